@@ -0,0 +1,151 @@
+#!/bin/bash
+# Benchmark for tree on synthetic filesystems, run by "make bench"
+#
+# For every shape and size gentree builds a tree once on tmpfs and once on disk, then times ./tree
+# with each flag combination warm (best of BENCH_RUNS) and cold (after dropping the page cache,
+# which needs root and means little on tmpfs; skipped otherwise), counts system calls per entry with strace when it is
+# installed, and runs GNU tree and find over the same tree when they are installed.
+#
+# Knobs, all optional:
+#	BENCH_SIZES	entry counts, default "10000 100000"; up to 10000000 works given the disk and time
+#	BENCH_SHAPES	default "wide deep mixed hidden"
+#	BENCH_TMPFS	a directory on tmpfs, default /dev/shm
+#	BENCH_DISK	a directory on disk, default /var/tmp
+#	BENCH_RUNS	warm runs per measurement, default 3
+#	BENCH_KEEP	set to 1 to keep the generated trees
+#
+# Output is one tab separated line per measurement:
+#	fs shape entries command flags warm_s cold_s syscalls_per_entry
+
+TREE=${TREE:-./tree}
+GENTREE=${GENTREE:-./gentree}
+SIZES=${BENCH_SIZES:-"10000 100000"}
+SHAPES=${BENCH_SHAPES:-"wide deep mixed hidden"}
+RUNS=${BENCH_RUNS:-3}
+
+# Flag combinations timed for ./tree, one per line
+FLAGS=(
+	""
+	"-a"
+	"-s"
+	"-s -a"
+	"-d"
+	"-L 3"
+	"-I dir_*"
+	"-P *7"
+	"-J"
+	"--ndjson"
+	"--du"
+	"--cache @CACHE@"
+)
+
+if [ ! -x "$TREE" ] || [ ! -x "$GENTREE" ]; then
+	echo "bench: build $TREE and $GENTREE first (make bench does)" >&2
+	exit 1
+fi
+
+# Optional tools, each measurement that needs a missing one prints "-" instead
+have() { command -v "$1" > /dev/null 2>&1; }
+CAN_DROP=0
+if [ -w /proc/sys/vm/drop_caches ]; then CAN_DROP=1; fi
+GNU_TREE=""
+if have tree && tree --version 2>/dev/null | grep -q "Steve Baker"; then GNU_TREE=$(command -v tree); fi
+have strace || echo "bench: strace not found, syscall counts skipped" >&2
+have find || echo "bench: find not found, skipped" >&2
+[ -n "$GNU_TREE" ] || echo "bench: GNU tree not found, skipped" >&2
+[ "$CAN_DROP" = 1 ] || echo "bench: cannot write /proc/sys/vm/drop_caches (not root), cold runs skipped" >&2
+
+FILESYSTEMS=""
+[ -d "${BENCH_TMPFS:-/dev/shm}" ] && FILESYSTEMS="tmpfs:${BENCH_TMPFS:-/dev/shm}"
+[ -d "${BENCH_DISK:-/var/tmp}" ] && FILESYSTEMS="$FILESYSTEMS disk:${BENCH_DISK:-/var/tmp}"
+
+
+# seconds CMD...: runs CMD with its output discarded and prints the wall clock time it took
+seconds() {
+	local start end
+	start=$(date +%s%N)
+	"$@" > /dev/null 2>&1
+	end=$(date +%s%N)
+	awk -v ns=$((end - start)) 'BEGIN { printf "%.4f", ns / 1e9 }'
+}
+
+# best CMD...: the fastest of RUNS warm runs, after one run to warm the caches
+best() {
+	local fastest="" t i
+	"$@" > /dev/null 2>&1
+	for ((i = 0; i < RUNS; i++)); do
+		t=$(seconds "$@")
+		if [ -z "$fastest" ] || awk -v a="$t" -v b="$fastest" 'BEGIN { exit !(a < b) }'; then fastest=$t; fi
+	done
+	echo "$fastest"
+}
+
+# cold CMD...: one run right after dropping the page, dentry and inode caches
+cold() {
+	if [ "$CAN_DROP" != 1 ]; then echo "-"; return; fi
+	sync
+	echo 3 > /proc/sys/vm/drop_caches
+	seconds "$@"
+}
+
+# per_entry ENTRIES CMD...: system calls the command makes per entry of the tree
+per_entry() {
+	local entries=$1 calls
+	shift
+	if ! have strace; then echo "-"; return; fi
+	calls=$(strace -f -c "$@" 2>&1 > /dev/null | awk '$NF == "total" { print $4 }')
+	if [ -z "$calls" ]; then echo "-"; return; fi
+	awk -v c="$calls" -v e="$entries" 'BEGIN { printf "%.2f", c / e }'
+}
+
+# measure FS SHAPE ENTRIES NAME FLAGS CMD...: prints one result line
+measure() {
+	local fs=$1 shape=$2 entries=$3 name=$4 flags=$5
+	shift 5
+	printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n" "$fs" "$shape" "$entries" "$name" "$flags" \
+		"$(best "$@")" "$(cold "$@")" "$(per_entry "$entries" "$@")"
+}
+
+
+printf "fs\tshape\tentries\tcommand\tflags\twarm_s\tcold_s\tsyscalls_per_entry\n"
+for fs_dir in $FILESYSTEMS; do
+	fs=${fs_dir%%:*}
+	base=${fs_dir#*:}/tree-bench.$$
+	mkdir -p "$base" || continue
+
+	for size in $SIZES; do
+		for shape in $SHAPES; do
+			dir=$base/$shape-$size
+			# gentree prints how many entries it made, the root comes on top
+			if ! made=$("$GENTREE" "$shape" "$size" "$dir"); then
+				echo "bench: could not generate $dir" >&2
+				rm -rf "$dir"
+				continue
+			fi
+			entries=$((made + 1))
+
+			for flags in "${FLAGS[@]}"; do
+				# --cache gets a fresh index, built by the warm-up run and reused after that
+				rm -f "$base/index"
+				args=${flags//@CACHE@/$base/index}
+				# Word splitting of $args is intended, set -f keeps the patterns away from the shell
+				set -f
+				measure "$fs" "$shape" "$entries" tree "${flags//@CACHE@/INDEX}" "$TREE" $args "$dir"
+				set +f
+			done
+			rm -f "$base/index"
+
+			if [ -n "$GNU_TREE" ]; then
+				measure "$fs" "$shape" "$entries" gnu-tree "-a -n --charset=ascii" "$GNU_TREE" -a -n --charset=ascii "$dir"
+				measure "$fs" "$shape" "$entries" gnu-tree "-a -s" "$GNU_TREE" -a -s -n --charset=ascii "$dir"
+			fi
+			if have find; then
+				measure "$fs" "$shape" "$entries" find "" find "$dir"
+				measure "$fs" "$shape" "$entries" find "-printf %s" find "$dir" -printf "%s\n"
+			fi
+
+			[ "${BENCH_KEEP:-0}" = 1 ] || rm -rf "$dir"
+		done
+	done
+	[ "${BENCH_KEEP:-0}" = 1 ] || rm -rf "$base"
+done
@@ -0,0 +1,88 @@
+#!/bin/bash
+# Checks for tree, run by "make check"
+#
+# --cache must never change what is listed: a tree holding an unreadable directory is listed without
+# the index, then twice with it (the first run writes the index, the second reads it), and all three
+# listings, errors included, must be the same. Root reads any directory, so as root tree runs as nobody
+#
+# -s --cache must show a file's new size after it is rewritten in place, which leaves its directory's
+# mtime as it was.
+#
+# A symlink given as the root is followed and listed like its target, and a root that cannot be listed
+# makes tree exit non-zero
+#
+# Knobs, all optional:
+#	CHECK_DIR	where the test tree goes, default /tmp
+#
+# Prints "check: ok" and exits 0, or the differing listings and exits 1
+
+TREE=${TREE:-./tree}
+
+if [ ! -x "$TREE" ]; then
+	echo "check: build $TREE first (make check does)" >&2
+	exit 1
+fi
+
+RUN=()
+if [ "$(id -u)" = 0 ]; then
+	if ! command -v setpriv > /dev/null 2>&1; then
+		echo "check: running as root and setpriv not found, skipped" >&2
+		exit 0
+	fi
+	RUN=(setpriv --reuid=nobody --regid=nogroup --clear-groups)
+fi
+
+base=$(mktemp -d "${CHECK_DIR:-/tmp}/tree-check.XXXXXX") || exit 1
+trap 'chmod -R u+rwx "$base"; rm -rf "$base"' EXIT
+
+# root/: a/x, b (unreadable, with a file in it), c/y, d
+mkdir -p "$base/root/a/x" "$base/root/b" "$base/root/c/y" "$base/root/d"
+touch "$base/root/a/f" "$base/root/b/g" "$base/root/c/y/h"
+chmod -R a+rwX "$base/root"
+chmod 000 "$base/root/b"
+# The index goes next to the tree, so base must be writable by whoever runs it
+tree_abs="$(cd "$(dirname "$TREE")" && pwd)/$(basename "$TREE")"
+index="$base/index"
+chmod 777 "$base"
+
+cd "$base" || exit 1
+"${RUN[@]}" "$tree_abs" root > plain 2>&1
+"${RUN[@]}" "$tree_abs" --cache "$index" root > first 2>&1
+"${RUN[@]}" "$tree_abs" --cache "$index" root > second 2>&1
+
+status=0
+for run in first second; do
+	if ! cmp -s plain "$run"; then
+		echo "check: --cache ($run run) lists an unreadable directory differently" >&2
+		diff plain "$run" >&2
+		status=1
+	fi
+done
+
+# Rewritten in place, the directory's mtime put back so the index still takes it as unchanged
+"${RUN[@]}" "$tree_abs" -s --cache "$index" root > /dev/null 2>&1
+stamp=$(stat -c %y root/c/y)
+printf 'rewritten\n' > root/c/y/h
+touch -d "$stamp" root/c/y
+"${RUN[@]}" "$tree_abs" -s root > plain 2>&1
+"${RUN[@]}" "$tree_abs" -s --cache "$index" root > sized 2>&1
+if ! cmp -s plain sized; then
+	echo "check: -s --cache shows a stale size for a file rewritten in place" >&2
+	diff plain sized >&2
+	status=1
+fi
+
+ln -s root link
+"${RUN[@]}" "$tree_abs" root > real 2>&1
+"${RUN[@]}" "$tree_abs" link > linked 2>&1
+if [ $? != 0 ] || ! diff real <(sed 's/^link$/root/' linked) >&2; then
+	echo "check: a symlink to a directory is not listed as the directory" >&2
+	status=1
+fi
+if "${RUN[@]}" "$tree_abs" root/b > /dev/null 2>&1; then
+	echo "check: an unreadable root exits 0" >&2
+	status=1
+fi
+
+[ "$status" = 0 ] && echo "check: ok"
+exit $status
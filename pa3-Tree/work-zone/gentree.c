@@ -0,0 +1,273 @@
+// openat, mkdirat and symlinkat are POSIX.1-2008, hidden by -std=c99 otherwise
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+// Synthetic trees for "make bench": gentree SHAPE COUNT DIR fills DIR (which must not exist yet) with
+// about COUNT entries, always the same ones for the same arguments
+//	wide	directories of WIDE_FANOUT files each, directly under DIR
+//	deep	chains of DEEP_DEPTH nested directories, a few files at every level
+//	mixed	random fan-out and depth, files of random sizes, some symlinks
+//	hidden	like mixed, but most names start with a '.'
+
+
+
+/* CONSTANTS */
+#define WIDE_FANOUT 10000	// files per directory of a wide tree
+#define DEEP_DEPTH 256		// directories per chain of a deep tree
+#define DEEP_FILES 3		// files next to each directory of a chain
+#define MIXED_MAX_DIRS 8	// subdirectories per directory of a mixed tree, at most
+#define MIXED_MAX_FILES 64	// files per directory of a mixed tree, at most
+#define MIXED_MAX_DEPTH 12
+#define MAX_FILE_SIZE 65536	// mixed files get a random size below this, as a hole so nothing is written
+#define HIDDEN_PERCENT 70	// share of names starting with '.' in a hidden tree
+#define NAME_SIZE 64
+
+#define SHAPE_WIDE 0
+#define SHAPE_DEEP 1
+#define SHAPE_MIXED 2
+#define SHAPE_HIDDEN 3
+
+
+
+/* STRUCTS */
+// A GenState holds what every step of the generator needs
+typedef struct {
+	int shape;		// 1. one of the SHAPE_ values
+	long target;		// 2. entries to create
+	long made;		// 3. entries created so far
+	uint64_t seed;		// 4. xorshift state, fixed so every run builds the same tree
+} GenState;
+
+
+
+/* PROGRAM FUNCTIONS */
+// Function steps the generator's random number sequence
+// Returns the next number
+uint64_t next_random(GenState* gen)
+{
+	gen->seed ^= gen->seed << 13;
+	gen->seed ^= gen->seed >> 7;
+	gen->seed ^= gen->seed << 17;
+	return gen->seed;
+}
+
+
+
+// Function writes the name of the i-th entry of a kind into name, with a leading '.' as the shape asks
+void make_name(GenState* gen, char* name, const char* kind, long i)
+{
+	int hidden = (gen->shape == SHAPE_HIDDEN && (int) (next_random(gen) % 100) < HIDDEN_PERCENT);
+
+	// Mixed case, so the case insensitive sort has something to do
+	snprintf(name, NAME_SIZE, "%s%s_%c%ld", hidden ? "." : "", kind, (i & 1) ? 'A' + (char) (i % 26) : 'a' + (char) (i % 26), i);
+}
+
+
+
+// Function creates a file in the directory dir_fd, of the given size
+// Returns 0 on success, -1 on error
+int make_file(GenState* gen, int dir_fd, const char* name, off_t size)
+{
+	int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd == -1)
+	{
+		perror(name);
+		return -1;
+	}
+	if (size > 0 && ftruncate(fd, size) != 0)
+		{ perror(name); }
+	close(fd);
+	gen->made++;
+	return 0;
+}
+
+
+
+// Function creates a directory in dir_fd and opens it
+// Returns its descriptor, -1 on error
+int make_dir(GenState* gen, int dir_fd, const char* name)
+{
+	if (mkdirat(dir_fd, name, 0755) != 0)
+	{
+		perror(name);
+		return -1;
+	}
+	gen->made++;
+
+	int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		{ perror(name); }
+	return fd;
+}
+
+
+
+// Function fills a wide tree: WIDE_FANOUT files per directory, all directories side by side
+void gen_wide(GenState* gen, int root_fd)
+{
+	char name[NAME_SIZE];
+
+	for (long dir = 0; gen->made < gen->target; dir++)
+	{
+		make_name(gen, name, "dir", dir);
+		int dir_fd = make_dir(gen, root_fd, name);
+		if (dir_fd == -1)
+			{ return; }
+
+		for (long i = 0; i < WIDE_FANOUT && gen->made < gen->target; i++)
+		{
+			make_name(gen, name, "file", i);
+			make_file(gen, dir_fd, name, 0);
+		}
+		close(dir_fd);
+	}
+}
+
+
+
+// Function fills a deep tree: chains of DEEP_DEPTH directories, each level holding DEEP_FILES files
+// The chain is walked down with descriptors only, so its paths may grow past PATH_MAX
+void gen_deep(GenState* gen, int root_fd)
+{
+	char name[NAME_SIZE];
+
+	for (long chain = 0; gen->made < gen->target; chain++)
+	{
+		make_name(gen, name, "chain", chain);
+		int dir_fd = make_dir(gen, root_fd, name);
+
+		for (int depth = 0; dir_fd != -1 && depth < DEEP_DEPTH && gen->made < gen->target; depth++)
+		{
+			for (long i = 0; i < DEEP_FILES && gen->made < gen->target; i++)
+			{
+				make_name(gen, name, "file", i);
+				make_file(gen, dir_fd, name, 0);
+			}
+
+			make_name(gen, name, "level", depth);
+			int next_fd = make_dir(gen, dir_fd, name);
+			close(dir_fd);
+			dir_fd = next_fd;
+		}
+		if (dir_fd != -1)
+			{ close(dir_fd); }
+		else
+			{ return; }
+	}
+}
+
+
+
+// Function fills one directory of a mixed or hidden tree and recurses into random subdirectories
+void gen_mixed(GenState* gen, int dir_fd, int depth)
+{
+	char name[NAME_SIZE];
+
+	long n_files = (long) (next_random(gen) % (MIXED_MAX_FILES + 1));
+	for (long i = 0; i < n_files && gen->made < gen->target; i++)
+	{
+		make_name(gen, name, "file", i);
+
+		// One in sixteen is a symlink to its predecessor, which may or may not exist
+		if (i > 0 && next_random(gen) % 16 == 0)
+		{
+			char target[NAME_SIZE];
+			make_name(gen, target, "file", i - 1);
+			if (symlinkat(target, dir_fd, name) == 0)
+				{ gen->made++; }
+			continue;
+		}
+		make_file(gen, dir_fd, name, (off_t) (next_random(gen) % MAX_FILE_SIZE));
+	}
+
+	if (depth >= MIXED_MAX_DEPTH)
+		{ return; }
+
+	// Shallow directories always branch, so the tree cannot die out before the target is reached
+	long n_dirs = (long) (next_random(gen) % (MIXED_MAX_DIRS + 1));
+	if (depth < 3 && n_dirs < 2)
+		{ n_dirs = 2; }
+	for (long i = 0; i < n_dirs && gen->made < gen->target; i++)
+	{
+		make_name(gen, name, "dir", i);
+		int sub_fd = make_dir(gen, dir_fd, name);
+		if (sub_fd == -1)
+			{ return; }
+		gen_mixed(gen, sub_fd, depth + 1);
+		close(sub_fd);
+	}
+}
+
+
+
+/* ------------------------------------------------------------ MAIN PROGRAM RUNS HERE ------------------------------------------------------------ */
+int main(int argc, char *argv[])
+{
+	if (argc != 4)
+	{
+		fprintf(stderr, "Usage: %s wide|deep|mixed|hidden COUNT DIR\n", argv[0]);
+		return 1;
+	}
+
+	GenState gen = { .target = atol(argv[2]), .seed = 0x9E3779B97F4A7C15ull };
+	if      (strcmp(argv[1], "wide") == 0)	{ gen.shape = SHAPE_WIDE; }
+	else if (strcmp(argv[1], "deep") == 0)	{ gen.shape = SHAPE_DEEP; }
+	else if (strcmp(argv[1], "mixed") == 0)	{ gen.shape = SHAPE_MIXED; }
+	else if (strcmp(argv[1], "hidden") == 0)	{ gen.shape = SHAPE_HIDDEN; }
+	else
+	{
+		fprintf(stderr, "gentree: unknown shape '%s'\n", argv[1]);
+		return 1;
+	}
+	if (gen.target <= 0)
+	{
+		fprintf(stderr, "gentree: COUNT must be positive\n");
+		return 1;
+	}
+
+	if (mkdir(argv[3], 0755) != 0)
+	{
+		perror(argv[3]);
+		return 1;
+	}
+	int root_fd = open(argv[3], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (root_fd == -1)
+	{
+		perror(argv[3]);
+		return 1;
+	}
+
+	if      (gen.shape == SHAPE_WIDE)	{ gen_wide(&gen, root_fd); }
+	else if (gen.shape == SHAPE_DEEP)	{ gen_deep(&gen, root_fd); }
+	else
+	{
+		// A mixed tree that stops branching early is simply started again beside itself
+		for (long part = 0; gen.made < gen.target; part++)
+		{
+			char name[NAME_SIZE];
+			long before = gen.made;
+			// The parts themselves are never hidden, or a hidden tree would show nothing at all without -a
+			snprintf(name, NAME_SIZE, "part_%ld", part);
+			int part_fd = make_dir(&gen, root_fd, name);
+			if (part_fd == -1)
+				{ break; }
+			gen_mixed(&gen, part_fd, 0);
+			close(part_fd);
+			if (gen.made == before)
+				{ break; }
+		}
+	}
+	close(root_fd);
+
+	printf("%ld\n", gen.made);
+	return 0;
+}
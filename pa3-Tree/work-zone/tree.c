@@ -1,10 +1,23 @@
 #include "tree.h"
 
-// Function compares two strings from the dirent struct
-// Returns 0 if the strings are the same
-int compare(const struct dirent** a, const struct dirent** b)
+
+
+// Number of ancestor directories whose descriptors may stay open during the walk, set in main
+static int fd_budget = 1;
+
+
+
+// Function compares two SortKeys for qsort: their case folded names, which orders like strcasecmp,
+// then the raw names so that names differing only in case always come out the same way
+// Returns 0 if the names are the same
+int compare(const void* a, const void* b)
 {
-	return strcasecmp( (*a)->d_name, (*b)->d_name );
+	const SortKey* key_a = a;
+	const SortKey* key_b = b;
+	int cmp = strcmp(key_a->key, key_b->key);
+	if (cmp != 0)
+		{ return cmp; }
+	return strcmp(key_a->name, key_b->name);
 }
 
 
@@ -20,121 +33,897 @@ void echo_args(int a_flag, int s_flag, char* path)
 
 
 
-// Function that recursively goes through the directories, sorts them in alphabetical order, then prints the names in a tree-like structure
-void tree_recurse(int s_flag, int a_flag, int level, int* dir_count, int* file_count, char* path)
+// Function opens the directory at rel_path, relative to the directory open at anchor_fd. Unless follow is set,
+// a symlink as its last component is not followed: only the root given on the command line may be one
+// Returns the new descriptor, -1 on error
+int open_dir_at(int anchor_fd, char* rel_path, int follow)
+{
+	int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+	int fd = openat(anchor_fd, rel_path, follow ? flags : flags | O_NOFOLLOW);
+	if (fd != -1 || errno != ENAMETOOLONG)
+		{ return fd; }
+
+	// Past the ancestors we keep open the relative path can outgrow PATH_MAX,
+	// so resolve it one component at a time, never holding more than two descriptors
+	char* copy = strdup(rel_path);
+	if (copy == NULL)
+		{ return -1; }
+
+	int cur_fd = anchor_fd;
+	char* save;
+	for (char* part = strtok_r(copy, "/", &save); part != NULL; part = strtok_r(NULL, "/", &save))
+	{
+		int last = (save[strspn(save, "/")] == '\0');
+		fd = openat(cur_fd, part, (follow || !last) ? flags : flags | O_NOFOLLOW);
+		if (cur_fd != anchor_fd)
+			{ close(cur_fd); }
+		if (fd == -1)
+			{ break; }
+		cur_fd = fd;
+	}
+	free(copy);
+	return fd;
+}
+
+
+
+// Function fills in the mode and size of the entries listed in todo, one fstatat per entry
+// A mode of 0 marks an entry whose stat failed
+void stat_entries(int dir_fd, TreeEntry* entries, int* todo, int n_todo)
 {
-	DIR* p_dir;
-	struct dirent* entry;
 	struct stat statbuf;
-	struct dirent** name_list;
-	int num_entries;
 
-	// If the opened directory from "path" is NULL, then print an error.
-	// The opened directory should never yield an error due to main.
-	if ((p_dir = opendir(path)) == NULL)
+	for (int i = 0; i < n_todo; i++)
 	{
-		// Prints if opendir is successful or not
-		perror("opendir");
-		return;
+		TreeEntry* entry = &entries[todo[i]];
+
+		// Get the stats of the entry with no Symbolic links, relative to the open directory
+		if (fstatat(dir_fd, entry->name, &statbuf, AT_SYMLINK_NOFOLLOW) == -1)
+		{
+			perror("fstatat");
+			entry->mode = 0;
+			continue;
+		}
+		entry->mode = statbuf.st_mode;
+		entry->size = statbuf.st_size;
+		entry->mtime = statbuf.st_mtim.tv_sec;
+		entry->mtime_nsec = statbuf.st_mtim.tv_nsec;
+		entry->blocks = statbuf.st_blocks;
+		entry->dev = statbuf.st_dev;
+		entry->ino = statbuf.st_ino;
+		entry->nlink = statbuf.st_nlink;
+	}
+}
+
+
+
+// Function splits a '|' separated list of wildcard patterns once, noting which ones are plain names
+// Returns 0 on success, -1 on allocation failure
+int pattern_compile(PatternList* list, const char* text)
+{
+	list->count = 1;
+	for (const char* c = text; *c != '\0'; c++)
+	{
+		if (*c == '|')	{ list->count++; }
+	}
+
+	list->text = strdup(text);
+	list->globs = malloc(sizeof(char*) * list->count);
+	list->literal = malloc(sizeof(int) * list->count);
+	if (list->text == NULL || list->globs == NULL || list->literal == NULL)
+	{
+		perror("malloc");
+		return -1;
+	}
+
+	// Cut the copy at every '|' so each alternative is its own string
+	char* start = list->text;
+	for (int i = 0; i < list->count; i++)
+	{
+		char* end = strchr(start, '|');
+		if (end != NULL)	{ *end = '\0'; }
+		list->globs[i] = start;
+		list->literal[i] = (strpbrk(start, "*?[\\") == NULL);
+		start = end + 1;
+	}
+	return 0;
+}
+
+
+
+// Function checks a name against each alternative of a compiled list
+// Returns 1 on a match, 0 otherwise
+int pattern_match(PatternList* list, const char* name)
+{
+	for (int i = 0; i < list->count; i++)
+	{
+		if (list->literal[i] ? strcmp(list->globs[i], name) == 0 : fnmatch(list->globs[i], name, 0) == 0)
+			{ return 1; }
+	}
+	return 0;
+}
+
+
+
+// Function decides whether an entry belongs in the listing; a mode of 0 means the type is not known yet
+// and the type based switches are left for when it is
+// Returns 1 to keep the entry, 0 to drop it
+int keep_entry(TreeWalk* walk, const char* name, mode_t mode)
+{
+	// Skip "." and ".." to prevent infinite loop
+	// Skip any hidden files unless a_flag is set
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || (walk->a_flag == A_FLAG_OFF && name[0] == '.'))
+		{ return 0; }
+
+	// -I drops files and whole directories alike, so an ignored directory is never opened
+	if (walk->ignore.count > 0 && pattern_match(&walk->ignore, name))
+		{ return 0; }
+
+	if (mode == 0 || S_ISDIR(mode))
+		{ return 1; }
+
+	// -d and -P only ever drop non-directories, we still descend to find matches deeper down
+	if (walk->dirs_only)
+		{ return 0; }
+	if (walk->match.count > 0 && !pattern_match(&walk->match, name))
+		{ return 0; }
+	return 1;
+}
+
+
+
+// Function finds the listing arena for a depth, creating it on first use
+// Returns the arena, NULL on allocation failure
+DirArena* walk_arena(TreeWalk* walk, int level)
+{
+	if (level >= walk->n_arenas)
+	{
+		int n = walk->n_arenas ? walk->n_arenas : INITIAL_ENTRIES;
+		while (n <= level)
+			{ n *= 2; }
+		DirArena* grown = realloc(walk->arenas, sizeof(DirArena) * n);
+		if (grown == NULL)
+		{
+			perror("realloc");
+			return NULL;
+		}
+		memset(grown + walk->n_arenas, 0, sizeof(DirArena) * (n - walk->n_arenas));
+		walk->arenas = grown;
+		walk->n_arenas = n;
+	}
+	return &walk->arenas[level];
+}
+
+
+
+// Function makes sure an arena's byte buffer holds at least bytes
+// Returns 0 on success, -1 on allocation failure
+int arena_reserve(DirArena* arena, size_t bytes)
+{
+	if (bytes <= arena->cap)
+		{ return 0; }
+
+	size_t cap = arena->cap ? arena->cap : ARENA_SIZE;
+	while (cap < bytes)
+		{ cap *= 2; }
+	char* grown = realloc(arena->buf, cap);
+	if (grown == NULL)
+	{
+		perror("realloc");
+		return -1;
+	}
+	arena->buf = grown;
+	arena->cap = cap;
+	return 0;
+}
+
+
+
+// Function makes sure an arena's entry, result and key arrays hold at least n elements
+// Returns 0 on success, -1 on allocation failure
+int arena_entries(DirArena* arena, int n)
+{
+	if (n <= arena->entries_cap)
+		{ return 0; }
+
+	int cap = arena->entries_cap ? arena->entries_cap : INITIAL_ENTRIES;
+	while (cap < n)
+		{ cap *= 2; }
+	TreeEntry* raw = realloc(arena->raw, sizeof(TreeEntry) * cap);
+	if (raw != NULL)	{ arena->raw = raw; }
+	TreeEntry* sorted = realloc(arena->sorted, sizeof(TreeEntry) * cap);
+	if (sorted != NULL)	{ arena->sorted = sorted; }
+	SortKey* keys = realloc(arena->keys, sizeof(SortKey) * cap);
+	if (keys != NULL)	{ arena->keys = keys; }
+
+	if (raw == NULL || sorted == NULL || keys == NULL)
+	{
+		perror("realloc");
+		return -1;
+	}
+	arena->entries_cap = cap;
+	return 0;
+}
+
+
+
+// Function frees the listing arenas of every depth
+void arenas_free(TreeWalk* walk)
+{
+	for (int i = 0; i < walk->n_arenas; i++)
+	{
+		free(walk->arenas[i].buf);
+		free(walk->arenas[i].raw);
+		free(walk->arenas[i].sorted);
+		free(walk->arenas[i].keys);
+	}
+	free(walk->arenas);
+	walk->arenas = NULL;
+	walk->n_arenas = 0;
+}
+
+
+
+// Function reads every entry of an open directory with getdents64 into the arena for this depth, taking
+// the file type from d_type where possible and stat'ing relative to the directory's descriptor only when
+// sizes are needed or the type is unknown. Names stay where the kernel put them, so listing a directory
+// costs no allocation per entry once the arena has grown to fit it
+// Returns the number of entries in the sorted array *entries, valid until the next listing at this depth, -1 on error
+int read_entries(TreeWalk* walk, int level, int dir_fd, TreeEntry** entries)
+{
+	DirArena* arena = walk_arena(walk, level);
+	int need_stat = (walk->s_flag == S_FLAG_ON || walk->output == OUTPUT_NDJSON || walk->cache != NULL);
+	size_t used = 0;
+	long got;
+
+	if (arena == NULL || arena_reserve(arena, ARENA_SIZE) != 0)
+		{ return -1; }
+
+	// Pull in the whole directory, growing the arena whenever less than a read's worth is left
+	for (;;)
+	{
+		if (arena->cap - used < DIRENT_READ && arena_reserve(arena, arena->cap * 2) != 0)
+			{ return -1; }
+		got = syscall(SYS_getdents64, dir_fd, arena->buf + used, arena->cap - used);
+		if (got <= 0)
+			{ break; }
+		used += got;
+	}
+	if (got < 0)
+	{
+		perror("getdents64");
+		return -1;
+	}
+
+	// Count the records to size the entry arrays once, and the bytes the folded keys will need
+	int n_records = 0;
+	size_t key_bytes = 0;
+	for (size_t at = 0; at < used; at += ((LinuxDirent*) (arena->buf + at))->d_reclen)
+	{
+		n_records++;
+		key_bytes += strlen(((LinuxDirent*) (arena->buf + at))->d_name) + 1;
+	}
+	if (arena_entries(arena, n_records) != 0 || arena_reserve(arena, used + key_bytes) != 0)
+		{ return -1; }
+
+	int n = 0;
+	for (size_t at = 0; at < used; at += ((LinuxDirent*) (arena->buf + at))->d_reclen)
+	{
+		LinuxDirent* entry = (LinuxDirent*) (arena->buf + at);
+
+		// DT_UNKNOWN means the filesystem does not fill in d_type, so the type has to come from a stat
+		mode_t mode = (entry->d_type == DT_UNKNOWN) ? 0 : DTTOIF(entry->d_type);
+
+		// Skip "." and ".." to prevent infinite loop
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			{ continue; }
+
+		// Filter before anything is stat'ed or opened; the --cache index still wants the complete
+		// listing, so there filtered entries are kept but not shown
+		int shown = keep_entry(walk, entry->d_name, mode);
+		if (!shown && walk->cache == NULL)
+			{ continue; }
+
+		TreeEntry* raw = &arena->raw[n++];
+		memset(raw, 0, sizeof(TreeEntry));
+		raw->name = entry->d_name;
+		raw->mode = mode;
+		raw->nlink = 1;
+		raw->shown = shown;
+	}
+
+	// Collect the entries that still need a stat: all of them for sizes and records, otherwise only
+	// unknown types. The key slots double as the list, they are not needed until after
+	int* todo = (int*) arena->keys;
+	int n_todo = 0;
+	for (int i = 0; i < n; i++)
+	{
+		if (need_stat || arena->raw[i].mode == 0)
+			{ todo[n_todo++] = i; }
+	}
+
+	if (n_todo > 0)
+	{
+#ifdef TREE_IO_URING
+		// Hand the whole batch to io_uring, falling back to fstatat if the ring is unavailable
+		if (uring_stat_entries(dir_fd, arena->raw, todo, n_todo) != 0)
+#endif
+		stat_entries(dir_fd, arena->raw, todo, n_todo);
+	}
+
+	// Drop the entries we could not stat, and those the type based switches rule out now that their
+	// type is known. Fold each survivor's name to lower case once, behind the records, as its sort key
+	char* key = arena->buf + used;
+	int kept = 0;
+	for (int i = 0; i < n; i++)
+	{
+		TreeEntry* entry = &arena->raw[i];
+		if (entry->mode != 0 && entry->shown)
+			{ entry->shown = keep_entry(walk, entry->name, entry->mode); }
+		if (entry->mode == 0 || (!entry->shown && walk->cache == NULL))
+			{ continue; }
+
+		arena->keys[kept].key = key;
+		arena->keys[kept].name = entry->name;
+		arena->keys[kept].index = i;
+		for (const char* c = entry->name; ; c++, key++)
+		{
+			*key = (char) tolower((unsigned char) *c);
+			if (*c == '\0')
+				{ break; }
+		}
+		key++;
+		kept++;
+	}
+
+	// Sort the entries alphabetically by sorting the keys, then gather the entries in that order
+	qsort(arena->keys, kept, sizeof(SortKey), compare);
+	for (int i = 0; i < kept; i++)
+		{ arena->sorted[i] = arena->raw[arena->keys[i].index]; }
+
+	*entries = arena->sorted;
+	return kept;
+}
+
+
+
+// Function sets up a writer that gathers output for fd in one large buffer
+// Returns 0 on success, -1 if the buffer could not be allocated
+int out_init(OutBuf* out, int fd)
+{
+	out->fd = fd;
+	out->len = 0;
+	out->cap = OUT_BUF_SIZE;
+	out->holds = 0;
+	out->buf = malloc(out->cap);
+	if (out->buf == NULL)
+	{
+		perror("malloc");
+		return -1;
 	}
+	return 0;
+}
 
-	// Change to the current directory to prevent the need of absolute paths
-	// chdir returns 0 if successful, else -1
-	if (chdir(path) != 0)
+
+
+// Function writes everything pending to the descriptor, retrying short writes
+void out_flush(OutBuf* out)
+{
+	size_t done = 0;
+	while (done < out->len)
 	{
-		perror("chdir");
-		closedir(p_dir);
+		ssize_t n = write(out->fd, out->buf + done, out->len - done);
+		if (n == -1)
+		{
+			if (errno == EINTR)
+				{ continue; }
+			perror("write");
+			break;
+		}
+		done += n;
+	}
+	out->len = 0;
+}
+
+
+
+// Function makes room for len more bytes: by flushing, or by growing the buffer while a hold is open
+// Returns 0 when the room is there, -1 if the caller has to write around the buffer
+int out_reserve(OutBuf* out, size_t len)
+{
+	if (len < out->cap - out->len)
+		{ return 0; }
+
+	if (out->holds == 0)
+	{
+		out_flush(out);
+		return (len < out->cap) ? 0 : -1;
+	}
+
+	// Held bytes may still be patched, so they cannot be written out yet
+	size_t cap = out->cap * 2;
+	while (cap - out->len <= len)
+		{ cap *= 2; }
+	char* grown = realloc(out->buf, cap);
+	if (grown == NULL)
+	{
+		perror("realloc");
+		return -1;
+	}
+	out->buf = grown;
+	out->cap = cap;
+	return 0;
+}
+
+
+
+// Function appends len bytes of data to the writer, flushing when the buffer fills up
+void out_write(OutBuf* out, const char* data, size_t len)
+{
+	if (out_reserve(out, len) == 0)
+	{
+		memcpy(out->buf + out->len, data, len);
+		out->len += len;
 		return;
 	}
 
-	// Read all entries into a list of names
-	num_entries = scandir(".", &name_list, NULL, compare);
-	// scandir scans the directory ".", sorted using compare function, and collected in &namelist.
-	// returns # of directory entries, -1 on error
-	if (num_entries < 0)
+	// Anything the size of the whole buffer goes straight out
+	ssize_t n;
+	while (len > 0 && ((n = write(out->fd, data, len)) > 0 || errno == EINTR))
 	{
-		perror("scandir");
-		closedir(p_dir);
+		if (n > 0)	{ data += n; len -= n; }
+	}
+}
+
+
+
+// Function appends a null terminated string to the writer
+void out_puts(OutBuf* out, const char* str)
+{
+	out_write(out, str, strlen(str));
+}
+
+
+
+// Function formats straight into the writer's buffer, flushing first if the result does not fit
+void out_printf(OutBuf* out, const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int n = vsnprintf(out->buf + out->len, out->cap - out->len, format, args);
+	va_end(args);
+
+	if (n < 0 || (size_t) n < out->cap - out->len)
+	{
+		if (n > 0)	{ out->len += n; }
 		return;
 	}
 
-	// Iterated over the sorted entries
-	for (int i = 0; i < num_entries; i++)
+	// It did not fit: make room and format again
+	if (out_reserve(out, n) != 0)
+		{ return; }
+	va_start(args, format);
+	vsnprintf(out->buf + out->len, out->cap - out->len, format, args);
+	va_end(args);
+	out->len += n;
+}
+
+
+
+// Function appends str with the characters JSON does not allow inside a string escaped
+// The surrounding quotes are left to the caller
+void out_json_escape(OutBuf* out, const char* str)
+{
+	const char* run = str;
+	for ( ; *str != '\0'; str++)
 	{
-		entry = name_list[i];
+		unsigned char c = (unsigned char) *str;
+		if (c >= 0x20 && c != '"' && c != '\\')
+			{ continue; }
 
-		// Skip "." and ".." to prevent infinite loop
-		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 )
+		// Copy the plain run before this character in one go
+		out_write(out, run, str - run);
+		if (c == '"')		{ out_puts(out, "\\\""); }
+		else if (c == '\\')	{ out_puts(out, "\\\\"); }
+		else if (c == '\n')	{ out_puts(out, "\\n"); }
+		else if (c == '\t')	{ out_puts(out, "\\t"); }
+		else			{ out_printf(out, "\\u%04x", c); }
+		run = str + 1;
+	}
+	out_write(out, run, str - run);
+}
+
+
+
+// Function reserves width blank bytes in the writer to be filled in later by out_patch
+// Nothing is flushed until the matching out_patch, so the returned offset stays valid
+// Returns the offset of the reserved bytes
+size_t out_hold(OutBuf* out, size_t width)
+{
+	out->holds++;
+	out_reserve(out, width);
+	size_t offset = out->len;
+	memset(out->buf + offset, ' ', width);
+	out->len += width;
+	return offset;
+}
+
+
+
+// Function fills in the width bytes held at offset with text, right aligned,
+// widening the hole if text is longer, then releases the hold
+void out_patch(OutBuf* out, size_t offset, size_t width, const char* text)
+{
+	size_t text_len = strlen(text);
+
+	if (text_len > width && out_reserve(out, text_len - width) == 0)
+	{
+		// Shift everything after the hole to make it wide enough
+		memmove(out->buf + offset + text_len, out->buf + offset + width, out->len - offset - width);
+		out->len += text_len - width;
+		width = text_len;
+	}
+	if (text_len <= width)
+		{ memcpy(out->buf + offset + width - text_len, text, text_len); }
+	out->holds--;
+}
+
+
+
+// Function adds (dev, ino) to the set
+// Returns 1 if it was already there, 0 if it was added (or could not be, in which case it counts again)
+int inode_seen(InodeSet* set, dev_t dev, ino_t ino)
+{
+	// Keep the load under one half so probe runs stay short
+	if ((set->size + 1) * 2 > set->cap)
+	{
+		size_t cap = set->cap ? set->cap * 2 : INITIAL_INODES;
+		dev_t* devs = calloc(cap, sizeof(dev_t));
+		ino_t* inos = calloc(cap, sizeof(ino_t));
+		if (devs == NULL || inos == NULL)
 		{
-			free(entry);
-			continue;
+			perror("calloc");
+			free(devs);
+			free(inos);
+			return 0;
 		}
+		for (size_t i = 0; i < set->cap; i++)
+		{
+			if (set->inos[i] == 0)
+				{ continue; }
+			size_t j = (size_t) (set->inos[i] * 0x9E3779B97F4A7C15ULL ^ set->devs[i]) & (cap - 1);
+			while (inos[j] != 0)
+				{ j = (j + 1) & (cap - 1); }
+			devs[j] = set->devs[i];
+			inos[j] = set->inos[i];
+		}
+		free(set->devs);
+		free(set->inos);
+		set->devs = devs;
+		set->inos = inos;
+		set->cap = cap;
+	}
+
+	// Linear probing from a multiplicative hash of the inode number
+	size_t i = (size_t) (ino * 0x9E3779B97F4A7C15ULL ^ dev) & (set->cap - 1);
+	while (set->inos[i] != 0)
+	{
+		if (set->inos[i] == ino && set->devs[i] == dev)
+			{ return 1; }
+		i = (i + 1) & (set->cap - 1);
+	}
+	set->devs[i] = dev;
+	set->inos[i] = ino;
+	set->size++;
+	return 0;
+}
+
+
+
+// Function adds an entry's sizes to a --du total, counting each hard linked file only once
+void du_add(TreeWalk* walk, DuSize* total, TreeEntry* entry)
+{
+	if (!S_ISDIR(entry->mode) && entry->nlink > 1 && inode_seen(&walk->inodes, entry->dev, entry->ino))
+		{ return; }
+	total->apparent += entry->size;
+	total->allocated += (long long) entry->blocks * 512;
+}
+
+
+
+// Function names the file type in a mode for the JSON formats
+// Returns a string constant
+const char* type_name(mode_t mode)
+{
+	if (S_ISDIR(mode))	{ return "directory"; }
+	if (S_ISLNK(mode))	{ return "link"; }
+	if (S_ISFIFO(mode))	{ return "fifo"; }
+	if (S_ISSOCK(mode))	{ return "socket"; }
+	if (S_ISCHR(mode))	{ return "char"; }
+	if (S_ISBLK(mode))	{ return "block"; }
+	return "file";
+}
+
+
 
-		// Skip any hidden files unless a_flag is set
-		// The inodes "." and ".." count as hidden, so they must be passed over to avoid infinite looping
-		// If "-a" IS on & hidden file IS present, display its information accordingly
-		if (a_flag == A_FLAG_OFF && entry->d_name[0] == '.')
+// Function appends "/name" to the walk's path, growing the buffer as needed
+// Returns 0 on success, -1 on allocation failure
+int path_push(TreeWalk* walk, const char* name)
+{
+	size_t name_len = strlen(name);
+	int need_sep = (walk->path_len > 0 && walk->path[walk->path_len - 1] != '/');
+
+	if (walk->path_len + need_sep + name_len + 1 > walk->path_cap)
+	{
+		size_t cap = walk->path_cap * 2;
+		while (cap < walk->path_len + need_sep + name_len + 1)
+			{ cap *= 2; }
+
+		char* grown = realloc(walk->path, cap);
+		if (grown == NULL)
 		{
-			free(entry);
-			continue;
+			perror("realloc");
+			return -1;
 		}
+		walk->path = grown;
+		walk->path_cap = cap;
+	}
+
+	if (need_sep)
+		{ walk->path[walk->path_len++] = '/'; }
+	memcpy(walk->path + walk->path_len, name, name_len + 1);
+	walk->path_len += name_len;
+	return 0;
+}
 
-		// Get the stats of the entry with no Symbolic links for name, mode, and size
-		if (lstat(entry->d_name, &statbuf) == -1)
+
+
+// Function prints one entry in the walk's output format; walk->path already ends in the entry's name
+// With --du a directory's size is not known until its contents have been walked, so its size is
+// left to print_dir_end: in ASCII through a held column whose offset is returned, otherwise returns 0
+size_t print_entry(TreeWalk* walk, int level, TreeEntry* entry, int is_last)
+{
+	OutBuf* out = &walk->out;
+	int rolled_up = (walk->du_flag && S_ISDIR(entry->mode));
+	size_t held = 0;
+
+	if (walk->output == OUTPUT_NDJSON)
+	{
+		// A directory's record comes after its contents with --du
+		if (rolled_up)
+			{ return 0; }
+
+		// {"path":"tmp/bob","depth":1,"type":"file","size":21,"mtime":1700000000}
+		out_puts(out, "{\"path\":\"");
+		out_json_escape(out, walk->path);
+		out_printf(out, "\",\"depth\":%d,\"type\":\"%s\",\"size\":%lld,\"mtime\":%lld}\n",
+			level + 1, type_name(entry->mode), (long long) entry->size, (long long) entry->mtime);
+		return 0;
+	}
+
+	if (walk->output == OUTPUT_JSON)
+	{
+		// Indented like tree -J, two spaces per level below the root's entry
+		out_printf(out, "%*s{\"type\":\"%s\",\"name\":\"", 2 * (level + 2), "", type_name(entry->mode));
+		out_json_escape(out, entry->name);
+		out_puts(out, "\"");
+		if (walk->s_flag == S_FLAG_ON && !rolled_up)
+			{ out_printf(out, ",\"size\":%lld", (long long) entry->size); }
+
+		// A directory stays open until print_dir_end closes its contents
+		if (S_ISDIR(entry->mode))
+			{ out_puts(out, ",\"contents\":[\n"); }
+		else	{ out_puts(out, is_last ? "}\n" : "},\n"); }
+		return 0;
+	}
+
+	// Display the entry in appropriate format
+	for (int j = 0; j < level; j++)
+		{ out_write(out, "|   ", 4); }
+
+	// If the current entry is the last in the list, print an ending character
+	// Otherwise, print with an entry character
+	out_write(out, is_last ? "`-- " : "|-- ", 4);
+
+	// Check the s_flag for displaying the size of the file
+	if (rolled_up)
+	{
+		out_write(out, "[", 1);
+		held = out_hold(out, SIZE_WIDTH);
+		out_write(out, "]  ", 3);
+	}
+	else if (walk->s_flag == S_FLAG_ON)
+		{ out_printf(out, "[%11ld]  ", (long) entry->size); }
+	out_puts(out, entry->name);
+	out_write(out, "\n", 1);
+	return held;
+}
+
+
+
+// Function finishes a directory after its contents: closes the nested JSON contents and,
+// with --du, prints the rolled up total where print_entry left room for it
+void print_dir_end(TreeWalk* walk, int level, TreeEntry* entry, int is_last, DuSize* total, size_t held)
+{
+	OutBuf* out = &walk->out;
+
+	if (walk->output == OUTPUT_JSON)
+	{
+		out_printf(out, "%*s]", 2 * (level + 2), "");
+		if (walk->du_flag)
+			{ out_printf(out, ",\"size\":%lld,\"disk\":%lld", total->apparent, total->allocated); }
+		out_puts(out, is_last ? "}\n" : "},\n");
+	}
+	else if (walk->du_flag && walk->output == OUTPUT_NDJSON)
+	{
+		out_puts(out, "{\"path\":\"");
+		out_json_escape(out, walk->path);
+		out_printf(out, "\",\"depth\":%d,\"type\":\"directory\",\"size\":%lld,\"disk\":%lld,\"mtime\":%lld}\n",
+			level + 1, total->apparent, total->allocated, (long long) entry->mtime);
+	}
+	else if (walk->du_flag)
+	{
+		char text[32];
+		snprintf(text, sizeof(text), "%lld", total->apparent);
+		out_patch(out, held, SIZE_WIDTH, text);
+	}
+}
+
+
+
+// Function that recursively goes through the directories, sorts them in alphabetical order, then prints the names in a tree-like structure
+// The directory is walk->path; it is opened through walk->path + anchor_off relative to anchor_fd,
+// the nearest ancestor still open, so the working directory never changes
+// With --du, the sizes of everything below are added to *total
+// With --cache, self is the directory's own entry: an unchanged directory is listed from the old index
+// without being opened, and every directory's listing goes into the new index, even one that failed to list
+// Returns 0, or -1 if the directory itself could not be listed
+int tree_recurse(TreeWalk* walk, int level, int anchor_fd, size_t anchor_off, DuSize* total, TreeEntry* self)
+{
+	TreeEntry* entries;
+	int num_entries;
+	int dir_fd = -1;
+	off_t cache_off = 0;
+
+	if (walk->cache != NULL && cache_fresh(walk->cache, self->cached, self))
+	{
+		// Unchanged since the last run: take the listing from the index
+		if ((num_entries = cache_entries(walk->cache, self->cached, walk_arena(walk, level), &entries)) < 0)
 		{
-			perror("lstat");
-			free(entry);
-			continue;
+			cache_skip_dir(walk->cache, self);
+			return -1;
+		}
+
+		// The subdirectories need a fresh stat, their mtimes decide whether they are reused in turn. A file
+		// rewritten in place leaves its directory's mtime alone, so when sizes are shown the files get one too
+		int sizes = (walk->s_flag == S_FLAG_ON || walk->du_flag || walk->output == OUTPUT_NDJSON);
+		size_t parent_len = walk->path_len;
+		struct stat statbuf;
+		for (int i = 0; i < num_entries; i++)
+		{
+			TreeEntry* entry = &entries[i];
+			if ((!S_ISDIR(entry->mode) && !sizes) || path_push(walk, entry->name) != 0)
+				{ continue; }
+			if (fstatat(anchor_fd, walk->path + anchor_off, &statbuf, AT_SYMLINK_NOFOLLOW) == 0)
+			{
+				entry->mode = statbuf.st_mode;
+				entry->size = statbuf.st_size;
+				entry->mtime = statbuf.st_mtim.tv_sec;
+				entry->mtime_nsec = statbuf.st_mtim.tv_nsec;
+				entry->blocks = statbuf.st_blocks;
+			}
+			walk->path_len = parent_len;
+			walk->path[parent_len] = '\0';
+		}
+		for (int i = 0; i < num_entries; i++)
+			{ entries[i].shown = keep_entry(walk, entries[i].name, entries[i].mode); }
+	}
+	else
+	{
+		// Open the directory exactly once; everything below works off this descriptor
+		if ((dir_fd = open_dir_at(anchor_fd, walk->path + anchor_off, level == 0)) == -1)
+		{
+			perror("openat");
+			if (walk->cache != NULL)
+				{ cache_skip_dir(walk->cache, self); }
+			return -1;
+		}
+
+		// Read and stat all entries while the directory is open
+		if ((num_entries = read_entries(walk, level, dir_fd, &entries)) < 0)
+		{
+			close(dir_fd);
+			if (walk->cache != NULL)
+				{ cache_skip_dir(walk->cache, self); }
+			return -1;
+		}
+
+		// Keep this directory open as the anchor for its children while we are within the budget,
+		// otherwise release it now so that very deep trees cannot run us out of descriptors
+		if (level >= fd_budget)
+		{
+			close(dir_fd);
+			dir_fd = -1;
 		}
 
-		// Display the entry in appropriate format
-		for (int i = 0; i < level; i++)
-			{ printf("|   "); }
+		// Line the new listing up with what the index knew about it
+		if (walk->cache != NULL)
+			{ cache_match(walk->cache, self->cached, entries, num_entries); }
+	}
+
+	if (walk->cache != NULL)
+		{ cache_off = cache_begin_dir(walk->cache, self, self->name, num_entries); }
 
-		// If the current entry is the last in the list, print an ending character
-		if (i == num_entries - 1)
-			{ printf("`-- "); }
-		// Otherwise, print with an entry character
-		else	{ printf("|-- "); }
+	// The last entry shown gets the ending character
+	int last_shown = num_entries - 1;
+	while (last_shown >= 0 && !entries[last_shown].shown)
+		{ last_shown--; }
 
-		// Check the s_flag for displaying the size of the file
-		if (s_flag == S_FLAG_ON)
-			{ printf("[%11ld]  %s\n", statbuf.st_size, entry->d_name); }
-		else 	{ printf("%s\n", entry->d_name); }
+	// Iterated over the sorted entries
+	size_t parent_len = walk->path_len;
+	for (int i = 0; i < num_entries; i++)
+	{
+		TreeEntry* entry = &entries[i];
+		int is_last = (i == last_shown);
+
+		// Entries that are filtered out only go into the index
+		if (!entry->shown || path_push(walk, entry->name) != 0)
+		{
+			if (walk->cache != NULL)
+				{ cache_put(walk->cache, entry); }
+			continue;
+		}
+		size_t held = print_entry(walk, level, entry, is_last);
 
 		// If it is a directory
-		if (S_ISDIR(statbuf.st_mode))
+		if (S_ISDIR(entry->mode))
 		{
 			// Increment directory number count
-			(*dir_count)++;
+			walk->dir_count++;
 
-			// Recurse into the directory
-			tree_recurse(s_flag, a_flag, level + 1, dir_count, file_count, entry->d_name);
+			// The directory's own size starts its subtree's total
+			DuSize subtree = { 0, 0 };
+			if (walk->du_flag)
+				{ du_add(walk, &subtree, entry); }
 
-			// Change back to the parent directory
-			if (chdir("..") != 0)
-			{
-				perror("chdir");
-				closedir(p_dir);
-				return;
-			}
+			// Recurse into the directory, relative to ourselves if we stayed open,
+			// or relative to our own anchor through the longer path; past -L it is not opened at all
+			int descend = (walk->max_depth == 0 || level + 1 < walk->max_depth);
+			if (descend && dir_fd != -1)
+				{ tree_recurse(walk, level + 1, dir_fd, walk->path_len - strlen(entry->name), &subtree, entry); }
+			else if (descend)
+				{ tree_recurse(walk, level + 1, anchor_fd, anchor_off, &subtree, entry); }
+			else if (walk->cache != NULL)
+				{ cache_put(walk->cache, entry); }
+
+			print_dir_end(walk, level, entry, is_last, &subtree, held);
+			total->apparent += subtree.apparent;
+			total->allocated += subtree.allocated;
 		}
 		// Otherwise it is a file
 		else
 		{
 			// Increment file number count
-			(*file_count)++;
+			walk->file_count++;
+			if (walk->du_flag)
+				{ du_add(walk, total, entry); }
+			if (walk->cache != NULL)
+				{ cache_put(walk->cache, entry); }
 		}
 
-		// Free the entry when we're done with the recursion and printing
-		free(entry);
+		// Drop the name from the path again when we're done with the recursion and printing;
+		// the entries themselves live in this depth's arena and are reused by the next directory here
+		walk->path_len = parent_len;
+		walk->path[parent_len] = '\0';
 	}
-	// Free our malloc'd namelist array
-	free(name_list);
 
-	// Close the directory
-	closedir(p_dir);
-	return;
+	if (walk->cache != NULL)
+		{ cache_end_dir(walk->cache, cache_off, self->name); }
+
+	// Close the directory if we still hold it
+	if (dir_fd != -1)
+		{ close(dir_fd); }
+	return 0;
 }
 
 
@@ -142,34 +931,88 @@ void tree_recurse(int s_flag, int a_flag, int level, int* dir_count, int* file_c
 /* ------------------------------------------------------------ MAIN PROGRAM RUNS HERE ------------------------------------------------------------ */
 int main(int argc, char *argv[])
 {
-	// Check if 2 < number of args < 4
-	if (argc < 2 || argc > 4)
+	// Check that there is at least a directory
+	if (argc < 2)
 	{
 		printf("Incorrect number of arguments\n");
 		return 1;
 	}
 	else
 	{
-		// There are 3 cases for user input:
-		// 1 ./<"tree"> <directory>
-		// 2 ./<"tree"> <switch> <directory>
-		// 3 ./<"tree"> <switch_1> <switch_2> <directory>
+		// User input takes the form:
+		// ./<"tree"> [<switch> ...] <directory>
+		// with the switches -s, -a, -d, -J, --ndjson, --du, -L <depth>, -P <pattern>, -I <pattern>
+		// --cache <index-file> and --watch in any order
 
-		// In any of these cases, loop through the arguments starting at the 2nd and ending before directory
-		int a_flag = A_FLAG_OFF;
-		int s_flag = S_FLAG_OFF;
+		// Loop through the arguments starting at the 2nd and ending before directory
+		TreeWalk walk = { .s_flag = S_FLAG_OFF, .a_flag = A_FLAG_OFF, .output = OUTPUT_ASCII };
+		TreeCache cache;
+		char* cache_file = NULL;
 		char* path;
 		struct stat dir_info;
 		for (int i = 1; i < (argc - 1); i++)
 		{
-			// If the optional argument is an "s" or "a" flag, strcmp will return 0 as True
+			// If the optional argument is a known flag, strcmp will return 0 as True
 			if (!strcmp(argv[i], "-s"))
 			{
-				s_flag = S_FLAG_ON;
+				walk.s_flag = S_FLAG_ON;
 			}
 			else if (!strcmp(argv[i], "-a"))
 			{
-				a_flag = S_FLAG_ON;
+				walk.a_flag = A_FLAG_ON;
+			}
+			else if (!strcmp(argv[i], "-d"))
+			{
+				walk.dirs_only = 1;
+			}
+			// The switches taking a value consume the next argument, which cannot be the directory
+			else if ((!strcmp(argv[i], "-L") || !strcmp(argv[i], "-P") || !strcmp(argv[i], "-I") || !strcmp(argv[i], "--cache"))
+			      && i + 1 >= argc - 1)
+			{
+				printf("'<%s>' needs a value before the directory.\n", argv[i]);
+				return 1;
+			}
+			else if (!strcmp(argv[i], "-L"))
+			{
+				char* endptr;
+				walk.max_depth = strtol(argv[++i], &endptr, 10 /*base*/);
+				if (*endptr != '\0' || walk.max_depth <= 0)
+				{
+					printf("Invalid level, must be greater than 0: %s\n", argv[i]);
+					return 1;
+				}
+			}
+			else if (!strcmp(argv[i], "-P"))
+			{
+				if (pattern_compile(&walk.match, argv[++i]) != 0)
+					{ return 1; }
+			}
+			else if (!strcmp(argv[i], "-I"))
+			{
+				if (pattern_compile(&walk.ignore, argv[++i]) != 0)
+					{ return 1; }
+			}
+			else if (!strcmp(argv[i], "--cache"))
+			{
+				cache_file = argv[++i];
+			}
+			else if (!strcmp(argv[i], "--watch"))
+			{
+				walk.watch_flag = 1;
+			}
+			else if (!strcmp(argv[i], "-J"))
+			{
+				walk.output = OUTPUT_JSON;
+			}
+			else if (!strcmp(argv[i], "--ndjson"))
+			{
+				walk.output = OUTPUT_NDJSON;
+			}
+			else if (!strcmp(argv[i], "--du"))
+			{
+				// Summed sizes are shown in place of the directory sizes, so --du implies -s
+				walk.du_flag = 1;
+				walk.s_flag = S_FLAG_ON;
 			}
 			else
 			{
@@ -179,29 +1022,157 @@ int main(int argc, char *argv[])
 		// The last argument is the path
 		path = argv[argc - 1];
 
+		// The live model only knows how to print the ASCII listing
+		if (walk.watch_flag && (walk.output != OUTPUT_ASCII || walk.du_flag || cache_file != NULL))
+		{
+			printf("--watch cannot be combined with -J, --ndjson, --du or --cache.\n");
+			return 1;
+		}
+
 		// TODO: This function just echoes the parameters to shell as a test
-//		echo_args(a_flag, s_flag, path);
+//		echo_args(walk.a_flag, walk.s_flag, path);
 
 		// Store path information into variable: dir_info
-		stat(path, &dir_info);
-
 		// Check if the path is valid,
 		// S_ISDIR returns 0 if the st_mode of a stat struct is not a directory
-		if (!S_ISDIR(dir_info.st_mode))
+		if (stat(path, &dir_info) != 0 || !S_ISDIR(dir_info.st_mode))
 		{
 			printf("Error, '%s' not a valid directory.\n", path);
 			return 1;
 		}
 
-		// With a valid path, recurse through tree with the level and current counts of dirs & files
-		int dir_count = 0;
-		int file_count = 0;
+		// Each directory we keep open while visiting its children costs one descriptor,
+		// so bound the number held at once by the soft limit on open files
+		struct rlimit fd_limit;
+		if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0 && fd_limit.rlim_cur != RLIM_INFINITY)
+			{ fd_budget = (int) fd_limit.rlim_cur - FD_RESERVE; }
+		else	{ fd_budget = MAX_HELD_FDS; }
+		if (fd_budget > MAX_HELD_FDS)	{ fd_budget = MAX_HELD_FDS; }
+		if (fd_budget < 1)		{ fd_budget = 1; }
+
+		// The walk's path starts as the directory given, without trailing slashes
+		walk.path_len = strlen(path);
+		while (walk.path_len > 1 && path[walk.path_len - 1] == '/')
+			{ walk.path_len--; }
+		walk.path_cap = (walk.path_len + 1 > INITIAL_PATH) ? walk.path_len + 1 : INITIAL_PATH;
+		if ((walk.path = malloc(walk.path_cap)) == NULL || out_init(&walk.out, STDOUT_FILENO) != 0)
+		{
+			free(walk.path);
+			return 1;
+		}
+		memcpy(walk.path, path, walk.path_len);
+		walk.path[walk.path_len] = '\0';
+
+		// --watch takes over from here and only returns once the root is gone
+		if (walk.watch_flag)
+		{
+			int status = watch_tree(&walk);
+			arenas_free(&walk);
+			free(walk.out.buf);
+			free(walk.path);
+			return status;
+		}
+
+#ifdef TREE_IO_URING
+		// Sizes need a stat of every entry, which is where batching through io_uring pays off
+		if (walk.s_flag == S_FLAG_ON || walk.output == OUTPUT_NDJSON)
+			{ uring_init(URING_ENTRIES); }
+#endif
+
+		// Print the root, then recurse through tree with the level and current counts of dirs & files
 		int level = 0;
-		printf("%s\n", path);
-		tree_recurse(s_flag, a_flag, level, &dir_count, &file_count, path);
+		if (walk.output == OUTPUT_JSON)
+		{
+			out_puts(&walk.out, "[\n  {\"type\":\"directory\",\"name\":\"");
+			out_json_escape(&walk.out, path);
+			out_puts(&walk.out, "\"");
+			if (walk.s_flag == S_FLAG_ON)
+				{ out_printf(&walk.out, ",\"size\":%lld", (long long) dir_info.st_size); }
+			out_puts(&walk.out, ",\"contents\":[\n");
+		}
+		else if (walk.output == OUTPUT_NDJSON)
+		{
+			out_puts(&walk.out, "{\"path\":\"");
+			out_json_escape(&walk.out, walk.path);
+			out_printf(&walk.out, "\",\"depth\":0,\"type\":\"directory\",\"size\":%lld,\"mtime\":%lld}\n",
+				(long long) dir_info.st_size, (long long) dir_info.st_mtime);
+		}
+		else
+		{
+			out_printf(&walk.out, "%s\n", path);
+		}
 
-		// Display the count of dirs & files.
-		printf("\n%d directories, %d files\n", dir_count, file_count);
-		return 0;
+		// The root directory's own entry, which is what the --cache index is checked against first
+		TreeEntry root = {
+			.name = strdup(walk.path), .mode = dir_info.st_mode, .size = dir_info.st_size,
+			.mtime = dir_info.st_mtim.tv_sec, .mtime_nsec = dir_info.st_mtim.tv_nsec,
+			.blocks = dir_info.st_blocks, .dev = dir_info.st_dev, .ino = dir_info.st_ino,
+			.nlink = dir_info.st_nlink, .shown = 1
+		};
+		if (cache_file != NULL)
+		{
+			if (cache_open(&cache, cache_file) != 0)
+			{
+				cache_close(&cache);
+				return 1;
+			}
+			walk.cache = &cache;
+			root.cached = cache_root(&cache, walk.path);
+		}
+
+		// The root directory itself starts the --du total
+		DuSize total = { dir_info.st_size, (long long) dir_info.st_blocks * 512 };
+		// A root that cannot be listed still gets its report, but the run fails
+		int status = (tree_recurse(&walk, level, AT_FDCWD, 0, &total, &root) == 0) ? 0 : 1;
+
+		if (walk.cache != NULL)
+			{ cache_close(walk.cache); }
+		free(root.name);
+
+#ifdef TREE_IO_URING
+		uring_exit();
+#endif
+
+		// Display the count of dirs & files, and the grand total with --du
+		if (walk.output == OUTPUT_JSON)
+		{
+			out_puts(&walk.out, "  ]");
+			if (walk.du_flag)
+				{ out_printf(&walk.out, ",\"size\":%lld,\"disk\":%lld", total.apparent, total.allocated); }
+			out_printf(&walk.out, "}\n,\n  {\"type\":\"report\",\"directories\":%d,\"files\":%d", walk.dir_count, walk.file_count);
+			if (walk.du_flag)
+				{ out_printf(&walk.out, ",\"size\":%lld,\"disk\":%lld", total.apparent, total.allocated); }
+			out_puts(&walk.out, "}\n]\n");
+		}
+		else if (walk.output == OUTPUT_NDJSON)
+		{
+			out_printf(&walk.out, "{\"type\":\"report\",\"directories\":%d,\"files\":%d", walk.dir_count, walk.file_count);
+			if (walk.du_flag)
+				{ out_printf(&walk.out, ",\"size\":%lld,\"disk\":%lld", total.apparent, total.allocated); }
+			out_puts(&walk.out, "}\n");
+		}
+		else if (walk.du_flag)
+		{
+			out_printf(&walk.out, "\n%lld bytes used (%lld allocated) in %d directories, %d files\n",
+				total.apparent, total.allocated, walk.dir_count, walk.file_count);
+		}
+		else
+		{
+			out_printf(&walk.out, "\n%d directories, %d files\n", walk.dir_count, walk.file_count);
+		}
+		out_flush(&walk.out);
+
+		free(walk.out.buf);
+		free(walk.path);
+		free(walk.inodes.devs);
+		free(walk.inodes.inos);
+		free(walk.match.text);
+		free(walk.match.globs);
+		free(walk.match.literal);
+		free(walk.ignore.text);
+		free(walk.ignore.globs);
+		free(walk.ignore.literal);
+		arenas_free(&walk);
+		return status;
 	}
 }
@@ -1,12 +1,24 @@
+// fdopendir, openat, fstatat and strcasecmp are POSIX.1-2008, hidden by -std=c99 otherwise
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 
 
 
@@ -17,11 +29,255 @@
 #define S_FLAG_OFF 0
 #define A_FLAG_OFF 0
 
+#define FD_RESERVE 16		// descriptors left free for stdio and anything else the process opens
+#define MAX_HELD_FDS 512	// upper bound on directories kept open at once, each also pins a DIR buffer
+#define INITIAL_ENTRIES 32	// starting capacity of a directory's entry list
+#define URING_ENTRIES 256	// submission queue depth when stats are batched through io_uring
+#define OUT_BUF_SIZE (1 << 20)	// bytes of output gathered before each write(2)
+#define ARENA_SIZE 32768	// starting size of a depth's getdents64 buffer
+#define DIRENT_READ 4096	// room left in that buffer below which it is grown before the next read
+#define INITIAL_PATH 256	// starting capacity of the walk's path buffer
+#define INITIAL_INODES 1024	// starting capacity of the --du hard link set, always a power of 2
+#define SIZE_WIDTH 11		// width of the "[%11ld]" size column
+#define CACHE_BUF_SIZE (1 << 20)	// bytes of the new --cache index gathered before each write(2)
+#define CACHE_MAGIC "TREEIDX"	// first bytes of a --cache index
+#define CACHE_VERSION 1
+#define WATCH_SETTLE_MS 100	// --watch prints changes once no event has come in for this long
+#define WATCH_EVENT_BUF 65536	// bytes of inotify events read at a time
+
+// Output formats
+#define OUTPUT_ASCII 0		// tree -n --charset=ascii
+#define OUTPUT_JSON 1		// -J: one nested JSON document, like tree -J
+#define OUTPUT_NDJSON 2		// --ndjson: one JSON record per line for every entry
+
+
+
+/* STRUCTS */
+// A TreeEntry holds what we need from a directory entry, gathered while its directory is still open
+typedef struct {
+	char* name;	// 1. name of the entry inside its directory
+	mode_t mode;	// 2. file type (and permission bits once stat'ed), 0 if the stat failed
+	off_t size;	// 3. size in bytes, only filled in when stat'ed
+	time_t mtime;	// 4. modification time, only filled in when stat'ed
+	long mtime_nsec;
+	blkcnt_t blocks;	// 5. allocated 512-byte blocks, only filled in when stat'ed
+	dev_t dev;	// 6. device and inode, to count hard links once in --du
+	ino_t ino;
+	nlink_t nlink;	// 7. number of hard links
+	int shown;	// 8. 0 for entries only listed to keep the --cache index complete
+	size_t cached;	// 9. offset of the entry's record in the old --cache index, 0 if it has none
+} TreeEntry;
+
+// A LinuxDirent is one record as getdents64 lays it out, glibc only exposes the call through readdir
+typedef struct {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;	// bytes up to the next record
+	unsigned char d_type;
+	char d_name[];
+} LinuxDirent;
+
+// A SortKey stands in for an entry while sorting, so the entries themselves are moved only once
+typedef struct {
+	const char* key;	// 1. the name folded to lower case, ordering like strcasecmp
+	const char* name;	// 2. the name itself, to order names that differ only in case
+	int index;		// 3. position of the entry in the unsorted array
+} SortKey;
+
+// A DirArena holds the listing of the directory open at one depth, reused by every directory at that depth
+typedef struct {
+	char* buf;		// 1. getdents64 records, then the folded sort keys; entry names point in here
+	size_t cap;
+	TreeEntry* raw;		// 2. entries in directory order
+	TreeEntry* sorted;	// 3. the same entries in the order they are printed
+	SortKey* keys;		// 4. one per entry
+	int entries_cap;	// 5. capacity of raw, sorted and keys
+} DirArena;
+
+// A DuSize holds the two totals --du rolls up for a subtree
+typedef struct {
+	long long apparent;	// 1. sum of st_size
+	long long allocated;	// 2. sum of st_blocks * 512
+} DuSize;
+
+// An InodeSet remembers the (device, inode) pairs of multiply linked files already counted
+typedef struct {
+	dev_t* devs;		// open addressing: slot i is used when inos[i] != 0
+	ino_t* inos;
+	size_t cap;		// power of 2
+	size_t size;
+} InodeSet;
+
+// A PatternList is a -P or -I argument split on '|' once, before the walk
+typedef struct {
+	char** globs;		// 1. the alternatives, pointing into text
+	int* literal;		// 2. 1 if the alternative has no wildcards and can be compared with strcmp
+	int count;		// 3. number of alternatives, 0 when the switch was not given
+	char* text;		// 4. private copy of the argument
+} PatternList;
+
+// A CacheHeader starts every --cache index file
+typedef struct {
+	char magic[8];		// CACHE_MAGIC
+	uint32_t version;	// CACHE_VERSION
+	uint32_t reserved;
+} CacheHeader;
+
+// A CacheRecord describes one entry in a --cache index, its name follows it without a terminator
+typedef struct {
+	int64_t size;
+	int64_t mtime;		// a directory's listing is reused only while its full mtime is unchanged
+	int64_t mtime_nsec;
+	int64_t blocks;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t subtree_len;	// directories: bytes of the records below, to step over them in one move
+	uint32_t mode;
+	uint32_t nlink;
+	uint32_t count;		// directories: number of child records
+	uint16_t name_len;
+	uint8_t scanned;	// directories: 1 if the children were listed
+	uint8_t unused;
+} CacheRecord;
+
+// A TreeCache holds the --cache index of the previous run and the one being written by this run
+typedef struct {
+	char* old_map;		// 1. previous index mapped read only, NULL if there was none
+	size_t old_len;
+	int fd;			// 2. new index, written under tmp_file and renamed to file at the end
+	char* file;
+	char* tmp_file;
+	char* buf;		// 3. pending bytes of the new index
+	size_t len;
+	size_t cap;
+	off_t flushed;		// 4. bytes of the new index already written
+	int failed;		// 5. set when a write failed, the old index is then kept
+} TreeCache;
+
+// An OutBuf gathers output in one large buffer so it reaches the descriptor in few, big writes
+typedef struct {
+	int fd;		// 1. descriptor the output ends up on
+	char* buf;	// 2. pending bytes
+	size_t len;	// 3. number of pending bytes
+	size_t cap;	// 4. size of buf
+	int holds;	// 5. open out_hold reservations, the buffer grows instead of flushing while any are open
+} OutBuf;
+
+// A TreeWalk holds the switches and running state of one traversal
+typedef struct {
+	int s_flag;		// 1. -s: show sizes
+	int a_flag;		// 2. -a: show hidden entries
+	int output;		// 3. one of the OUTPUT_ formats
+	int du_flag;		// --du: roll sizes up into each directory
+	int dirs_only;		// -d: list directories only
+	int max_depth;		// -L: levels to descend, 0 for no limit
+	PatternList match;	// -P: only list files matching one of these
+	PatternList ignore;	// -I: leave out anything matching one of these, without opening it
+	int dir_count;		// 4. directories seen so far
+	int file_count;		// 5. everything else seen so far
+	OutBuf out;		// 6. where everything is printed
+	char* path;		// 7. path of the directory being visited, as given on the command line plus names
+	size_t path_len;
+	size_t path_cap;
+	InodeSet inodes;	// 8. hard linked files already counted by --du
+	TreeCache* cache;	// 9. --cache index, NULL without the switch
+	int watch_flag;		// 10. --watch: keep the listing current until interrupted
+	DirArena* arenas;	// 11. one listing arena per depth
+	int n_arenas;
+} TreeWalk;
+
 
 
 /* PROGRAM FUNCTIONS */
-int compare(const struct dirent** a, const struct dirent** b);
+int compare(const void* a, const void* b);
 
 void echo_args(int a_flag, int s_flag, char* path);
 
-void tree_recurse(int s_flag, int a_flag, int level, int* dir_count, int* file_count, char* path);
+int open_dir_at(int anchor_fd, char* rel_path, int follow);
+
+void stat_entries(int dir_fd, TreeEntry* entries, int* todo, int n_todo);
+
+int pattern_compile(PatternList* list, const char* text);
+
+int pattern_match(PatternList* list, const char* name);
+
+int keep_entry(TreeWalk* walk, const char* name, mode_t mode);
+
+DirArena* walk_arena(TreeWalk* walk, int level);
+
+int arena_reserve(DirArena* arena, size_t bytes);
+
+int arena_entries(DirArena* arena, int n);
+
+void arenas_free(TreeWalk* walk);
+
+int read_entries(TreeWalk* walk, int level, int dir_fd, TreeEntry** entries);
+
+int out_init(OutBuf* out, int fd);
+
+void out_flush(OutBuf* out);
+
+void out_write(OutBuf* out, const char* data, size_t len);
+
+void out_puts(OutBuf* out, const char* str);
+
+void out_printf(OutBuf* out, const char* format, ...);
+
+void out_json_escape(OutBuf* out, const char* str);
+
+size_t out_hold(OutBuf* out, size_t width);
+
+void out_patch(OutBuf* out, size_t offset, size_t width, const char* text);
+
+int inode_seen(InodeSet* set, dev_t dev, ino_t ino);
+
+void du_add(TreeWalk* walk, DuSize* total, TreeEntry* entry);
+
+const char* type_name(mode_t mode);
+
+int path_push(TreeWalk* walk, const char* name);
+
+size_t print_entry(TreeWalk* walk, int level, TreeEntry* entry, int is_last);
+
+void print_dir_end(TreeWalk* walk, int level, TreeEntry* entry, int is_last, DuSize* total, size_t held);
+
+int tree_recurse(TreeWalk* walk, int level, int anchor_fd, size_t anchor_off, DuSize* total, TreeEntry* self);
+
+
+
+#ifdef TREE_IO_URING
+/* IO_URING STAT BACKEND (tree_uring.c) */
+int uring_init(unsigned entries);
+
+int uring_stat_entries(int dir_fd, TreeEntry* entries, int* todo, int n_todo);
+
+void uring_exit(void);
+#endif
+
+
+
+/* PERSISTENT INDEX (tree_cache.c) */
+int cache_open(TreeCache* cache, const char* file);
+
+size_t cache_root(TreeCache* cache, const char* name);
+
+int cache_fresh(TreeCache* cache, size_t offset, TreeEntry* self);
+
+int cache_entries(TreeCache* cache, size_t offset, DirArena* arena, TreeEntry** entries);
+
+void cache_match(TreeCache* cache, size_t offset, TreeEntry* entries, int n);
+
+off_t cache_begin_dir(TreeCache* cache, TreeEntry* self, const char* name, int count);
+
+void cache_skip_dir(TreeCache* cache, TreeEntry* self);
+
+void cache_end_dir(TreeCache* cache, off_t offset, const char* name);
+
+void cache_put(TreeCache* cache, TreeEntry* entry);
+
+int cache_close(TreeCache* cache);
+
+
+
+/* LIVE WATCH MODE (tree_watch.c) */
+int watch_tree(TreeWalk* walk);
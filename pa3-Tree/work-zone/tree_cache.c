@@ -0,0 +1,400 @@
+#include "tree.h"
+
+#include <sys/mman.h>
+
+// The index is a header followed by one record per entry in pre-order: a directory's record is
+// followed by the records of everything below it, and carries the byte length of that subtree so a
+// reader can step over it in one move. The previous run's index is only ever mapped read only;
+// the new one is streamed out during the walk and renamed over the old one at the end.
+
+
+
+// Function decodes the record at offset, checking that it lies within the mapped index
+// Returns 0 on success with *name pointing at its (not null terminated) name, -1 if out of bounds
+static int cache_read(TreeCache* cache, size_t offset, CacheRecord* rec, const char** name)
+{
+	if (offset > cache->old_len || cache->old_len - offset < sizeof(CacheRecord))
+		{ return -1; }
+
+	memcpy(rec, cache->old_map + offset, sizeof(CacheRecord));
+	if (cache->old_len - offset - sizeof(CacheRecord) < rec->name_len
+	 || cache->old_len - offset - sizeof(CacheRecord) - rec->name_len < rec->subtree_len)
+		{ return -1; }
+
+	*name = cache->old_map + offset + sizeof(CacheRecord);
+	return 0;
+}
+
+
+
+// Function writes everything pending in the new index out to its file
+static void cache_flush(TreeCache* cache)
+{
+	size_t done = 0;
+	while (done < cache->len)
+	{
+		ssize_t n = write(cache->fd, cache->buf + done, cache->len - done);
+		if (n == -1)
+		{
+			if (errno == EINTR)
+				{ continue; }
+			perror("write");
+			cache->failed = 1;
+			break;
+		}
+		done += n;
+	}
+	cache->flushed += cache->len;
+	cache->len = 0;
+}
+
+
+
+// Function appends len bytes to the new index
+static void cache_write(TreeCache* cache, const void* data, size_t len)
+{
+	if (len > cache->cap - cache->len)
+		{ cache_flush(cache); }
+	if (len > cache->cap)
+	{
+		// Only a copied subtree can be this big, write it around the buffer
+		if (write(cache->fd, data, len) != (ssize_t) len)
+			{ cache->failed = 1; }
+		cache->flushed += len;
+		return;
+	}
+	memcpy(cache->buf + cache->len, data, len);
+	cache->len += len;
+}
+
+
+
+// Function appends one record and its name to the new index
+// Returns the offset of the record in the new index
+static off_t cache_put_record(TreeCache* cache, TreeEntry* entry, const char* name, uint8_t scanned, uint32_t count)
+{
+	CacheRecord rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.size = entry->size;
+	rec.mtime = entry->mtime;
+	rec.mtime_nsec = entry->mtime_nsec;
+	rec.blocks = entry->blocks;
+	rec.dev = entry->dev;
+	rec.ino = entry->ino;
+	rec.mode = entry->mode;
+	rec.nlink = entry->nlink;
+	rec.count = count;
+	rec.name_len = (uint16_t) strlen(name);
+	rec.scanned = scanned;
+
+	off_t offset = cache->flushed + cache->len;
+	cache_write(cache, &rec, sizeof(rec));
+	cache_write(cache, name, rec.name_len);
+	return offset;
+}
+
+
+
+// Function maps the index left by a previous run, if there is a valid one, and starts the new one next to it
+// Returns 0 on success, -1 if the new index cannot be written
+int cache_open(TreeCache* cache, const char* file)
+{
+	memset(cache, 0, sizeof(*cache));
+	cache->fd = -1;
+
+	// A missing or unreadable old index just means a full walk
+	int old_fd = open(file, O_RDONLY | O_CLOEXEC);
+	struct stat info;
+	if (old_fd != -1 && fstat(old_fd, &info) == 0 && (size_t) info.st_size > sizeof(CacheHeader))
+	{
+		char* map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, old_fd, 0);
+		CacheHeader header;
+		if (map != MAP_FAILED)
+		{
+			memcpy(&header, map, sizeof(header));
+			if (memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) == 0 && header.version == CACHE_VERSION)
+			{
+				cache->old_map = map;
+				cache->old_len = info.st_size;
+			}
+			else	{ munmap(map, info.st_size); }
+		}
+	}
+	if (old_fd != -1)
+		{ close(old_fd); }
+
+	// The new index goes to a temporary name so an interrupted run leaves the old one intact
+	cache->file = strdup(file);
+	cache->tmp_file = malloc(strlen(file) + 5);
+	cache->buf = malloc(CACHE_BUF_SIZE);
+	if (cache->file == NULL || cache->tmp_file == NULL || cache->buf == NULL)
+	{
+		perror("malloc");
+		return -1;
+	}
+	sprintf(cache->tmp_file, "%s.tmp", file);
+	cache->cap = CACHE_BUF_SIZE;
+
+	if ((cache->fd = open(cache->tmp_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+	{
+		perror(cache->tmp_file);
+		return -1;
+	}
+
+	CacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.version = CACHE_VERSION;
+	cache_write(cache, &header, sizeof(header));
+	return 0;
+}
+
+
+
+// Function finds the old index's record for the root of the walk
+// Returns its offset, or 0 when the old index is missing or was made for another directory
+size_t cache_root(TreeCache* cache, const char* name)
+{
+	CacheRecord rec;
+	const char* rec_name;
+
+	if (cache->old_map == NULL || cache_read(cache, sizeof(CacheHeader), &rec, &rec_name) != 0)
+		{ return 0; }
+	if (rec.name_len != strlen(name) || memcmp(rec_name, name, rec.name_len) != 0)
+		{ return 0; }
+	return sizeof(CacheHeader);
+}
+
+
+
+// Function checks whether an old directory record still describes the directory
+// Returns 1 if its listing was stored and the directory's mtime has not changed since, 0 otherwise
+int cache_fresh(TreeCache* cache, size_t offset, TreeEntry* self)
+{
+	CacheRecord rec;
+	const char* name;
+
+	if (offset == 0 || cache_read(cache, offset, &rec, &name) != 0)
+		{ return 0; }
+	return rec.scanned && S_ISDIR(rec.mode) && rec.mtime == self->mtime && rec.mtime_nsec == self->mtime_nsec;
+}
+
+
+
+// Function lists a directory out of its old record instead of the filesystem, into the arena of its depth
+// Returns the number of entries stored into the arena's entry array, in the order they were stored, -1 on error
+int cache_entries(TreeCache* cache, size_t offset, DirArena* arena, TreeEntry** entries)
+{
+	CacheRecord rec;
+	const char* name;
+
+	if (arena == NULL || cache_read(cache, offset, &rec, &name) != 0)
+		{ return -1; }
+
+	// The children follow their parent back to back, each one followed by its own subtree;
+	// a first pass adds up their names so the arena is sized once
+	size_t first = offset + sizeof(CacheRecord) + rec.name_len;
+	size_t child = first;
+	size_t name_bytes = 0;
+	uint32_t count = 0;
+	for ( ; count < rec.count; count++)
+	{
+		CacheRecord child_rec;
+		const char* child_name;
+		if (cache_read(cache, child, &child_rec, &child_name) != 0)
+			{ break; }
+		name_bytes += child_rec.name_len + 1;
+		child += sizeof(CacheRecord) + child_rec.name_len + child_rec.subtree_len;
+	}
+	if (arena_entries(arena, (int) count) != 0 || arena_reserve(arena, name_bytes) != 0)
+		{ return -1; }
+
+	char* copy = arena->buf;
+	child = first;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		CacheRecord child_rec;
+		const char* child_name;
+		cache_read(cache, child, &child_rec, &child_name);
+
+		TreeEntry* entry = &arena->sorted[i];
+		memcpy(copy, child_name, child_rec.name_len);
+		copy[child_rec.name_len] = '\0';
+		entry->name = copy;
+		copy += child_rec.name_len + 1;
+		entry->mode = child_rec.mode;
+		entry->size = child_rec.size;
+		entry->mtime = child_rec.mtime;
+		entry->mtime_nsec = child_rec.mtime_nsec;
+		entry->blocks = child_rec.blocks;
+		entry->dev = child_rec.dev;
+		entry->ino = child_rec.ino;
+		entry->nlink = child_rec.nlink;
+		entry->shown = 1;
+		entry->cached = child;
+
+		child += sizeof(CacheRecord) + child_rec.name_len + child_rec.subtree_len;
+	}
+	*entries = arena->sorted;
+	return (int) count;
+}
+
+
+
+// The index compare_cached reads from, qsort has no way to pass it along
+static TreeCache* match_cache;
+
+// Function compares two old child records by their exact names for qsort
+static int compare_cached(const void* a, const void* b)
+{
+	CacheRecord rec_a, rec_b;
+	const char* name_a;
+	const char* name_b;
+
+	cache_read(match_cache, *(const size_t*) a, &rec_a, &name_a);
+	cache_read(match_cache, *(const size_t*) b, &rec_b, &name_b);
+
+	size_t len = (rec_a.name_len < rec_b.name_len) ? rec_a.name_len : rec_b.name_len;
+	int cmp = memcmp(name_a, name_b, len);
+	return cmp ? cmp : (int) rec_a.name_len - (int) rec_b.name_len;
+}
+
+
+
+// Function points each freshly listed entry at its record under the old directory record, if it has one,
+// so that unchanged subdirectories can still be reused below a directory that changed
+void cache_match(TreeCache* cache, size_t offset, TreeEntry* entries, int n)
+{
+	CacheRecord rec;
+	const char* name;
+
+	for (int i = 0; i < n; i++)
+		{ entries[i].cached = 0; }
+	if (offset == 0 || cache_read(cache, offset, &rec, &name) != 0 || rec.count == 0)
+		{ return; }
+
+	// Index the old children by exact name
+	size_t* children = malloc(sizeof(size_t) * rec.count);
+	if (children == NULL)
+		{ return; }
+	size_t child = offset + sizeof(CacheRecord) + rec.name_len;
+	uint32_t count = 0;
+	while (count < rec.count)
+	{
+		CacheRecord child_rec;
+		const char* child_name;
+		if (cache_read(cache, child, &child_rec, &child_name) != 0)
+			{ break; }
+		children[count++] = child;
+		child += sizeof(CacheRecord) + child_rec.name_len + child_rec.subtree_len;
+	}
+	match_cache = cache;
+	qsort(children, count, sizeof(size_t), compare_cached);
+
+	// Binary search each new name among them
+	for (int i = 0; i < n; i++)
+	{
+		size_t lo = 0, hi = count;
+		size_t name_len = strlen(entries[i].name);
+		while (lo < hi)
+		{
+			size_t mid = (lo + hi) / 2;
+			CacheRecord mid_rec;
+			const char* mid_name;
+			cache_read(cache, children[mid], &mid_rec, &mid_name);
+
+			size_t len = (mid_rec.name_len < name_len) ? mid_rec.name_len : name_len;
+			int cmp = memcmp(entries[i].name, mid_name, len);
+			if (cmp == 0)	{ cmp = (int) name_len - (int) mid_rec.name_len; }
+
+			if (cmp == 0)		{ entries[i].cached = children[mid]; break; }
+			else if (cmp < 0)	{ hi = mid; }
+			else			{ lo = mid + 1; }
+		}
+	}
+	free(children);
+}
+
+
+
+// Function starts the new record of a directory whose count entries are about to be walked
+// Returns the offset to hand back to cache_end_dir
+off_t cache_begin_dir(TreeCache* cache, TreeEntry* self, const char* name, int count)
+{
+	return cache_put_record(cache, self, name, 1, (uint32_t) count);
+}
+
+
+
+// Function records a directory that could not be listed, with no children and not marked scanned, so that
+// the next run opens it again instead of trusting the index
+void cache_skip_dir(TreeCache* cache, TreeEntry* self)
+{
+	cache_put_record(cache, self, self->name, 0, 0);
+}
+
+
+
+// Function finishes a directory's record by filling in the length of everything written below it
+void cache_end_dir(TreeCache* cache, off_t offset, const char* name)
+{
+	uint64_t subtree_len = cache->flushed + cache->len - (offset + sizeof(CacheRecord) + strlen(name));
+	off_t field = offset + offsetof(CacheRecord, subtree_len);
+
+	// Patch it in the buffer if it is still there, in the file otherwise
+	if (field >= cache->flushed)
+		{ memcpy(cache->buf + (field - cache->flushed), &subtree_len, sizeof(subtree_len)); }
+	else if (pwrite(cache->fd, &subtree_len, sizeof(subtree_len), field) != sizeof(subtree_len))
+		{ cache->failed = 1; }
+}
+
+
+
+// Function records an entry the walk does not descend into: a file, or a directory that is hidden,
+// ignored or past -L. Such a directory keeps whatever the old index knew below it; every directory
+// in there is checked against its own mtime again before it is ever reused
+void cache_put(TreeCache* cache, TreeEntry* entry)
+{
+	CacheRecord rec;
+	const char* name;
+
+	if (S_ISDIR(entry->mode) && entry->cached != 0 && cache_read(cache, entry->cached, &rec, &name) == 0
+	 && S_ISDIR(rec.mode) && rec.name_len == strlen(entry->name))
+	{
+		cache_write(cache, cache->old_map + entry->cached, sizeof(CacheRecord) + rec.name_len + rec.subtree_len);
+		return;
+	}
+	cache_put_record(cache, entry, entry->name, 0, 0);
+}
+
+
+
+// Function finishes the new index and swaps it in for the old one
+// Returns 0 on success, -1 if it could not be written (the old one is left alone)
+int cache_close(TreeCache* cache)
+{
+	int status = 0;
+
+	if (cache->fd != -1)
+	{
+		cache_flush(cache);
+		if (close(cache->fd) != 0 || cache->failed)
+		{
+			fprintf(stderr, "Could not write the index %s\n", cache->file);
+			unlink(cache->tmp_file);
+			status = -1;
+		}
+		else if (rename(cache->tmp_file, cache->file) != 0)
+		{
+			perror("rename");
+			status = -1;
+		}
+	}
+
+	if (cache->old_map != NULL)
+		{ munmap(cache->old_map, cache->old_len); }
+	free(cache->buf);
+	free(cache->file);
+	free(cache->tmp_file);
+	return status;
+}
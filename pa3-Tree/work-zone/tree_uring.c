@@ -0,0 +1,226 @@
+#include "tree.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+
+// io_uring driven through the raw system calls so no liburing is needed.
+// Every entry of a directory becomes one IORING_OP_STATX submission relative to the
+// directory's descriptor, and a whole batch costs one io_uring_enter to submit it and at most one more
+// to wait for what did not complete inline.
+
+
+
+// A StatRing holds the mapped submission and completion queues of one io_uring instance
+typedef struct {
+	int ring_fd;			// descriptor returned by io_uring_setup, -1 when unavailable
+	unsigned entries;		// number of submission slots
+	unsigned* sq_head;		// submission queue indices, shared with the kernel
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;		// completion queue indices, shared with the kernel
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_sqe* sqes;	// submission queue entries
+	struct io_uring_cqe* cqes;	// completion queue entries
+	void* sq_ptr;			// the mappings, kept to unmap them again
+	void* cq_ptr;
+	size_t sq_len;
+	size_t cq_len;
+	size_t sqes_len;
+	struct statx* results;		// one statx buffer per submission slot
+} StatRing;
+
+static StatRing ring = { .ring_fd = -1 };
+
+
+
+// Function sets up the ring and maps its queues
+// Returns 0 on success, -1 if io_uring is unavailable (old kernel, seccomp, io_uring_disabled)
+int uring_init(unsigned entries)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	int fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+	if (fd < 0)
+		{ return -1; }
+
+	ring.ring_fd = fd;
+	ring.entries = params.sq_entries;
+	ring.sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring.cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring.sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	// Newer kernels share one mapping between both rings
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (ring.cq_len > ring.sq_len)	{ ring.sq_len = ring.cq_len; }
+		ring.cq_len = ring.sq_len;
+	}
+
+	ring.sq_ptr = mmap(NULL, ring.sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring.sq_ptr == MAP_FAILED)
+		{ goto fail; }
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		{ ring.cq_ptr = ring.sq_ptr; }
+	else
+	{
+		ring.cq_ptr = mmap(NULL, ring.cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (ring.cq_ptr == MAP_FAILED)
+			{ munmap(ring.sq_ptr, ring.sq_len); goto fail; }
+	}
+
+	ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+	{
+		if (ring.cq_ptr != ring.sq_ptr)	{ munmap(ring.cq_ptr, ring.cq_len); }
+		munmap(ring.sq_ptr, ring.sq_len);
+		goto fail;
+	}
+
+	ring.results = malloc(sizeof(struct statx) * ring.entries);
+	if (ring.results == NULL)
+	{
+		munmap(ring.sqes, ring.sqes_len);
+		if (ring.cq_ptr != ring.sq_ptr)	{ munmap(ring.cq_ptr, ring.cq_len); }
+		munmap(ring.sq_ptr, ring.sq_len);
+		goto fail;
+	}
+
+	char* sq = ring.sq_ptr;
+	char* cq = ring.cq_ptr;
+	ring.sq_head  = (unsigned*) (sq + params.sq_off.head);
+	ring.sq_tail  = (unsigned*) (sq + params.sq_off.tail);
+	ring.sq_mask  = (unsigned*) (sq + params.sq_off.ring_mask);
+	ring.sq_array = (unsigned*) (sq + params.sq_off.array);
+	ring.cq_head  = (unsigned*) (cq + params.cq_off.head);
+	ring.cq_tail  = (unsigned*) (cq + params.cq_off.tail);
+	ring.cq_mask  = (unsigned*) (cq + params.cq_off.ring_mask);
+	ring.cqes     = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+	return 0;
+
+fail:
+	close(fd);
+	ring.ring_fd = -1;
+	return -1;
+}
+
+
+
+// Function gives up on the ring after io_uring_enter failed, so that the rest of the walk uses fstatat. What was
+// queued is never reaped, and requests still in flight may yet write to the results, so nothing is unmapped
+static void ring_abandon(void)
+{
+	perror("io_uring_enter");
+	close(ring.ring_fd);
+	ring.ring_fd = -1;
+}
+
+
+
+// Function stats the entries listed in todo through the ring, about two io_uring_enter calls per batch of slots
+// Returns 0 when every entry was handled (failed stats get a mode of 0), -1 if the caller must use fstatat
+int uring_stat_entries(int dir_fd, TreeEntry* entries, int* todo, int n_todo)
+{
+	if (ring.ring_fd == -1)
+		{ return -1; }
+
+	for (int done = 0; done < n_todo; )
+	{
+		unsigned batch = (unsigned) (n_todo - done);
+		if (batch > ring.entries)	{ batch = ring.entries; }
+
+		// Queue one STATX per entry, the user_data carries the slot its result lands in
+		unsigned tail = *ring.sq_tail;
+		for (unsigned i = 0; i < batch; i++)
+		{
+			unsigned index = (tail + i) & *ring.sq_mask;
+			struct io_uring_sqe* sqe = &ring.sqes[index];
+
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = dir_fd;
+			sqe->addr = (unsigned long) entries[todo[done + i]].name;
+			sqe->len = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME | STATX_BLOCKS | STATX_INO | STATX_NLINK;
+			sqe->off = (unsigned long) &ring.results[i];
+			sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+			sqe->user_data = i;
+			ring.sq_array[index] = index;
+		}
+		// The kernel must see the filled entries before it sees the new tail
+		__atomic_store_n(ring.sq_tail, tail + batch, __ATOMIC_RELEASE);
+
+		// Submit the batch and reap it. The kernel may take fewer entries than it is offered, and only those it
+		// took will complete, so the rest are offered again and only what is in flight is waited for
+		unsigned submitted = 0;
+		for (unsigned reaped = 0; reaped < batch; )
+		{
+			unsigned head = *ring.cq_head;
+			if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+			{
+				unsigned in_flight = submitted - reaped;
+				int ret = (int) syscall(__NR_io_uring_enter, ring.ring_fd, batch - submitted, in_flight,
+					(in_flight > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+				if (ret < 0 && errno == EINTR)
+					{ continue; }
+				if (ret < 0 || (ret == 0 && in_flight == 0))
+				{
+					// Slots already reaped keep their results, the caller stats them all again
+					ring_abandon();
+					return -1;
+				}
+				submitted += (unsigned) ret;
+				continue;
+			}
+
+			struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+			unsigned slot = (unsigned) cqe->user_data;
+			TreeEntry* entry = &entries[todo[done + slot]];
+
+			// Kernels without IORING_OP_STATX answer -EINVAL, fall back to a plain fstatat for those
+			if (cqe->res == -EINVAL)
+				{ stat_entries(dir_fd, entries, &todo[done + slot], 1); }
+			else if (cqe->res < 0)
+			{
+				fprintf(stderr, "statx: %s: %s\n", entry->name, strerror(-cqe->res));
+				entry->mode = 0;
+			}
+			else
+			{
+				entry->mode = ring.results[slot].stx_mode;
+				entry->size = (off_t) ring.results[slot].stx_size;
+				entry->mtime = (time_t) ring.results[slot].stx_mtime.tv_sec;
+				entry->mtime_nsec = (long) ring.results[slot].stx_mtime.tv_nsec;
+				entry->blocks = (blkcnt_t) ring.results[slot].stx_blocks;
+				entry->dev = makedev(ring.results[slot].stx_dev_major, ring.results[slot].stx_dev_minor);
+				entry->ino = (ino_t) ring.results[slot].stx_ino;
+				entry->nlink = (nlink_t) ring.results[slot].stx_nlink;
+			}
+
+			__atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+			reaped++;
+		}
+		done += batch;
+	}
+	return 0;
+}
+
+
+
+// Function unmaps the queues and closes the ring
+void uring_exit(void)
+{
+	if (ring.ring_fd == -1)
+		{ return; }
+
+	free(ring.results);
+	munmap(ring.sqes, ring.sqes_len);
+	if (ring.cq_ptr != ring.sq_ptr)	{ munmap(ring.cq_ptr, ring.cq_len); }
+	munmap(ring.sq_ptr, ring.sq_len);
+	close(ring.ring_fd);
+	ring.ring_fd = -1;
+}
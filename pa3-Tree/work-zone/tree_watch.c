@@ -0,0 +1,509 @@
+#include "tree.h"
+
+#include <poll.h>
+#include <sys/inotify.h>
+
+// --watch keeps the walked hierarchy in memory as a tree of WatchNodes, one inotify watch per
+// directory. Events patch the model in place; only the directories they touched are printed again,
+// followed by the updated totals, so nothing is ever re-walked from the root.
+
+
+
+// A WatchNode is one entry of the in-memory model
+typedef struct WatchNode {
+	char* name;			// 1. name inside the parent, the full path for the root
+	mode_t mode;			// 2. file type and permission bits
+	off_t size;			// 3. size in bytes, kept current with -s
+	struct WatchNode* parent;	// 4. NULL for the root
+	struct WatchNode** children;	// 5. directories: entries sorted like compare() sorts them
+	int n_children;
+	int cap_children;
+	int wd;				// 6. inotify watch descriptor, -1 for files and unwatched directories
+	int dirty;			// 7. 1 while waiting to be printed again
+} WatchNode;
+
+// A TreeWatch holds the model and the inotify state
+typedef struct {
+	TreeWalk* walk;		// 1. switches, counters, writer and path buffer
+	int ifd;		// 2. inotify descriptor
+	WatchNode* root;	// 3. the directory given on the command line
+	WatchNode** by_wd;	// 4. watch descriptor -> node, watch descriptors are small integers
+	int wd_cap;
+	WatchNode** dirty;	// 5. directories changed since the last render
+	int n_dirty;
+	int dirty_cap;
+	size_t root_len;	// 6. length of the root's path in walk->path
+	int warned;		// 7. 1 once the user has been told the watch limit was hit
+} TreeWatch;
+
+
+
+// Function finds the insertion point of name among a directory's sorted children
+// Returns the index of the exact match if *found is set, otherwise where name would go
+static int node_search(WatchNode* dir, const char* name, int* found)
+{
+	int lo = 0, hi = dir->n_children;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (strcasecmp(dir->children[mid]->name, name) < 0)
+			{ lo = mid + 1; }
+		else	{ hi = mid; }
+	}
+
+	// Names equal but for case sit next to each other
+	*found = 0;
+	for (int i = lo; i < dir->n_children && strcasecmp(dir->children[i]->name, name) == 0; i++)
+	{
+		if (strcmp(dir->children[i]->name, name) == 0)
+		{
+			*found = 1;
+			return i;
+		}
+	}
+	return lo;
+}
+
+
+
+// Function rebuilds the full path of a node in walk->path
+// Returns walk->path, or NULL on allocation failure
+static char* node_path(TreeWatch* watch, WatchNode* node)
+{
+	if (node->parent == NULL)
+	{
+		watch->walk->path_len = watch->root_len;
+		watch->walk->path[watch->root_len] = '\0';
+		return watch->walk->path;
+	}
+	if (node_path(watch, node->parent) == NULL || path_push(watch->walk, node->name) != 0)
+		{ return NULL; }
+	return watch->walk->path;
+}
+
+
+
+// Function counts the levels between a node and the root's children
+static int node_level(WatchNode* node)
+{
+	int level = -1;
+	for ( ; node->parent != NULL; node = node->parent)
+		{ level++; }
+	return level;
+}
+
+
+
+// Function queues a directory to be printed again
+static void mark_dirty(TreeWatch* watch, WatchNode* dir)
+{
+	if (dir->dirty)
+		{ return; }
+
+	if (watch->n_dirty == watch->dirty_cap)
+	{
+		int cap = watch->dirty_cap ? watch->dirty_cap * 2 : INITIAL_ENTRIES;
+		WatchNode** grown = realloc(watch->dirty, sizeof(WatchNode*) * cap);
+		if (grown == NULL)
+		{
+			perror("realloc");
+			return;
+		}
+		watch->dirty = grown;
+		watch->dirty_cap = cap;
+	}
+	dir->dirty = 1;
+	watch->dirty[watch->n_dirty++] = dir;
+}
+
+
+
+// Function frees a node and everything below it, dropping their watches and their share of the totals
+static void node_free(TreeWatch* watch, WatchNode* node)
+{
+	for (int i = 0; i < node->n_children; i++)
+		{ node_free(watch, node->children[i]); }
+
+	if (node->wd >= 0)
+	{
+		// The watch may already be gone if the directory was deleted, which is harmless
+		inotify_rm_watch(watch->ifd, node->wd);
+		watch->by_wd[node->wd] = NULL;
+	}
+	if (node->parent != NULL)
+	{
+		if (S_ISDIR(node->mode))	{ watch->walk->dir_count--; }
+		else				{ watch->walk->file_count--; }
+	}
+
+	// A queued directory that goes away is simply skipped when rendering
+	for (int i = 0; i < watch->n_dirty; i++)
+	{
+		if (watch->dirty[i] == node)	{ watch->dirty[i] = NULL; }
+	}
+
+	free(node->children);
+	free(node->name);
+	free(node);
+}
+
+
+
+// Function takes a new node for entry under dir, with its own copy of the entry's name
+// Returns the node, NULL on allocation failure
+static WatchNode* node_add(TreeWatch* watch, WatchNode* dir, TreeEntry* entry)
+{
+	int found;
+	int at = node_search(dir, entry->name, &found);
+	if (found)
+	{
+		// Already there (a create racing our own scan), just refresh it
+		dir->children[at]->mode = entry->mode;
+		dir->children[at]->size = entry->size;
+		return NULL;
+	}
+
+	if (dir->n_children == dir->cap_children)
+	{
+		int cap = dir->cap_children ? dir->cap_children * 2 : 4;
+		WatchNode** grown = realloc(dir->children, sizeof(WatchNode*) * cap);
+		if (grown == NULL)
+		{
+			perror("realloc");
+			return NULL;
+		}
+		dir->children = grown;
+		dir->cap_children = cap;
+	}
+
+	WatchNode* node = calloc(1, sizeof(WatchNode));
+	if (node == NULL || (node->name = strdup(entry->name)) == NULL)
+	{
+		perror("calloc");
+		free(node);
+		return NULL;
+	}
+	node->mode = entry->mode;
+	node->size = entry->size;
+	node->parent = dir;
+	node->wd = -1;
+
+	memmove(&dir->children[at + 1], &dir->children[at], sizeof(WatchNode*) * (dir->n_children - at));
+	dir->children[at] = node;
+	dir->n_children++;
+
+	if (S_ISDIR(node->mode))	{ watch->walk->dir_count++; }
+	else				{ watch->walk->file_count++; }
+	return node;
+}
+
+
+
+// Function puts a watch on a directory node and lists it into the model, recursing into subdirectories
+// down to the -L limit
+static void scan_dir(TreeWatch* watch, WatchNode* dir, int level)
+{
+	TreeWalk* walk = watch->walk;
+	char* path = node_path(watch, dir);
+	if (path == NULL)
+		{ return; }
+
+	// Watch first, so nothing created while we list is missed (node_add tolerates duplicates)
+	uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB
+	              | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+	int wd = inotify_add_watch(watch->ifd, path, mask);
+	if (wd == -1)
+	{
+		if (errno == ENOSPC && !watch->warned)
+		{
+			fprintf(stderr, "tree: out of inotify watches (fs.inotify.max_user_watches), "
+			                "some directories will not be updated\n");
+			watch->warned = 1;
+		}
+		else if (errno != ENOSPC)
+			{ perror(path); }
+	}
+	else
+	{
+		if (wd >= watch->wd_cap)
+		{
+			int cap = watch->wd_cap ? watch->wd_cap : INITIAL_ENTRIES;
+			while (cap <= wd)
+				{ cap *= 2; }
+			WatchNode** grown = realloc(watch->by_wd, sizeof(WatchNode*) * cap);
+			if (grown == NULL)
+			{
+				perror("realloc");
+				inotify_rm_watch(watch->ifd, wd);
+				return;
+			}
+			memset(grown + watch->wd_cap, 0, sizeof(WatchNode*) * (cap - watch->wd_cap));
+			watch->by_wd = grown;
+			watch->wd_cap = cap;
+		}
+		dir->wd = wd;
+		watch->by_wd[wd] = dir;
+	}
+
+	// List it the same way the one-shot walk does
+	int dir_fd = open_dir_at(AT_FDCWD, path, dir->parent == NULL);
+	if (dir_fd == -1)
+	{
+		perror(path);
+		return;
+	}
+	TreeEntry* entries;
+	int num_entries = read_entries(walk, level, dir_fd, &entries);
+	close(dir_fd);
+	if (num_entries < 0)
+		{ return; }
+
+	for (int i = 0; i < num_entries; i++)
+	{
+		WatchNode* node = node_add(watch, dir, &entries[i]);
+		if (node != NULL && S_ISDIR(node->mode) && (walk->max_depth == 0 || level + 1 < walk->max_depth))
+			{ scan_dir(watch, node, level + 1); }
+	}
+}
+
+
+
+// Function prints the contents of a directory node like tree_recurse does
+static void render(TreeWatch* watch, WatchNode* dir, int level)
+{
+	for (int i = 0; i < dir->n_children; i++)
+	{
+		WatchNode* node = dir->children[i];
+		TreeEntry entry = { .name = node->name, .mode = node->mode, .size = node->size, .shown = 1 };
+
+		print_entry(watch->walk, level, &entry, i == dir->n_children - 1);
+		if (S_ISDIR(node->mode))
+			{ render(watch, node, level + 1); }
+	}
+}
+
+
+
+// Function prints every directory changed since the last render, skipping those below another
+// changed directory since they are printed with it, then the totals
+static void render_changes(TreeWatch* watch)
+{
+	OutBuf* out = &watch->walk->out;
+
+	for (int i = 0; i < watch->n_dirty; i++)
+	{
+		WatchNode* dir = watch->dirty[i];
+		if (dir == NULL)
+			{ continue; }
+
+		int covered = 0;
+		for (WatchNode* up = dir->parent; up != NULL && !covered; up = up->parent)
+			{ covered = up->dirty; }
+		if (covered)
+			{ continue; }
+
+		char* path = node_path(watch, dir);
+		out_printf(out, "\n%s\n", path ? path : dir->name);
+		render(watch, dir, 0);
+	}
+	for (int i = 0; i < watch->n_dirty; i++)
+	{
+		if (watch->dirty[i] != NULL)	{ watch->dirty[i]->dirty = 0; }
+	}
+	watch->n_dirty = 0;
+
+	out_printf(out, "\n%d directories, %d files\n", watch->walk->dir_count, watch->walk->file_count);
+	out_flush(out);
+}
+
+
+
+// Function stats path into a TreeEntry
+// Returns 0 on success, -1 if it is gone
+static int stat_path(const char* path, TreeEntry* entry)
+{
+	struct stat statbuf;
+	if (fstatat(AT_FDCWD, path, &statbuf, AT_SYMLINK_NOFOLLOW) != 0)
+		{ return -1; }
+	entry->mode = statbuf.st_mode;
+	entry->size = statbuf.st_size;
+	entry->mtime = statbuf.st_mtim.tv_sec;
+	return 0;
+}
+
+
+
+// Function applies one inotify event to the model
+// Returns 0 to keep watching, -1 once the root itself is gone
+static int handle_event(TreeWatch* watch, struct inotify_event* event)
+{
+	TreeWalk* walk = watch->walk;
+
+	if (event->mask & IN_Q_OVERFLOW)
+	{
+		// Events were dropped, the model cannot be patched any more: list everything again
+		for (int i = 0; i < watch->root->n_children; i++)
+			{ node_free(watch, watch->root->children[i]); }
+		watch->root->n_children = 0;
+		scan_dir(watch, watch->root, 0);
+		mark_dirty(watch, watch->root);
+		return 0;
+	}
+	if (event->wd < 0 || event->wd >= watch->wd_cap || watch->by_wd[event->wd] == NULL)
+		{ return 0; }
+
+	WatchNode* dir = watch->by_wd[event->wd];
+	if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+	{
+		if (dir == watch->root)
+			{ return -1; }
+		// Anything else is handled through its parent's DELETE or MOVED_FROM
+		if (event->mask & IN_IGNORED)
+		{
+			watch->by_wd[event->wd] = NULL;
+			dir->wd = -1;
+		}
+		return 0;
+	}
+	if (event->len == 0)
+		{ return 0; }
+
+	int found;
+	int at = node_search(dir, event->name, &found);
+
+	if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+	{
+		if (found)
+		{
+			node_free(watch, dir->children[at]);
+			memmove(&dir->children[at], &dir->children[at + 1], sizeof(WatchNode*) * (dir->n_children - at - 1));
+			dir->n_children--;
+		}
+	}
+	else
+	{
+		// Created, moved in or changed: look at it again
+		TreeEntry entry = { .name = NULL, .shown = 1 };
+		char* path = node_path(watch, dir);
+		if (path == NULL || path_push(walk, event->name) != 0 || stat_path(walk->path, &entry) != 0)
+			{ return 0; }
+
+		if (found)
+		{
+			if (dir->children[at]->size == entry.size && dir->children[at]->mode == entry.mode)
+				{ return 0; }
+			dir->children[at]->size = entry.size;
+			dir->children[at]->mode = entry.mode;
+		}
+		else if (keep_entry(walk, event->name, entry.mode))
+		{
+			entry.name = event->name;
+			WatchNode* node = node_add(watch, dir, &entry);
+			int level = node_level(node ? node : dir);
+			if (node != NULL && S_ISDIR(node->mode) && (walk->max_depth == 0 || level + 1 < walk->max_depth))
+				{ scan_dir(watch, node, level + 1); }
+		}
+		else
+			{ return 0; }
+	}
+
+	// Creating or removing entries changes the directory's own size too
+	if (walk->s_flag == S_FLAG_ON && dir != watch->root && (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)))
+	{
+		TreeEntry self;
+		char* path = node_path(watch, dir);
+		if (path != NULL && stat_path(path, &self) == 0)
+			{ dir->size = self.size; }
+		mark_dirty(watch, dir->parent);
+	}
+	mark_dirty(watch, dir);
+	return 0;
+}
+
+
+
+// Function builds the model, prints it once, then keeps it current from inotify events until
+// the root goes away or an error occurs
+// Returns the program's exit status
+int watch_tree(TreeWalk* walk)
+{
+	TreeWatch watch;
+	memset(&watch, 0, sizeof(watch));
+	watch.walk = walk;
+	watch.root_len = walk->path_len;
+
+	if ((watch.ifd = inotify_init1(IN_CLOEXEC)) == -1)
+	{
+		perror("inotify_init1");
+		return 1;
+	}
+	if ((watch.root = calloc(1, sizeof(WatchNode))) == NULL || (watch.root->name = strdup(walk->path)) == NULL)
+	{
+		perror("calloc");
+		free(watch.root);
+		close(watch.ifd);
+		return 1;
+	}
+	watch.root->mode = S_IFDIR;
+	watch.root->wd = -1;
+
+	// The initial listing is the same as a one-shot run
+	scan_dir(&watch, watch.root, 0);
+	out_printf(&walk->out, "%s\n", watch.root->name);
+	render(&watch, watch.root, 0);
+	out_printf(&walk->out, "\n%d directories, %d files\n", walk->dir_count, walk->file_count);
+	out_flush(&walk->out);
+
+	// Events come in bursts (an unpacked archive, a batch of uploads), so after each one wait
+	// WATCH_SETTLE_MS for the burst to end and print everything it changed once
+	char events[WATCH_EVENT_BUF] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd pfd = { .fd = watch.ifd, .events = POLLIN };
+	int status = 0;
+	for (;;)
+	{
+		int ready = poll(&pfd, 1, watch.n_dirty > 0 ? WATCH_SETTLE_MS : -1);
+		if (ready == -1)
+		{
+			if (errno == EINTR)
+				{ continue; }
+			perror("poll");
+			status = 1;
+			break;
+		}
+		if (ready == 0)
+		{
+			render_changes(&watch);
+			continue;
+		}
+
+		ssize_t len = read(watch.ifd, events, sizeof(events));
+		if (len <= 0)
+		{
+			if (len == -1 && errno == EINTR)
+				{ continue; }
+			perror("read");
+			status = 1;
+			break;
+		}
+
+		int gone = 0;
+		for (char* at = events; at < events + len && !gone; )
+		{
+			struct inotify_event* event = (struct inotify_event*) at;
+			gone = (handle_event(&watch, event) != 0);
+			at += sizeof(struct inotify_event) + event->len;
+		}
+		if (gone)
+		{
+			out_printf(&walk->out, "\n%s was removed\n", watch.root->name);
+			out_flush(&walk->out);
+			break;
+		}
+	}
+
+	node_free(&watch, watch.root);
+	free(watch.by_wd);
+	free(watch.dirty);
+	close(watch.ifd);
+	return status;
+}
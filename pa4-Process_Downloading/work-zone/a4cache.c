@@ -0,0 +1,410 @@
+#include "a4download.h"
+
+// The download cache, in the directory -k names, used only when it names one:
+//	objects/<content key>	every file downloaded, once per content, named by its CRC-64, CRC-32 and size
+//	urls/<hash of the URL>	what was last fetched from a URL: the URL, its ETag and Last-Modified (- for none),
+//				the object holding it, its size, and the run that fetched it
+// A URL with a record is asked for again with If-None-Match and If-Modified-Since, and an unchanged one (304)
+// is put in place from its object. A URL already fetched by this run is not asked for again at all.
+// Files are put in place by reflink where the filesystem has them, so the output is a copy of its own that
+// takes no space; otherwise they are copied, and the copy out of an object has to match the CRC-32 in its
+// name. An output never shares an inode with an object, so editing it leaves the cache alone.
+// At the end of the run the least recently used objects are evicted until CACHE_MAX_BYTES are left
+
+
+
+// The cache directory, empty when there is no cache, and the id records written by this run carry
+static char cache_root[MAX_LINE_CHARS * 2] = "";
+static char run_id[32];
+
+
+
+// Function hashes bytes with 64-bit FNV-1a, carrying on from hash
+// Returns the new hash
+static uint64_t fnv64(uint64_t hash, const void* data, size_t len)
+{
+	const unsigned char* p = data;
+	while (len-- > 0)
+		{ hash = (hash ^ *p++) * 1099511628211ull; }
+	return hash;
+}
+
+
+
+// Function sets up the cache in cache_dir, NULL meaning no cache
+// Returns 0 on success, -1 if there is no cache to use (the run goes on without one)
+int cache_open(const char* cache_dir)
+{
+	if (cache_dir == NULL)
+		{ return -1; }
+	snprintf(cache_root, sizeof(cache_root), "%s", cache_dir);
+
+	char path[MAX_LINE_CHARS * 3];
+	const char* parts[] = { "", "/objects", "/urls" };
+	for (int i = 0; i < 3; i++)
+	{
+		snprintf(path, sizeof(path), "%s%s", cache_root, parts[i]);
+		if (mkdir(path, 0755) != 0 && errno != EEXIST)
+		{
+			perror(path);
+			cache_root[0] = '\0';
+			return -1;
+		}
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	snprintf(run_id, sizeof(run_id), "%ld.%ld.%ld", (long) getpid(), (long) ts.tv_sec, ts.tv_nsec);
+	return 0;
+}
+
+
+
+// Function tells whether there is a cache
+// Returns 1 if so, 0 otherwise
+int cache_enabled(void)
+{
+	return cache_root[0] != '\0';
+}
+
+
+
+// Function hashes a URL for the manifest to spot lines fetching the same one
+// Returns the hash, never 0
+uint64_t cache_url_key(const char* url)
+{
+	return fnv64(14695981039346656037ull, url, strlen(url)) | 1;
+}
+
+
+
+// Function reads the record of a URL, checking it is for that URL and that its object is still there whole
+// Returns 0 on success, -1 if there is none to go by
+static int record_read(const char* url, CacheRecord* record)
+{
+	char path[MAX_LINE_CHARS * 3];
+	snprintf(path, sizeof(path), "%s/urls/%016llx", cache_root, (unsigned long long) cache_url_key(url));
+	FILE* fp = fopen(path, "r");
+	if (fp == NULL)
+		{ return -1; }
+
+	char saved_url[MAX_URL_CHARS + 2];
+	int fields = 0;
+	if (fgets(saved_url, sizeof(saved_url), fp) != NULL)
+	{
+		saved_url[strcspn(saved_url, "\n")] = '\0';
+		if (fgets(record->etag, sizeof(record->etag), fp) != NULL && fgets(record->last_modified, sizeof(record->last_modified), fp) != NULL)
+			{ fields = fscanf(fp, "%63s %lld %31s", record->object, &record->size, record->run); }
+	}
+	fclose(fp);
+	if (fields != 3 || strcmp(saved_url, url) != 0)
+		{ return -1; }
+	record->etag[strcspn(record->etag, "\n")] = '\0';
+	record->last_modified[strcspn(record->last_modified, "\n")] = '\0';
+
+	struct stat st;
+	snprintf(path, sizeof(path), "%s/objects/%s", cache_root, record->object);
+	return (stat(path, &st) == 0 && st.st_size == record->size) ? 0 : -1;
+}
+
+
+
+// Function writes the record of a URL, all at once by renaming it into place
+static void record_write(const char* url, CacheRecord* record)
+{
+	char path[MAX_LINE_CHARS * 3];
+	char temp[MAX_LINE_CHARS * 3 + 16];
+	snprintf(path, sizeof(path), "%s/urls/%016llx", cache_root, (unsigned long long) cache_url_key(url));
+	snprintf(temp, sizeof(temp), "%s.%ld", path, (long) getpid());
+
+	FILE* fp = fopen(temp, "w");
+	if (fp == NULL)
+	{
+		perror(temp);
+		return;
+	}
+	fprintf(fp, "%s\n%s\n%s\n%s %lld %s\n", url, record->etag[0] ? record->etag : "-",
+		record->last_modified[0] ? record->last_modified : "-", record->object, record->size, record->run);
+	if (fclose(fp) != 0 || rename(temp, path) != 0)
+	{
+		perror(path);
+		unlink(temp);
+	}
+}
+
+
+
+// Function reads the CRC-32 of an object's content from its name, where it follows the CRC-64
+// Returns the CRC
+static uint32_t object_crc(const char* object)
+{
+	char digits[9];
+	snprintf(digits, sizeof(digits), "%.8s", object + 16);
+	return (uint32_t) strtoul(digits, NULL, 16);
+}
+
+
+
+// Function puts a copy of from at to, replacing whatever was there: a reflink, else, when copy is set, a copy of
+// the bytes, which have to come out with the CRC-32 crc
+// Returns 0 on success, -1 on error or when the bytes copied are not what crc says
+static int cache_place(const char* from, const char* to, int copy, uint32_t crc)
+{
+	// Made under a name of its own and renamed over to, so a failure leaves to as it was
+	char temp[MAX_LINE_CHARS * 3];
+	snprintf(temp, sizeof(temp), "%s.a4tmp", to);
+	unlink(temp);
+
+	int in = open(from, O_RDONLY | O_CLOEXEC);
+	int out = (in == -1) ? -1 : open(temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	int placed = -1;
+#ifdef FICLONE
+	if (out != -1 && ioctl(out, FICLONE, in) == 0)
+		{ placed = 0; }
+#endif
+	if (placed != 0 && out != -1 && copy)
+	{
+		char buf[HTTP_BUF_SIZE];
+		ssize_t n;
+		uint32_t sum = 0;
+		while ((n = read(in, buf, sizeof(buf))) > 0)
+		{
+			if (write(out, buf, (size_t) n) != n)
+				{ break; }
+			sum = crc32_update(sum, buf, (size_t) n);
+		}
+		if (n == 0 && sum != crc)	{ fprintf(stderr, "%s: content does not match its CRC-32\n", from); }
+		placed = (n == 0 && sum == crc) ? 0 : -1;
+	}
+	if (out != -1)	{ close(out); }
+	if (in != -1)	{ close(in); }
+
+	if (placed == 0 && rename(temp, to) == 0)
+		{ return 0; }
+	unlink(temp);
+	return -1;
+}
+
+
+
+// Function gives the conditions a request for a line's URL is sent with, from the record of what was fetched
+// from it before: the header lines for If-None-Match and If-Modified-Since in conditions, of size bytes
+// Returns 1 if there are any, 0 if the URL is to be fetched outright
+int cache_conditions(FileEntry* entry, char* conditions, size_t size)
+{
+	CacheRecord record;
+	conditions[0] = '\0';
+	if (!cache_enabled() || record_read(entry->url, &record) != 0)
+		{ return 0; }
+
+	int len = 0;
+	if (strcmp(record.etag, "-") != 0)
+		{ len = snprintf(conditions, size, "If-None-Match: %s\r\n", record.etag); }
+	if (strcmp(record.last_modified, "-") != 0 && len >= 0 && (size_t) len < size)
+		{ snprintf(conditions + len, size - (size_t) len, "If-Modified-Since: %s\r\n", record.last_modified); }
+	return conditions[0] != '\0';
+}
+
+
+
+// Function puts the cached copy of a line's URL in place of its file, after the server said it is unchanged,
+// giving its CRC-32 in crc. The record is dropped when there is no copy to use, so the retry fetches the file outright
+// Returns the size of the file, -1 if it could not be put in place
+long long cache_restore(FileEntry* entry, uint32_t* crc)
+{
+	CacheRecord record;
+	char path[MAX_LINE_CHARS * 3];
+	if (!cache_enabled())
+		{ return -1; }
+	if (record_read(entry->url, &record) == 0)
+	{
+		snprintf(path, sizeof(path), "%s/objects/%s", cache_root, record.object);
+		if (cache_place(path, entry->file_name, 1, object_crc(record.object)) == 0)
+		{
+			utimensat(AT_FDCWD, path, NULL, 0);
+			snprintf(record.run, sizeof(record.run), "%s", run_id);
+			record_write(entry->url, &record);
+			*crc = object_crc(record.object);
+			return record.size;
+		}
+		// An object that could not be copied out whole is of no use to any URL
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/urls/%016llx", cache_root, (unsigned long long) cache_url_key(entry->url));
+	unlink(path);
+	return -1;
+}
+
+
+
+// Function puts a line in place from the cache without asking the server, when an earlier line of this run
+// fetched the same URL, recording it in the journal and the report like a download
+// Returns 0 if it did, -1 if the line is to be downloaded
+int cache_reuse(FileEntry* entry)
+{
+	CacheRecord record;
+	char path[MAX_LINE_CHARS * 3];
+	if (!cache_enabled() || record_read(entry->url, &record) != 0 || strcmp(record.run, run_id) != 0)
+		{ return -1; }
+	snprintf(path, sizeof(path), "%s/objects/%s", cache_root, record.object);
+	if (cache_place(path, entry->file_name, 1, object_crc(record.object)) != 0)
+	{
+		unlink(path);
+		return -1;
+	}
+	utimensat(AT_FDCWD, path, NULL, 0);
+
+	printf("line %d: same URL as an earlier line, %lld bytes from the cache\n", entry->line_number, record.size);
+	journal_done(entry, record.size, object_crc(record.object));
+	report_line(entry, OUTCOME_OK, 0, record.size, NULL);
+	return 0;
+}
+
+
+
+// Function adds a line's downloaded file to the cache, with the validators its response came with (empty
+// when it had none). Its content key is made of the size and CRCs kept as it was downloaded, so the file is
+// only read again to be copied. Content that is cached already is refreshed from the file where reflinks
+// let the two share storage, and otherwise left as it is
+void cache_store(FileEntry* entry, const char* etag, const char* last_modified, long long size, uint32_t crc, uint64_t crc64)
+{
+	if (!cache_enabled())
+		{ return; }
+
+	CacheRecord record;
+	char path[MAX_LINE_CHARS * 3];
+	snprintf(record.object, sizeof(record.object), "%016llx%08lx-%lld", (unsigned long long) crc64, (unsigned long) crc, size);
+	snprintf(path, sizeof(path), "%s/objects/%s", cache_root, record.object);
+	struct stat st;
+	if (stat(path, &st) == 0 && st.st_size == size)
+	{
+		if (cache_place(entry->file_name, path, 0, crc) != 0)
+			{ utimensat(AT_FDCWD, path, NULL, 0); }
+	}
+	else if (cache_place(entry->file_name, path, 1, crc) != 0)
+		{ return; }
+
+	snprintf(record.etag, sizeof(record.etag), "%s", (etag != NULL && etag[0] != '\0') ? etag : "-");
+	snprintf(record.last_modified, sizeof(record.last_modified), "%s", (last_modified != NULL && last_modified[0] != '\0') ? last_modified : "-");
+	snprintf(record.run, sizeof(record.run), "%s", run_id);
+	record.size = size;
+	record_write(entry->url, &record);
+}
+
+
+
+// Function orders cached objects by when they were last used, oldest first, for qsort
+// Returns <0, 0 or >0 as a was used before, with or after b
+static int object_compare(const void* a, const void* b)
+{
+	const CacheObject* x = a;
+	const CacheObject* y = b;
+	return (x->used > y->used) - (x->used < y->used);
+}
+
+
+
+// Function drops the records of URLs whose object is gone
+static void records_prune(void)
+{
+	char path[MAX_LINE_CHARS * 4];
+	snprintf(path, sizeof(path), "%s/urls", cache_root);
+	DIR* dir = opendir(path);
+	if (dir == NULL)
+		{ return; }
+
+	struct dirent* ent;
+	while ((ent = readdir(dir)) != NULL)
+	{
+		if (ent->d_name[0] == '.')
+			{ continue; }
+		snprintf(path, sizeof(path), "%s/urls/%s", cache_root, ent->d_name);
+		FILE* fp = fopen(path, "r");
+		if (fp == NULL)
+			{ continue; }
+
+		// The object is named on the fourth line, after the URL and the two validators
+		char line[MAX_LINE_CHARS * 2];
+		char object[64] = "";
+		for (int i = 0; i < 4 && fgets(line, sizeof(line), fp) != NULL; i++)
+		{
+			if (i == 3)	{ sscanf(line, "%63s", object); }
+		}
+		fclose(fp);
+
+		char object_path[MAX_LINE_CHARS * 4];
+		struct stat st;
+		snprintf(object_path, sizeof(object_path), "%s/objects/%s", cache_root, object);
+		if (object[0] == '\0' || stat(object_path, &st) != 0)
+			{ unlink(path); }
+	}
+	closedir(dir);
+}
+
+
+
+// Function evicts objects, least recently used first, until those left take CACHE_MAX_BYTES at most, along with the
+// records of the URLs they held. An object is used when it is stored, put in place, or found already cached
+void cache_close(void)
+{
+	if (!cache_enabled())
+		{ return; }
+
+	char path[MAX_LINE_CHARS * 4];
+	snprintf(path, sizeof(path), "%s/objects", cache_root);
+	DIR* dir = opendir(path);
+	if (dir == NULL)
+	{
+		cache_root[0] = '\0';
+		return;
+	}
+
+	CacheObject* objects = NULL;
+	size_t count = 0;
+	size_t capacity = 0;
+	long long total = 0;
+	struct dirent* ent;
+	while ((ent = readdir(dir)) != NULL)
+	{
+		struct stat st;
+		snprintf(path, sizeof(path), "%s/objects/%s", cache_root, ent->d_name);
+		if (ent->d_name[0] == '.' || strlen(ent->d_name) >= sizeof(objects->name) || stat(path, &st) != 0)
+			{ continue; }
+		if (count == capacity)
+		{
+			capacity = (capacity == 0) ? 64 : capacity * 2;
+			CacheObject* grown = realloc(objects, capacity * sizeof(CacheObject));
+			if (grown == NULL)
+			{
+				fprintf(stderr, "Memory allocation failed\n");
+				break;
+			}
+			objects = grown;
+		}
+		strcpy(objects[count].name, ent->d_name);
+		objects[count].size = st.st_size;
+		objects[count].used = st.st_mtime;
+		total += st.st_size;
+		count++;
+	}
+	closedir(dir);
+
+	int evicted = 0;
+	if (total > CACHE_MAX_BYTES)
+	{
+		qsort(objects, count, sizeof(CacheObject), object_compare);
+		for (size_t i = 0; i < count && total > CACHE_MAX_BYTES; i++)
+		{
+			snprintf(path, sizeof(path), "%s/objects/%s", cache_root, objects[i].name);
+			if (unlink(path) == 0)
+			{
+				total -= objects[i].size;
+				evicted++;
+			}
+		}
+	}
+	free(objects);
+	if (evicted > 0)
+		{ records_prune(); }
+	cache_root[0] = '\0';
+}
@@ -3,51 +3,115 @@
 
 
 // Global variables to help with signal catching and freeing
-FileEntry* file_info;
+Manifest manifest;
 
-int n_lines = 0;
+volatile sig_atomic_t stop_signal = 0;
 
 
 
-// Function free's the array holding file information, clearing all heap data
-// Returns nothing
-void free_file_info()
+// Function catches the specified program terminations. Nothing is done here but noting the signal, as it may
+// land in the middle of a journal record: the engines stop at their next wakeup, and main clears the heap
+void sig_handler(int signum)
 {
-	// Free mallocs: array holding file information before closing
-	for (int i = 0; i < n_lines; i++)
-	{
-		free(file_info[i].file_name);
-		free(file_info[i].url);
-	}
-	free(file_info);
+	stop_signal = signum;
 }
 
 
 
-// Function catches the specified program terminations and clears the heap
-void sig_handler(int signum)
+// Function ends the program after a signal stopped it, closing what it had open
+static void stop_exit(int signum)
 {
 	if 	(signum == SIGINT ) 	{ printf("Received SIGINT.\n"); }
 	else if (signum == SIGQUIT) 	{ printf("Received SIGQUIT.\n");}
-	free_file_info();
+	journal_close();
+	report_close();
+	timing_close();
+	cache_close();
+	manifest_close(&manifest);
 	exit(signum);
 }
 
 
 
-// Function parses and verifies program arguments for correct startup
+// Function parses and verifies program arguments for correct startup, filling in options
 // Returns the max-processing time as inputted by user, a default value if unspecified
-int parse_args(int argc, char* argv[])
+int parse_args(int argc, char* argv[], Options* options)
 {
+	options->engine = ENGINE_CURL;
+	options->host_conns = DEFAULT_HOST_CONNS;
+	options->pipeline = DEFAULT_PIPELINE;
+	options->ranges = 1;
+	options->policy = POLICY_FIFO;
+	options->rate = 0;
+	options->host_rate = 0;
+	options->retries = DEFAULT_RETRIES;
+	options->report_file = NULL;
+	options->cache_dir = NULL;
+	options->trace_file = NULL;
+	options->direct = 0;
+
+	// Switches come first: -e picks the download engine, -c and -p size the http engine's connection pools,
+	// -r splits large files into ranges fetched at once, -s picks which waiting line starts next,
+	// -b and -B cap the bytes per second of the whole run and of each host, -R sets how often a line is retried,
+	// -o where the report goes, -k where the download cache is and -t where the timings of every try are traced,
+	// -d writes large files past the page cache. The report, the cache and the trace are only written when named.
+	// The journal always is, as <file-name>.journal, and is removed again once every line is done
+	int opt;
+	while ((opt = getopt(argc, argv, "e:c:p:r:s:b:B:R:o:k:t:d")) != -1)
+	{
+		char* endptr = "";
+		if (opt == 'e' && strcmp(optarg, "curl") == 0)		{ options->engine = ENGINE_CURL; }
+		else if (opt == 'e' && strcmp(optarg, "http") == 0)	{ options->engine = ENGINE_HTTP; }
+		else if (opt == 's' && strcmp(optarg, "fifo") == 0)	{ options->policy = POLICY_FIFO; }
+		else if (opt == 's' && strcmp(optarg, "edf") == 0)	{ options->policy = POLICY_EDF; }
+		else if (opt == 's' && strcmp(optarg, "sjf") == 0)	{ options->policy = POLICY_SJF; }
+		else if (opt == 's' && strcmp(optarg, "fair") == 0)	{ options->policy = POLICY_FAIR; }
+		else if (opt == 'c')	{ options->host_conns = strtol(optarg, &endptr, 10); }
+		else if (opt == 'p')	{ options->pipeline = strtol(optarg, &endptr, 10); }
+		else if (opt == 'r')	{ options->ranges = strtol(optarg, &endptr, 10); }
+		else if (opt == 'b')	{ options->rate = parse_rate(optarg); }
+		else if (opt == 'B')	{ options->host_rate = parse_rate(optarg); }
+		else if (opt == 'R')	{ options->retries = strtol(optarg, &endptr, 10); }
+		else if (opt == 'o')	{ options->report_file = optarg; }
+		else if (opt == 'k')	{ options->cache_dir = optarg; }
+		else if (opt == 't')	{ options->trace_file = optarg; }
+		else if (opt == 'd')	{ options->direct = 1; }
+		else			{ endptr = NULL; }
+
+		if (endptr == NULL || *endptr != '\0' || options->host_conns <= 0 || options->rate < 0 || options->host_rate < 0 || options->retries < 0
+		 || options->pipeline <= 0 || options->pipeline > MAX_PIPELINE
+		 || options->ranges <= 0 || options->ranges > MAX_RANGES)
+		{
+			fprintf(stderr, "Usage: ./a4download [-e curl|http] [-c conns-per-host] [-p pipeline-depth] [-r ranges] [-s fifo|edf|sjf|fair] [-b bytes-per-sec] [-B bytes-per-sec-per-host] [-R retries] [-o report-file] [-k cache-dir] [-t trace.csv|trace.json] [-d] <file-name> <(opt) max-processing-time>\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	// Sizes come from HEAD requests, and files are written past the page cache, only by the http engine
+	if (options->policy == POLICY_SJF && options->engine != ENGINE_HTTP)
+	{
+		fprintf(stderr, "-s sjf needs -e http\n");
+		exit(EXIT_FAILURE);
+	}
+	if (options->direct && options->engine != ENGINE_HTTP)
+	{
+		fprintf(stderr, "-d needs -e http\n");
+		exit(EXIT_FAILURE);
+	}
+
 	// Verify number of parameters from input
 	if (argc < 2 || 3 < argc)
 	{
-		fprintf(stderr, "Usage: ./a4download <file-name> <(opt) max-processing-time>\n");
+		fprintf(stderr, "Usage: ./a4download [-e curl|http] [-c conns-per-host] [-p pipeline-depth] [-r ranges] [-s fifo|edf|sjf|fair] [-b bytes-per-sec] [-B bytes-per-sec-per-host] [-R retries] [-o report-file] [-k cache-dir] [-t trace.csv|trace.json] [-d] <file-name> <(opt) max-processing-time>\n");
 		exit(EXIT_FAILURE);
 	}
-	else if (argc == 2)
+	options->input_file = argv[1];
+	if (argc == 2)
 	{
 		printf("Note: default number for concurrent process downloads of 2 will be used.\n");
+		options->max_downloads = DEFAULT_DOWNLOADS;
 		return DEFAULT_DOWNLOADS;
 	}
 	else
@@ -62,227 +126,701 @@ int parse_args(int argc, char* argv[])
 			fprintf(stderr, "Invalid download cap: %s\n", argv[2]);
 			exit(EXIT_FAILURE);
 		}
+		options->max_downloads = max_downloads;
 		return max_downloads;
 	}
 }
 
 
 
-// Function parses the user specified input_file and populates an array holding download information
-// Returns a pointer to the array
-// Note: It is not possible to instantiate file_info in main and pass it into a function as a pointer
-//	 to mutate it with mallocs and reallocs so we just return the pointer to the data.
-FileEntry* copy_file_contents(char* input_file, int* n_lines)
+// Function reads a rate as curl's --limit-rate takes it: bytes per second, or with a k, m or g suffix
+// Returns the rate, -1 if it is not one
+long long parse_rate(const char* text)
+{
+	char* endptr;
+	long long rate = strtoll(text, &endptr, 10);
+	if (endptr == text || rate <= 0)
+		{ return -1; }
+	if      (*endptr == 'k' || *endptr == 'K')	{ rate <<= 10; endptr++; }
+	else if (*endptr == 'm' || *endptr == 'M')	{ rate <<= 20; endptr++; }
+	else if (*endptr == 'g' || *endptr == 'G')	{ rate <<= 30; endptr++; }
+	return (*endptr == '\0') ? rate : -1;
+}
+
+
+
+// Function works out the --limit-rate each curl child gets: an even share of the tighter of -b and -B.
+// Children are not told apart by host, so -B is shared as if every download went to the same one
+// Returns the rate, 0 for no limit
+long long curl_share(Options* options)
+{
+	long long limit = options->rate;
+	if (options->host_rate > 0 && (limit == 0 || options->host_rate < limit))
+		{ limit = options->host_rate; }
+	if (limit == 0)
+		{ return 0; }
+	long long share = limit / options->max_downloads;
+	return (share > 0) ? share : 1;
+}
+
+
+
+// Function opens the manifest, with room for running downloads at once plus MANIFEST_AHEAD lines parsed ahead,
+// which the policy picks from
+// Returns 0 on success, -1 if the file cannot be read or memory ran out
+int manifest_open(Manifest* manifest, char* input_file, int running, int policy)
+{
+	memset(manifest, 0, sizeof(Manifest));
+	manifest->policy = policy;
+	if ((manifest->fp = fopen(input_file, "r")) == NULL)
+		{ return -1; }
+
+	// Every entry owns a fixed strip of the arena, wide enough for the longest name and URL a line may have
+	manifest->size = running + MANIFEST_AHEAD;
+	manifest->entries = calloc((size_t) manifest->size, sizeof(FileEntry));
+	manifest->arena = malloc((size_t) manifest->size * (MAX_NAME_CHARS + MAX_URL_CHARS));
+	manifest->free_list = malloc(sizeof(int) * (size_t) manifest->size);
+	manifest->pending = malloc(sizeof(int) * (size_t) manifest->size);
+	if (!manifest->entries || !manifest->arena || !manifest->free_list || !manifest->pending)
+	{
+		manifest_close(manifest);
+		return -1;
+	}
+	for (int i = 0; i < manifest->size; i++)
+	{
+		manifest->entries[i].file_name = manifest->arena + (size_t) i * (MAX_NAME_CHARS + MAX_URL_CHARS);
+		manifest->entries[i].url = manifest->entries[i].file_name + MAX_NAME_CHARS;
+		manifest->free_list[i] = manifest->size - 1 - i;
+	}
+	manifest->n_free = manifest->size;
+	return 0;
+}
+
+
+
+// Function hashes the host of a URL (whatever its scheme) to its FAIR_BUCKETS counter
+// Returns the bucket
+static unsigned host_bucket(const char* url)
 {
-	// Open the file with the download links
-	FILE *fp = fopen(input_file, "r");
-	if (fp == NULL)
+	const char* host = strstr(url, "://");
+	host = (host != NULL) ? host + 3 : url;
+
+	unsigned hash = 2166136261u;
+	for (size_t i = 0, len = strcspn(host, "/?#"); i < len; i++)
+		{ hash = (hash ^ (unsigned char) tolower((unsigned char) host[i])) * 16777619u; }
+	return hash & (FAIR_BUCKETS - 1);
+}
+
+
+
+// Function finds an entry in use for the same URL as a line just read, which the line is to wait for so the URL
+// is fetched once and the line put in place from the cache
+// Returns the entry's index, -1 if there is none
+static int manifest_same_url(Manifest* manifest, FileEntry* entry)
+{
+	for (int i = 0; i < manifest->size; i++)
 	{
-		printf("Error: failed to read file %s.\n", input_file);
-		exit(EXIT_FAILURE);
+		FileEntry* other = &manifest->entries[i];
+		if (other != entry && other->url_key == entry->url_key && strcmp(other->url, entry->url) == 0)
+			{ return i; }
 	}
+	return -1;
+}
+
 
-	// Initialize an array and necessary buffers to hold all of the line entries in the file
-	FileEntry* file_info = NULL;
-	char line[MAX_LINE_CHARS];
 
-	// Read the lines of the file until an EOF is reached.
-	// fgets(*string, n chars to read, *file_stream);
-	while (fgets(line, MAX_LINE_CHARS, fp) != NULL)
+// Function reads lines of the manifest into free entries until MANIFEST_AHEAD are waiting or the file ends.
+// Blank and malformed lines are passed over, and so are lines the journal says are already downloaded
+static void manifest_fill(Manifest* manifest)
+{
+	char line[MAX_LINE_CHARS];
+	while (manifest->fp != NULL && manifest->n_free > 0 && manifest->count < MANIFEST_AHEAD)
 	{
-		// Parse the line for the local_name, url, and max_seconds. If max_seconds not specified, set to MAX_DOWNLOAD_TIME;
-		char local_name[MAX_NAME_CHARS];
-		char url[MAX_URL_CHARS];
-		int max_seconds;
-		if (sscanf(line, "%63s %123s %d", local_name, url, &max_seconds) != 3)
+		if (fgets(line, MAX_LINE_CHARS, manifest->fp) == NULL)
 		{
-			max_seconds = MAX_DOWNLOAD_TIME;
+			fclose(manifest->fp);
+			manifest->fp = NULL;
+			break;
 		}
+		manifest->line_number++;
 
-		// TODO: might be able to just remove this one
-		if (max_seconds <= 0) { max_seconds = MAX_DOWNLOAD_TIME; }
-
-		// Create an array to hold the information of the current line
-		FileEntry line_info = {
-			.file_name = malloc(strlen(local_name) + 1),
-			.url = malloc(strlen(url) + 1),
-			.timeout = max_seconds,
-			.line_number = (*n_lines) + 1
-		} ;
-
-		// If the malloc failed, end the program
-		if (!line_info.file_name || !line_info.url)
+		// A line too long for the buffer is cut off here, the rest of it is not a line of its own
+		if (strchr(line, '\n') == NULL && !feof(manifest->fp))
 		{
-			if (!line_info.file_name) { free(line_info.file_name); }
-			if (!line_info.url) { free(line_info.url); }
-			fprintf(stderr, "Memory allocation failed\n");
-			fclose(fp);
-			exit(EXIT_FAILURE); // or exit, depending on the program's needs
+			int c;
+			while ((c = fgetc(manifest->fp)) != '\n' && c != EOF)
+				{ }
 		}
 
-		// Copy the strings held in the buffers to temporary memory, line_info
-		strcpy(line_info.file_name, local_name);
-		strcpy(line_info.url, url);
+		// Parse the line for the local_name, url, and max_seconds. If max_seconds not specified, set to MAX_DOWNLOAD_TIME;
+		int index = manifest->free_list[manifest->n_free - 1];
+		FileEntry* entry = &manifest->entries[index];
+		int max_seconds;
+		int fields = sscanf(line, "%63s %123s %d", entry->file_name, entry->url, &max_seconds);
+		if (fields < 2)
+		{
+			if (fields == 1)	{ printf("line %d has no URL, skipped\n", manifest->line_number); }
+			continue;
+		}
+		if (fields != 3 || max_seconds <= 0)
+			{ max_seconds = MAX_DOWNLOAD_TIME; }
+		entry->timeout = max_seconds;
+		entry->line_number = manifest->line_number;
+		entry->ready = now_seconds();
+		entry->deadline = entry->ready + max_seconds;
+		entry->expected_bytes = (manifest->policy == POLICY_SJF) ? EXPECT_UNPROBED : EXPECT_UNKNOWN;
+		entry->host_bucket = host_bucket(entry->url);
+		entry->attempts = 0;
+		entry->not_before = 0;
+
+		journal_lookup(entry);
+		if (entry->journal == JOURNAL_DONE)
+		{
+			printf("line %d already downloaded, skipped\n", entry->line_number);
+			report_line(entry, OUTCOME_SKIPPED, 0, entry->resume_bytes, NULL);
+			continue;
+		}
 
-		// Reallocate memory for file_info to hold another entry of a line and its contents
-		file_info = realloc(file_info, (sizeof(FileEntry) * ((*n_lines) + 1)) /* * 2*/);
-		if (file_info == NULL)
+		// A line whose URL is being fetched already waits for it, with no need to be sized
+		entry->waiting_on = -1;
+		if (cache_enabled())
 		{
-			printf("Could not allocate memory for <FileEntry* file_info>.\n");
-			fclose(fp);
-			exit(EXIT_FAILURE);
+			entry->url_key = cache_url_key(entry->url);
+			if ((entry->waiting_on = manifest_same_url(manifest, entry)) != -1)
+				{ entry->expected_bytes = EXPECT_UNKNOWN; }
 		}
 
-		// Now file_info is a dynamic array holding number n_lines of entries
-		file_info[(*n_lines)] = line_info;
-		(*n_lines)++;
-	} // End of while
+		manifest->n_free--;
+		manifest->pending[manifest->count++] = index;
+	}
+}
 
-	// After storing file contents, null terminate the last elements of our array
-	// TODO: the following line creates write errors with valgrind, but no memory leaks
-	// file_info[n_lines] = (FileEntry) {NULL, NULL, -1, -1};
 
-	// Close the file after we have gathered its information
-	fclose(fp);
 
-	return file_info;
+// Function tells whether, under the manifest's policy, line a should start before line b
+// Returns 1 if so, 0 otherwise
+static int manifest_before(Manifest* manifest, FileEntry* a, FileEntry* b)
+{
+	if (manifest->policy == POLICY_EDF && a->deadline != b->deadline)
+		{ return a->deadline < b->deadline; }
+	if (manifest->policy == POLICY_SJF && a->expected_bytes != b->expected_bytes)
+	{
+		// Unknown sizes go last, as if they were the largest
+		if (a->expected_bytes < 0 || b->expected_bytes < 0)	{ return b->expected_bytes < 0; }
+		return a->expected_bytes < b->expected_bytes;
+	}
+	if (manifest->policy == POLICY_FAIR)
+	{
+		int a_running = manifest->host_running[a->host_bucket];
+		int b_running = manifest->host_running[b->host_bucket];
+		if (a_running != b_running)	{ return a_running < b_running; }
+	}
+	// Manifest order breaks ties, and is all FIFO goes by
+	return a->line_number < b->line_number;
 }
 
 
 
-// Function executes "curl" shell command per child request
-// Returns nothing and exits once shell command is completed
-void child_process(int timeout, char* file_name, char* url)
+// Function takes the next line to download, the one the policy puts first among those read ahead, reading
+// more of the manifest as lines are taken. Under -s sjf a line still being sized is not taken, nor is a line
+// waiting out its backoff before a retry
+// Returns the line's entry, NULL if there is none to start now
+FileEntry* manifest_next(Manifest* manifest)
 {
-	char seconds_str[10];
-	sprintf(seconds_str, "-m %d", timeout);
+	manifest_fill(manifest);
 
-	execl("/usr/bin/curl", "curl", seconds_str, "-o", file_name, "-s", url, NULL);
-	exit(0);
+	double now = now_seconds();
+	int best = -1;
+	for (int i = 0; i < manifest->count; i++)
+	{
+		FileEntry* entry = &manifest->entries[manifest->pending[i]];
+		if (entry->expected_bytes == EXPECT_UNPROBED || entry->expected_bytes == EXPECT_PROBING || entry->not_before > now
+		 || entry->waiting_on != -1)
+			{ continue; }
+		if (best == -1 || manifest_before(manifest, entry, &manifest->entries[manifest->pending[best]]))
+			{ best = i; }
+	}
+	if (best == -1)
+		{ return NULL; }
+
+	FileEntry* entry = &manifest->entries[manifest->pending[best]];
+	manifest->pending[best] = manifest->pending[--manifest->count];
+	manifest->host_running[entry->host_bucket]++;
+	entry->started = now;
+	return entry;
 }
 
 
 
-// Function operates the "waiting" portion of the program each child request
-// Returns nothing
-void parent_process(pid_t process_ids[], int n_lines)
+// Function finds a waiting line that has not been sized yet, in manifest order, and marks it as being sized
+// Returns its entry, NULL if there is none
+FileEntry* manifest_unprobed(Manifest* manifest)
 {
-	// waitpid with -1 to wait for any child process to finish and its pid is stored
-	int status;
-	pid_t finished_child = waitpid(-1, &status, 0);
+	manifest_fill(manifest);
 
-	// Search for finished child in our array of process ids
-	for (int i = 0; i < n_lines; i++)
+	FileEntry* first = NULL;
+	for (int i = 0; i < manifest->count; i++)
 	{
-		if (finished_child == process_ids[i])
-		{
-			// Check child exit status, if successful:
-			int exit_status = WEXITSTATUS(status);
-			if (exit_status == 0)
-				{ printf("process %d processing line %d exited normally\n", finished_child, i + 1); }
-			// If not successful, then display appropriate message
-			else	{ printf("process %d processing line %d terminated with exit status: %d\n", finished_child, i + 1, exit_status); }
-			// adding this break removes a valgrind error
-			// "Conditional jump or move depends on uninitialised value(s)"
-			break;
-		}
+		FileEntry* entry = &manifest->entries[manifest->pending[i]];
+		if (entry->expected_bytes == EXPECT_UNPROBED && (first == NULL || entry->line_number < first->line_number))
+			{ first = entry; }
 	}
+	if (first != NULL)
+		{ first->expected_bytes = EXPECT_PROBING; }
+	return first;
 }
 
 
 
-/* ------------------------------------------------------------ MAIN PROGRAM RUNS HERE ------------------------------------------------------------ */
-int main(int argc, char* argv[])
+// Function gives back the entry of a line that is done with, for a later line to use. Lines that waited for it
+// to fetch the same URL may start now, and find it in the cache if it succeeded
+void manifest_release(Manifest* manifest, FileEntry* entry)
 {
-	// Check if the number of arguments are valid first
-	char* input_file = argv[1];
-	int max_downloads = parse_args(argc, argv);
+	int index = (int) (entry - manifest->entries);
+	for (int i = 0; i < manifest->count; i++)
+	{
+		FileEntry* waiting = &manifest->entries[manifest->pending[i]];
+		if (waiting->waiting_on == index)	{ waiting->waiting_on = -1; }
+	}
+	entry->url_key = 0;
+	manifest->host_running[entry->host_bucket]--;
+	manifest->free_list[manifest->n_free++] = index;
+}
 
-	// Signals to catch any program terminations.
-	if (signal(SIGQUIT, sig_handler) == SIG_ERR) // "CTRL + \"
-		{ printf("unable to register handler for SIGQUIT\n"); 	return 1; }
-	if (signal(SIGINT, sig_handler) == SIG_ERR) // "CTRL + C"
-		{ printf("unable to register handler for SIGINT\n"); 	return 1; }
 
-	// Instantiate the array and populate it with information from the input_file
-	file_info = copy_file_contents(input_file, &n_lines);
 
-	/* - - - - - The downloading - - - - - - */
+// Function puts a line that failed back among the waiting ones, not to be taken before its not_before
+void manifest_retry(Manifest* manifest, FileEntry* entry)
+{
+	entry->ready = entry->not_before;
+	manifest->host_running[entry->host_bucket]--;
+	manifest->pending[manifest->count++] = (int) (entry - manifest->entries);
+}
+
+
+
+// Function tells how long until the next line waiting to be retried may start
+// Returns the seconds, 0 if no line is waiting on a backoff
+double manifest_wait(Manifest* manifest)
+{
+	double now = now_seconds();
+	double wait = 0;
+	for (int i = 0; i < manifest->count; i++)
+	{
+		double left = manifest->entries[manifest->pending[i]].not_before - now;
+		if (left > 0 && (wait == 0 || left < wait))
+			{ wait = left; }
+	}
+	return wait;
+}
+
+
+
+// Function tells whether every line of the manifest has been handed out
+// Returns 1 if so, 0 otherwise
+int manifest_finished(Manifest* manifest)
+{
+	return manifest->fp == NULL && manifest->count == 0;
+}
+
+
+
+// Function closes the manifest and frees its entries
+void manifest_close(Manifest* manifest)
+{
+	if (manifest->fp != NULL)	{ fclose(manifest->fp); }
+	free(manifest->entries);
+	free(manifest->arena);
+	free(manifest->free_list);
+	free(manifest->pending);
+	memset(manifest, 0, sizeof(Manifest));
+}
+
 
-	// Set the max_downloads to the number of FileEntries in the file to prevent over-downloading
-	if (max_downloads > n_lines)
+
+// Function sets up an empty table with room for n running children
+// Returns 0 on success, -1 if memory ran out
+int pidmap_init(PidMap* map, int n)
+{
+	// At most half full, so probes stay short
+	size_t size = 16;
+	while (size < (size_t) n * 2)
+		{ size <<= 1; }
+	map->cells = calloc(size, sizeof(PidCell));
+	map->mask = size - 1;
+	return (map->cells != NULL) ? 0 : -1;
+}
+
+
+
+// Function hashes a pid to its home cell; pids are handed out in sequence, so their bits are mixed first
+static size_t pidmap_home(PidMap* map, pid_t pid)
+{
+	return ((uint32_t) pid * 2654435761u) & map->mask;
+}
+
+
+
+// Function records which line (or slot) a child is working on
+void pidmap_put(PidMap* map, pid_t pid, int value)
+{
+	size_t i = pidmap_home(map, pid);
+	while (map->cells[i].pid != 0)
+		{ i = (i + 1) & map->mask; }
+	map->cells[i].pid = pid;
+	map->cells[i].value = value;
+}
+
+
+
+// Function finds a child and removes it from the table
+// Returns what was recorded for it, -1 if it is not in the table
+int pidmap_take(PidMap* map, pid_t pid)
+{
+	size_t i = pidmap_home(map, pid);
+	while (map->cells[i].pid != pid)
 	{
-		// These prints aren't necessary, but are good for debugging or clarity for user.
-		// printf("Number of max processes, %d, specified by user exceeds number of file entries, %d.\n", max_downloads, n_lines);
-		max_downloads = n_lines;
-		// printf("Set to cap\n");
+		if (map->cells[i].pid == 0)
+			{ return -1; }
+		i = (i + 1) & map->mask;
 	}
+	int value = map->cells[i].value;
+
+	// Close the gap by moving back every later cell of the run that may live there, so no probe stops short
+	size_t hole = i;
+	for (size_t j = (i + 1) & map->mask; map->cells[j].pid != 0; j = (j + 1) & map->mask)
+	{
+		size_t home = pidmap_home(map, map->cells[j].pid);
+		if (((j - home) & map->mask) >= ((j - hole) & map->mask))
+		{
+			map->cells[hole] = map->cells[j];
+			hole = j;
+		}
+	}
+	map->cells[hole].pid = 0;
+	return value;
+}
+
+
+
+// Mask restored in every child, SIGCHLD being blocked in this process while children run
+static sigset_t spawn_mask;
+
 
-	// Array holding pid information
-	pid_t process_ids[n_lines];
-	int process_count = 0;
-	int total_downloaded = 0;
-	int cur_spot = 0;
 
-	// Begin process downloading until we have downloaded all of the files.
-	while (total_downloaded < n_lines)
+// Function blocks SIGCHLD and opens a descriptor that becomes readable when a child exits instead
+// Returns the descriptor, -1 on error
+int sigchld_open(int flags)
+{
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &mask, &spawn_mask) != 0)
+		{ return -1; }
+	return signalfd(-1, &mask, flags | SFD_CLOEXEC);
+}
+
+
+
+// Function closes the SIGCHLD descriptor and unblocks the signal
+void sigchld_close(int sfd)
+{
+	if (sfd != -1)	{ close(sfd); }
+	sigprocmask(SIG_SETMASK, &spawn_mask, NULL);
+}
+
+
+
+// Function starts "curl -m <seconds> -o <filename> -s <url>" for a line, with -C - when resuming it,
+// --limit-rate when limit_rate is not 0, and the conditions of a cached URL. The response headers go to
+// <filename>.headers, for report_child to tell what the server said, and the timings -w writes go to
+// <filename>.timing in place of curl's output. posix_spawn leaves this process's memory alone, so a big
+// parent starts children as cheaply as a small one
+// Returns the child's pid, -1 if it could not be started
+pid_t spawn_curl(FileEntry* entry, int resume, long long limit_rate)
+{
+	char seconds_str[16];
+	char rate_str[24];
+	char headers[MAX_NAME_CHARS + 16];
+	char timing[MAX_NAME_CHARS + 16];
+	char conditions[2 * MAX_VALIDATOR_CHARS + 48];
+	snprintf(seconds_str, sizeof(seconds_str), "-m %d", entry->timeout);
+	snprintf(rate_str, sizeof(rate_str), "%lld", limit_rate);
+	snprintf(headers, sizeof(headers), "%s.headers", entry->file_name);
+	snprintf(timing, sizeof(timing), "%s%s", entry->file_name, TIMING_SUFFIX);
+
+	// A file made from the cache may be a hard link to it, which curl must not write through
+	char* if_none_match = NULL;
+	char* if_modified_since = NULL;
+	if (!resume)
 	{
-		// There are 2 issues occur that this check solves:
-		// 1. cur_spot will exceed n_lines and will download past the number of valid entries
-		//	"curl: option -m -1: expected a positive numerical parameter"
-		// 2. entering a max_downloads greater than 1 will speed up the a4download program and
-		//    the program finishes way before the curl downloads ever finish
-		if (cur_spot >= n_lines)
+		unlink(entry->file_name);
+		if (cache_conditions(entry, conditions, sizeof(conditions)))
 		{
-			parent_process(process_ids, n_lines);
-			process_count--;
-			total_downloaded++;
-			continue;
+			// Each condition is one "Name: value\r\n" line, curl -H takes them without the line ends
+			for (char* line = strtok(conditions, "\r\n"); line != NULL; line = strtok(NULL, "\r\n"))
+			{
+				if (strncmp(line, "If-None-Match:", 14) == 0)	{ if_none_match = line; }
+				else						{ if_modified_since = line; }
+			}
 		}
+	}
+
+	char* argv[20];
+	int argc = 0;
+	argv[argc++] = "curl";
+	argv[argc++] = seconds_str;
+	if (resume)
+	{
+		argv[argc++] = "-C";
+		argv[argc++] = "-";
+	}
+	if (limit_rate > 0)
+	{
+		argv[argc++] = "--limit-rate";
+		argv[argc++] = rate_str;
+	}
+	if (if_none_match != NULL)
+	{
+		argv[argc++] = "-H";
+		argv[argc++] = if_none_match;
+	}
+	if (if_modified_since != NULL)
+	{
+		argv[argc++] = "-H";
+		argv[argc++] = if_modified_since;
+	}
+	argv[argc++] = "-D";
+	argv[argc++] = headers;
+	argv[argc++] = "-w";
+	argv[argc++] = "%{time_namelookup} %{time_connect} %{time_pretransfer} %{time_starttransfer} %{time_total} %{size_download}\n";
+	argv[argc++] = "-o";
+	argv[argc++] = entry->file_name;
+	argv[argc++] = "-s";
+	argv[argc++] = entry->url;
+	argv[argc] = NULL;
+
+	// The child starts with the signal mask this process had before SIGCHLD was blocked
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &spawn_mask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, timing, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	pid_t pid;
+	int error = posix_spawn(&pid, "/usr/bin/curl", &actions, &attr, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	if (error != 0)
+	{
+		fprintf(stderr, "curl: %s\n", strerror(error));
+		return -1;
+	}
+	return pid;
+}
 
-		// Begin child processes
-		pid_t pid = fork();
-		process_count++;
 
-		// fork() error handler
-		if (pid == -1)
+
+// Function reports how a reaped child did, recording a finished line in the journal, and then either gives
+// the line back to the manifest or puts it back in line for a retry. curl's exit status tells the failures
+// with no response apart (6 and 7 could not connect, 28 timed out, the others listed broke off), the
+// headers it saved tell a response the server turned away. 33 is a resume the server would not do.
+// The try's timings are recorded whatever came of it
+// Returns 0 if the line is done with, 1 if it is to be retried, -1 if it failed
+int report_child(Manifest* manifest, pid_t pid, int status, FileEntry* entry)
+{
+	char headers[MAX_NAME_CHARS + 16];
+	char etag[MAX_VALIDATOR_CHARS];
+	char last_modified[MAX_VALIDATOR_CHARS];
+	double retry_after;
+	snprintf(headers, sizeof(headers), "%s.headers", entry->file_name);
+	int http_status = headers_status(headers, &retry_after, etag, last_modified);
+	Timing timing;
+	snprintf(headers, sizeof(headers), "%s%s", entry->file_name, TIMING_SUFFIX);
+	timing_curl(headers, &timing);
+	int code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+
+	int outcome;
+	if      (code == 0)			{ outcome = status_outcome(http_status); }
+	else if (code == 6 || code == 7)	{ outcome = OUTCOME_CONNECT; }
+	else if (code == 28)			{ outcome = OUTCOME_TIMEOUT; }
+	else if (code == 18 || code == 33 || code == 52 || code == 55 || code == 56 || code == 92)
+						{ outcome = OUTCOME_PARTIAL; }
+	else					{ outcome = OUTCOME_FAILED; }
+
+	char exit_error[32];
+	const char* error = NULL;
+	if (code == 0)
+	{
+		printf("process %d processing line %d exited normally\n", pid, entry->line_number);
+
+		// Unchanged since it was cached: the cached copy stands in for the empty body. Otherwise curl wrote the
+		// file, which is read back once for the CRCs the journal and the cache file it under
+		struct stat st;
+		uint32_t crc;
+		uint64_t crc64;
+		long long bytes;
+		if (http_status == 304)
 		{
-			printf("Fork Error\n");
-			return -1;
+			if ((bytes = cache_restore(entry, &crc)) >= 0)	{ journal_done(entry, bytes, crc); }
+			else
+			{
+				outcome = OUTCOME_PARTIAL;
+				error = "cached copy missing";
+			}
 		}
-		// Child process: fork() returns 0
-		else if (pid == 0)
+		else if (outcome == OUTCOME_OK && stat(entry->file_name, &st) == 0
+		 && journal_file_crc(entry->file_name, st.st_size, &crc, &crc64) == 0)
 		{
-			// On fork, begin the downloading
-			printf("process %d processing line %d\n", getpid(), file_info[cur_spot].line_number);
-
-			// Helper function for the downloading: curl -m <seconds> -o <filename> -s <url>
-			child_process(file_info[cur_spot].timeout, file_info[cur_spot].file_name, file_info[cur_spot].url);
+			journal_done(entry, st.st_size, crc);
+			if (http_status >= 200 && http_status < 300)	{ cache_store(entry, etag, last_modified, st.st_size, crc, crc64); }
 		}
-		// Parent process: fork() returns the child's process ID (pid)
-		else
+	}
+	else
+	{
+		printf("process %d processing line %d terminated with exit status: %d\n", pid, entry->line_number, code);
+		snprintf(exit_error, sizeof(exit_error), "curl exit status %d", code);
+		error = exit_error;
+	}
+	timing_record(entry, outcome, &timing);
+
+	// A retry after the body broke off carries on with curl -C -, one after an error page or a refused resume starts over
+	if (retry_schedule(entry, outcome, retry_after))
+	{
+		int over = (outcome == OUTCOME_SERVER || outcome == OUTCOME_THROTTLED || code == 33);
+		entry->journal = over ? JOURNAL_NONE : JOURNAL_PARTIAL;
+		manifest_retry(manifest, entry);
+		return 1;
+	}
+
+	struct stat st;
+	report_line(entry, outcome, http_status, (stat(entry->file_name, &st) == 0) ? st.st_size : 0, error);
+	manifest_release(manifest, entry);
+	return (error == NULL) ? 0 : -1;
+}
+
+
+
+// Function downloads every line with its own curl process, at most max_downloads at a time, each held to
+// limit_rate bytes per second when that is not 0. Whenever a child exits, SIGCHLD wakes the loop, which
+// reaps every child that is done and starts a new one for each
+// Returns nothing
+void process_downloads(int max_downloads, long long limit_rate)
+{
+	PidMap children;
+	int sfd = sigchld_open(0);
+	if (sfd == -1 || pidmap_init(&children, max_downloads) != 0)
+	{
+		perror("scheduler");
+		sigchld_close(sfd);
+		return;
+	}
+
+	int running = 0;
+	while ((!manifest_finished(&manifest) || running > 0) && stop_signal == 0)
+	{
+		// Keep the window full, whichever lines the free places came from
+		FileEntry* entry;
+		while (running < max_downloads && (entry = manifest_next(&manifest)) != NULL)
 		{
-			// Copy the child's pid into our array holding all of the process ids
-			process_ids[cur_spot] = pid;
-
-			// This check fixes the problem of downloads only occuring one at a time because
-			//	as long as we haven't gone through all entries yet, cur_spot will keep
-			//	incrementing. This ensures that with each fork a process_count will increase
-			//	and with it an associated download at the correct spot in file_info
-			if (process_count < max_downloads)
+			if (cache_reuse(entry) == 0)
+			{
+				manifest_release(&manifest, entry);
+				continue;
+			}
+			pid_t pid = spawn_curl(entry, entry->journal == JOURNAL_PARTIAL, limit_rate);
+			if (pid == -1)
 			{
-				cur_spot++;
+				printf("line %d could not be started\n", entry->line_number);
+				report_line(entry, OUTCOME_FAILED, 0, 0, "could not start curl");
+				manifest_release(&manifest, entry);
 				continue;
 			}
+			// A line that was started is resumed with curl -C - should this run be cut short
+			journal_progress(entry, 0, 0);
+			printf("process %d processing line %d\n", pid, entry->line_number);
+			pidmap_put(&children, pid, (int) (entry - manifest.entries));
+			running++;
+		}
+		// With nothing running, only lines waiting out a backoff keep the loop from reading more of the manifest
+		double wait = manifest_wait(&manifest);
+		if (running == 0 && wait == 0)
+			{ continue; }
+
+		// Signals of children exiting together arrive as one, so every wakeup reaps all that are done.
+		// A retry coming due wakes the loop too, and so does SIGINT or SIGQUIT, which ends it. The children
+		// got the signal as well, their lines resume with curl -C - next run
+		struct pollfd pfd = { .fd = sfd, .events = POLLIN };
+		int ready = poll(&pfd, 1, (wait > 0) ? (int) (wait * 1000) + 1 : -1);
+		struct signalfd_siginfo info;
+		if ((ready == -1 && errno != EINTR) || (ready == 1 && read(sfd, &info, sizeof(info)) == -1 && errno != EINTR))
+		{
+			perror("signalfd");
+			break;
+		}
+		int status;
+		pid_t pid;
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+		{
+			int index = pidmap_take(&children, pid);
+			if (index == -1)
+				{ continue; }
+			report_child(&manifest, pid, status, &manifest.entries[index]);
+			running--;
+		}
+	}
 
-			// Helper function for parent, waiting for any child to be done with their download
-			parent_process(process_ids, n_lines);
+	free(children.cells);
+	sigchld_close(sfd);
+}
 
-			// On completed download, allow for another processes by decrementing and incrementing our totals
-			process_count--;
-			total_downloaded++;
-			cur_spot++;
-		}
+
+
+/* ------------------------------------------------------------ MAIN PROGRAM RUNS HERE ------------------------------------------------------------ */
+int main(int argc, char* argv[])
+{
+	// Check if the number of arguments are valid first
+	Options options;
+	int max_downloads = parse_args(argc, argv, &options);
+
+	// Signals to catch any program terminations.
+	if (signal(SIGQUIT, sig_handler) == SIG_ERR) // "CTRL + \"
+		{ printf("unable to register handler for SIGQUIT\n"); 	return 1; }
+	if (signal(SIGINT, sig_handler) == SIG_ERR) // "CTRL + C"
+		{ printf("unable to register handler for SIGINT\n"); 	return 1; }
+
+	// The journal is read first: lines it says are done are passed over as the manifest is read.
+	// The manifest is read as the downloads go, a little ahead of them, so they start right away
+	journal_open(options.input_file);
+	report_open(options.report_file, options.retries);
+	cache_open(options.cache_dir);
+	timing_open(options.trace_file);
+	if (manifest_open(&manifest, options.input_file, max_downloads, options.policy) != 0)
+	{
+		printf("Error: failed to read file %s.\n", options.input_file);
+		journal_close();
+		report_close();
+		timing_close();
+		exit(EXIT_FAILURE);
 	}
-	free_file_info();
+
+	/* - - - - - The downloading - - - - - - */
+
+	// The http engine fetches what it can itself and hands the rest to curl,
+	// otherwise every line gets its own curl process
+	options.max_downloads = max_downloads;
+	if (options.engine == ENGINE_HTTP)	{ http_run(&manifest, &options); }
+	else					{ process_downloads(max_downloads, curl_share(&options)); }
+	if (stop_signal != 0)
+		{ stop_exit(stop_signal); }
+
+	// The manifest is all read only once every line of it has been through
+	if (manifest.fp == NULL)	{ journal_finish(); }
+	journal_close();
+	report_close();
+	timing_close();
+	cache_close();
+	manifest_close(&manifest);
 }
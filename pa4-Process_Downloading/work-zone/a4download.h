@@ -1,10 +1,34 @@
+// getopt, strcasecmp, clock_gettime, getaddrinfo and strptime are POSIX, getaddrinfo_a glibc's, and splice,
+// fallocate, eventfd and O_DIRECT Linux's, all hidden by -std=c99 otherwise
+#define _GNU_SOURCE
+
 /* IMPORTS */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <dirent.h>
 
 /* CONSTANTS */
 #define DEFAULT_DOWNLOADS 2
@@ -12,6 +36,86 @@
 #define MAX_NAME_CHARS 64
 #define MAX_URL_CHARS  124
 #define MAX_DOWNLOAD_TIME 20
+#define MANIFEST_AHEAD 256	// lines parsed ahead of the downloads, beyond one per download running;
+				// the scheduling policy picks among these
+
+// Scheduling policies, chosen with -s
+#define POLICY_FIFO 0		// manifest order
+#define POLICY_EDF 1		// earliest deadline first: the line whose timeout runs out soonest
+#define POLICY_SJF 2		// shortest expected first, sized by HEAD requests (http engine only)
+#define POLICY_FAIR 3		// the line whose host has the fewest downloads running
+#define FAIR_BUCKETS 1024	// hosts are counted in this many hash buckets, a power of 2
+
+// FileEntry.expected_bytes before and instead of a size
+#define EXPECT_UNKNOWN -1	// no size to go by
+#define EXPECT_UNPROBED -2	// waiting for a HEAD request
+#define EXPECT_PROBING -3	// HEAD request on its way
+
+// Download engines, chosen with -e
+#define ENGINE_CURL 0		// one curl process per line
+#define ENGINE_HTTP 1		// every http:// line from this process over non-blocking sockets
+
+#define HTTP_BUF_SIZE 16384	// bytes read from a socket at a time, per connection
+#define MAX_HEADER_BYTES 8192	// a response whose headers do not fit is rejected
+#define MAX_HOST_CHARS 256
+#define HOST_BUCKETS 256	// hash buckets of the resolved host table, a power of 2
+#define MAX_EVENTS 256		// epoll events handled per wakeup
+#define LOOP_TICK_MS 100	// timeouts are checked at least this often
+#define DEFAULT_HOST_CONNS 6	// -c: connections kept to one host
+#define DEFAULT_PIPELINE 4	// -p: requests sent ahead on one connection
+#define MAX_PIPELINE 16
+#define IDLE_TIMEOUT 5.0	// seconds an unused keep-alive connection is kept
+#define MAX_REQUEUES 3		// times a request is resent after its connection closed before answering it
+#define MAX_RANGES 16		// -r: most segments a file is split into
+#define MAX_PROBES 32		// -s sjf: HEAD requests out at once
+#define PROBE_TIMEOUT 2.0	// seconds a HEAD request may take before its line is left unsized
+#define SEGMENT_MIN_BYTES (1 << 20)	// no segment is made smaller than this
+
+// How the http engine writes what it receives
+#define SPLICE_MIN_BYTES (256 << 10)	// a body with more than this to go moves from socket to file through a pipe
+#define SPLICE_PIPE_SIZE (1 << 20)	// bytes the pipe is asked to hold, and moved at a time
+#define DIRECT_MIN_BYTES (64 << 20)	// -d: files at least this large are written with O_DIRECT
+#define DIRECT_BUF_SIZE (1 << 20)	// in blocks of this many bytes, gathered in a buffer aligned to DIRECT_ALIGN
+#define DIRECT_ALIGN 4096
+
+// Bandwidth shaping, -b for the whole run and -B per host
+#define RATE_BURST 0.25		// seconds' worth of bytes a token bucket holds when full
+#define AIMD_INTERVAL 1.0	// seconds between adjustments of the number of downloads let run
+#define AIMD_CEILING 0.9	// throughput above this share of -b counts as the ceiling reached
+
+// Progress journal, kept next to the manifest
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_INTERVAL 2.0	// seconds between progress records of a running download
+#define JOURNAL_NONE 0		// nothing recorded for the line
+#define JOURNAL_PARTIAL 1	// started, resume_bytes of it on disk
+#define JOURNAL_DONE 2		// finished, resume_bytes long
+
+// Retries, and the report of how every line ended, written to the file -o names
+#define DEFAULT_RETRIES 3	// -R: times a line that failed for a passing reason is tried again
+#define RETRY_BASE 0.5		// seconds before the first retry, doubled for every one after, give or take half
+#define RETRY_MAX 30.0		// longest backoff
+#define RETRY_AFTER_MAX 120.0	// longest Retry-After honoured
+
+// How a line ended, in the report; the first five are tried again
+#define OUTCOME_CONNECT 0	// no response: no connection, or it closed before any answer
+#define OUTCOME_TIMEOUT 1	// ran past its timeout
+#define OUTCOME_SERVER 2	// HTTP 5xx
+#define OUTCOME_THROTTLED 3	// HTTP 429
+#define OUTCOME_PARTIAL 4	// the body broke off part way
+#define OUTCOME_OK 5		// downloaded
+#define OUTCOME_CLIENT 6	// HTTP 4xx other than 429, the file holds the error page
+#define OUTCOME_FAILED 7	// anything else: a bad URL, a host that does not resolve, a file that cannot be written
+#define OUTCOME_INTERRUPTED 8	// cut short by SIGINT or SIGQUIT
+#define OUTCOME_SKIPPED 9	// already downloaded, by the journal
+
+// Download cache, kept in the directory -k names
+#define MAX_VALIDATOR_CHARS 128	// longest ETag or Last-Modified kept
+#define CACHE_MAX_BYTES (1LL << 30)	// objects kept once a run ends, the least recently used go first
+
+// Timings of every try, summed up at the end of the run and traced line by line with -t
+#define TIMING_SUFFIX ".timing"	// where a curl child's -w output goes, next to its file
+#define TIMING_BUCKETS 512	// histogram buckets: 8 to every power of 2, so a percentile is off by 1/8 at most
+#define RATE_MIN_BYTES 4096	// a body smaller than this is over too soon for its rate to tell anything
 
 
 /* STRUCTS */
@@ -21,8 +125,373 @@ typedef struct {
 	char* url;		// 2. URL,
 	int timeout;		// 3. optional max-number of seconds for download
 	int line_number;	// 4. the line number to assist in display and access
+	int journal;		// 5. what the journal says of it, one of the JOURNAL_ values, with the bytes
+	long long resume_bytes;	//    already on disk and their CRC-32 and CRC-64
+	uint32_t resume_crc;
+	uint64_t resume_crc64;
+	double deadline;	// 6. when its timeout runs out, counted from when the line was read
+	long long expected_bytes;	// 7. its size for -s sjf, or one of the EXPECT_ values
+	unsigned host_bucket;	// 8. which FAIR_BUCKETS counter its host is counted in
+	int attempts;		// 9. tries so far, and when the next may start after one failed
+	double not_before;
+	uint64_t url_key;	// 10. hash of the URL while the entry is in use with a cache, 0 otherwise, and the entry
+	int waiting_on;		//     of an earlier line fetching the same URL that it waits for, -1 if none
+	double ready;		// 11. when it joined the waiting lines or came due for a retry, and when its try began
+	double started;
 } FileEntry ;
-// a variable called file_info will be the array holding a FileEntry
-// and each FileEntry is a line extracted from the file, holding these 4 key pieces
+// Each FileEntry is a line extracted from the file, holding these key pieces; the manifest hands them out
+// as the downloads need them
+
+// The manifest, read only as far as the downloads have got. Parsed lines wait in a ring, and every line
+// being worked on holds one of a fixed number of entries, its strings in that entry's strip of one arena,
+// so memory is the same however long the manifest is
+typedef struct {
+	FILE* fp;		// 1. the manifest file, NULL once it is all read
+	int line_number;	// 2. lines read so far
+	FileEntry* entries;	// 3. the entries, size of them, and the arena their strings live in
+	int size;
+	char* arena;
+	int* free_list;		// 4. entries not in use
+	int n_free;
+	int* pending;		// 5. entries parsed and waiting for a download, in no particular order
+	int count;
+	int policy;		// 6. how the next one is picked from them
+	int host_running[FAIR_BUCKETS];	// 7. downloads running per host bucket
+} Manifest ;
+
+// One line's last record in the journal, as journal_lookup needs it
+typedef struct {
+	int line_number;	// 1. the line, and the order its records were written in
+	int seq;
+	int state;		// 2. JOURNAL_PARTIAL or JOURNAL_DONE, with the bytes and their CRC-32
+	long long bytes;
+	uint32_t crc;
+	uint64_t key;		// 3. hash of the file name and URL, so a record for an edited line does not count
+} JournalRecord ;
+
+// The command line, once parsed
+typedef struct {
+	char* input_file;	// 1. the manifest
+	int max_downloads;	// 2. downloads running at once
+	int engine;		// 3. one of the ENGINE_ values
+	int host_conns;		// 4. -c: keep-alive connections per host for the http engine
+	int pipeline;		// 5. -p: requests pipelined per connection
+	int ranges;		// 6. -r: segments a large file is fetched in at once, 1 to fetch files whole
+	int policy;		// 7. -s: which waiting line starts next, one of the POLICY_ values
+	long long rate;		// 8. -b and -B: bytes per second for all downloads together and to any one host, 0 for no limit
+	long long host_rate;
+	int retries;		// 9. -R: times a line is tried again, and -o: where the report goes, NULL for nowhere
+	char* report_file;
+	char* cache_dir;	// 10. -k: the download cache, NULL for none
+	char* trace_file;	// 11. -t: where every try's timings go, CSV if it ends in .csv and JSON otherwise, NULL for nowhere
+	int direct;		// 12. -d: large files bypass the page cache
+} Options ;
+
+// What the cache knows of a URL
+typedef struct {
+	char etag[MAX_VALIDATOR_CHARS];		// 1. validators of the response it was fetched with, "-" for none
+	char last_modified[MAX_VALIDATOR_CHARS];
+	char object[64];			// 2. the object holding its content, and its size
+	long long size;
+	char run[32];				// 3. the run that last fetched or revalidated it
+} CacheRecord ;
+
+// An object found in the cache when it is cut down to size
+typedef struct {
+	char name[64];		// 1. its name in objects/, made of its CRCs and size
+	long long size;		// 2. bytes it takes
+	time_t used;		// 3. when it was last used, kept as its mtime
+} CacheObject ;
+
+// How long one try at a line spent on each part of it, in seconds, -1 for a part it never got to
+typedef struct {
+	double queued;		// 1. waiting to start, from when the line was read or came due for a retry
+	double dns;		// 2. resolving the host, 0 when it was resolved already
+	double connect;		// 3. opening the connection, 0 when it went on one already open
+	double ttfb;		// 4. from the request going out to the first byte of the response
+	double transfer;	// 5. from the first byte to the last, and the whole try from start to end
+	double total;
+	long long bytes;	// 6. bytes of the response body received
+} Timing ;
+
+// Values counted into buckets of about the same relative width, for percentiles in fixed memory
+typedef struct {
+	long long count;		// 1. values counted, their sum and the largest
+	double sum;
+	double max;
+	long long buckets[TIMING_BUCKETS];	// 2. how many fell in each
+} Histogram ;
+
+// A running child, in a table hashed by pid with linear probing
+typedef struct {
+	pid_t pid;		// 1. 0 when the cell is free
+	int value;		// 2. what it is working on: its line, or its slot in the http engine
+} PidCell ;
+
+typedef struct {
+	PidCell* cells;		// 1. a power of 2 of them, at least twice as many as children run at once
+	size_t mask;
+} PidMap ;
+
+// A token bucket: bytes may be read while it holds tokens, and it fills at rate up to RATE_BURST seconds' worth
+typedef struct {
+	double rate;		// 1. bytes per second, 0 for no limit
+	double tokens;		// 2. bytes that may be read now, below 0 after a read took more than was left
+	double last;		// 3. when it was last filled
+} TokenBucket ;
+
+struct HttpJob;
+struct HttpConn;
+
+// A host every http:// line naming it shares: resolved once, with its own pool of connections
+typedef struct HttpHost {
+	char* name;			// 1. host and port as written in the URL
+	char* port;
+	struct addrinfo* addrs;		// 2. result of getaddrinfo, NULL until resolved, and the address new connections
+	struct addrinfo* addr;		//    try first: the first one, until another answered where it did not
+	int failed;			// 3. set when the name did not resolve, so it is not tried again, and while it is
+	int resolving;			//    being resolved off the loop, the getaddrinfo_a request doing it
+	struct gaicb lookup;
+	struct HttpConn* conns;		// 4. open connections, at most Options.host_conns of them
+	int n_conns;
+	struct HttpJob* wait_head;	// 5. jobs waiting for room on a connection, oldest first
+	struct HttpJob* wait_tail;
+	struct HttpHost* next;		// 6. next host in the same hash bucket
+	TokenBucket bucket;		// 7. -B: bytes its connections may read
+} HttpHost ;
+
+// One running download of the http engine: a request on a connection, or a curl child for URLs it cannot fetch itself
+typedef struct HttpJob {
+	FileEntry* entry;	// 1. the line being downloaded, NULL when the slot is free
+	pid_t pid;		// 2. curl child fetching it instead, 0 otherwise
+	HttpHost* host;		// 3. where it goes, and the connection carrying it, NULL while it waits for one
+	struct HttpConn* conn;
+	char* request;		// 4. the request, sent as the connection accepts it
+	size_t request_len;
+	int header_done;	// 5. the response so far
+	int status;
+	int close_after;	// 6. the server will close the connection after this response
+	long long content_length;	// 7. body length, -1 when the body runs until the connection closes
+	long long body_bytes;	// 8. body bytes written so far
+	int chunked;		// 9. Transfer-Encoding: chunked, and where the decoder is
+	int chunk_state;
+	long long chunk_left;
+	int out_fd;		// 10. the output file, opened once the headers are in
+	double deadline;	// 11. monotonic time the line's timeout runs out
+	int requeues;		// 12. times it was moved to another connection after its own closed under it
+	struct HttpJob* next;	// 13. next job waiting on the same host
+	int probe;		// 14. -r: the request asks for bytes=0-0 to learn the size and whether ranges work
+	long long range_from;	// 15. a segment's byte range of the file, written in place with pwrite
+	long long range_to;
+	long long range_start;	// 16. from Content-Range: where the response starts, and the whole size
+	long long range_total;
+	struct HttpJob* parent;	// 17. a segment's file, and a file's segments still running, with the CRCs and length
+	struct HttpJob* segments[MAX_RANGES];	//     of each one that finished, combined in order once they all have
+	int segments_left;
+	uint32_t segment_crc[MAX_RANGES];
+	uint64_t segment_crc64[MAX_RANGES];
+	long long segment_bytes[MAX_RANGES];
+	char error[64];		// 18. why a segment failed, reported for the whole file
+	int split;		// 19. the file was fetched as segments
+	long long resume_from;	// 20. bytes of the file kept from an earlier run, and whether the server carried on from there
+	int resumed;
+	uint32_t crc;		// 21. CRC-32 and CRC-64 of the body so far: of a segment, its range; of a split file,
+	uint64_t crc64;		//     its first byte
+	long long journaled;	// 22. bytes of it the journal last recorded
+	int head;		// 23. a HEAD request sizing a waiting line for -s sjf, and the size it found
+	long long head_bytes;
+	double retry_after;	// 24. seconds the server asked to wait with Retry-After, -1 if it did not
+	char conditions[2 * MAX_VALIDATOR_CHARS + 48];	// 25. If-None-Match and If-Modified-Since lines for a cached URL,
+	char etag[MAX_VALIDATOR_CHARS];			//     and the validators the response came with
+	char last_modified[MAX_VALIDATOR_CHARS];
+	double dns;		// 26. how long resolving its host took, how long its connection took to open when the
+	double connect;		//     request was the first on it (-1 until the request is sent), and when the request
+	double sent_at;		//     was sent and the response started arriving, 0 until they were
+	double first_byte;
+	int spliced;		// 27. the body went to the file by splice
+	char* direct_buf;	// 28. -d: the body's next block for O_DIRECT, and the bytes in it, NULL when not writing direct
+	size_t direct_len;
+} HttpJob ;
+
+// A connection to a host, carrying pipelined requests whose responses come back in order
+typedef struct HttpConn {
+	int fd;			// 1. the socket
+	int state;		// 2. one of the CONN_ values
+	HttpHost* host;
+	HttpJob* queue[MAX_PIPELINE];	// 3. jobs sent or about to be, oldest (the one being answered) first
+	int head;
+	int count;
+	int n_sent;		// 4. queued jobs whose request is fully sent, and how far into the next one we are
+	size_t sent_off;
+	char* buf;		// 5. bytes read but not yet consumed, HTTP_BUF_SIZE plus a terminator
+	size_t buf_len;
+	int persistent;		// 6. a response on it kept the connection open, so requests may be pipelined
+	int served;		// 7. responses completed on it
+	double idle_since;	// 8. when the queue last ran empty
+	struct HttpConn* next;	// 9. next connection to the same host
+	int throttled;		// 10. not read from until the buckets it draws on fill again
+	double opened;		// 11. when it was opened, and how long the handshake took until a request was sent on it
+	double handshake;
+	struct addrinfo* addr;	// 12. the host's address it connects to, the next ones are tried if it refuses
+} HttpConn ;
+
+// Connection states
+#define CONN_CONNECTING 0
+#define CONN_OPEN 1
+
+// Chunked decoder states
+#define CHUNK_SIZE 0		// reading the hex size line
+#define CHUNK_DATA 1		// chunk_left bytes of data to go
+#define CHUNK_DATA_END 2	// the CRLF after the data
+#define CHUNK_TRAILER 3		// trailer lines up to the empty one
+
+// The http engine's running state
+typedef struct {
+	int epfd;			// 1. epoll instance all connections are registered with
+	HttpJob* jobs;			// 2. one per download allowed at once
+	int n_jobs;
+	int active;			// 3. jobs in use
+	HttpHost* hosts[HOST_BUCKETS];	// 4. hosts seen so far
+	int host_conns;			// 5. connections allowed per host
+	int pipeline;			// 6. requests in flight per connection
+	int ranges;			// 7. segments per large file
+	int failed;			// 8. lines that did not download
+	int sfd;			// 9. signalfd for SIGCHLD, and the curl children running, by pid
+	PidMap children;
+	Manifest* manifest;		// 10. where lines come from, and go back to once done
+	HttpJob* probes[MAX_PROBES];	// 11. HEAD requests out for -s sjf
+	int n_probes;
+	TokenBucket bucket;		// 12. -b: bytes all connections together may read, and -B for every host's bucket
+	double host_rate;
+	int window;			// 13. downloads let run at once, at most n_jobs: shrunk by half when downloads
+	int aimd;			//     fail and grown by one while they do not, when shaping is on
+	long long window_bytes;		// 14. bytes read and downloads failed since the window was last adjusted
+	int window_errors;
+	double window_start;
+	long long curl_rate;		// 15. --limit-rate for each curl child, 0 for none
+	int pipe[2];			// 16. what bodies are spliced through, -1 when there is none, the pipe tee(2) copies
+	int tee[2];			//     them to so they are checksummed on the way, and -d
+	int direct;
+	int rfd;			// 17. eventfd a host's lookup writes to once it is done, registered like sfd
+} HttpEngine ;
+
+// Set by sig_handler; either engine stops at its next wakeup, and main cleans up and exits after it
+extern volatile sig_atomic_t stop_signal;
+extern char** environ;
 
 /* PROGRAM FUNCTIONS */
+
+void sig_handler(int signum);
+
+int parse_args(int argc, char* argv[], Options* options);
+
+int manifest_open(Manifest* manifest, char* input_file, int running, int policy);
+
+FileEntry* manifest_next(Manifest* manifest);
+
+FileEntry* manifest_unprobed(Manifest* manifest);
+
+void manifest_release(Manifest* manifest, FileEntry* entry);
+
+void manifest_retry(Manifest* manifest, FileEntry* entry);
+
+double manifest_wait(Manifest* manifest);
+
+int manifest_finished(Manifest* manifest);
+
+void manifest_close(Manifest* manifest);
+
+int pidmap_init(PidMap* map, int n);
+
+void pidmap_put(PidMap* map, pid_t pid, int value);
+
+int pidmap_take(PidMap* map, pid_t pid);
+
+int sigchld_open(int flags);
+
+void sigchld_close(int sfd);
+
+long long parse_rate(const char* text);
+
+long long curl_share(Options* options);
+
+pid_t spawn_curl(FileEntry* entry, int resume, long long limit_rate);
+
+int report_child(Manifest* manifest, pid_t pid, int status, FileEntry* entry);
+
+void process_downloads(int max_downloads, long long limit_rate);
+
+/* HTTP ENGINE (a4http.c) */
+double now_seconds(void);
+
+int parse_url(const char* url, char* host, char* port, const char** path);
+
+int http_run(Manifest* manifest, Options* options);
+
+/* PROGRESS JOURNAL (a4journal.c) */
+uint32_t crc32_update(uint32_t crc, const void* data, size_t len);
+
+uint64_t crc64_update(uint64_t crc, const void* data, size_t len);
+
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, long long len2);
+
+uint64_t crc64_combine(uint64_t crc1, uint64_t crc2, long long len2);
+
+int journal_file_crc(const char* file_name, long long bytes, uint32_t* crc, uint64_t* crc64);
+
+int journal_open(const char* input_file);
+
+void journal_lookup(FileEntry* entry);
+
+void journal_progress(FileEntry* entry, long long bytes, uint32_t crc);
+
+void journal_done(FileEntry* entry, long long bytes, uint32_t crc);
+
+void journal_finish(void);
+
+void journal_close(void);
+
+/* RETRIES AND THE REPORT (a4retry.c) */
+int report_open(const char* report_file, int retries);
+
+int status_outcome(int status);
+
+double retry_after_seconds(const char* value);
+
+void header_value(const char* text, char* value);
+
+int headers_status(const char* path, double* retry_after, char* etag, char* last_modified);
+
+int retry_schedule(FileEntry* entry, int outcome, double retry_after);
+
+const char* outcome_name(int outcome);
+
+void report_line(FileEntry* entry, int outcome, int status, long long bytes, const char* error);
+
+void report_close(void);
+
+/* DOWNLOAD CACHE (a4cache.c) */
+int cache_open(const char* cache_dir);
+
+int cache_enabled(void);
+
+uint64_t cache_url_key(const char* url);
+
+int cache_conditions(FileEntry* entry, char* conditions, size_t size);
+
+long long cache_restore(FileEntry* entry, uint32_t* crc);
+
+int cache_reuse(FileEntry* entry);
+
+void cache_store(FileEntry* entry, const char* etag, const char* last_modified, long long size, uint32_t crc, uint64_t crc64);
+
+void cache_close(void);
+
+/* TIMINGS (a4timing.c) */
+int timing_open(const char* trace_file);
+
+void timing_record(FileEntry* entry, int outcome, Timing* timing);
+
+void timing_curl(const char* path, Timing* timing);
+
+void timing_close(void);
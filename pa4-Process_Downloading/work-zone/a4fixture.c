@@ -0,0 +1,590 @@
+// getopt and clock_gettime are POSIX and accept4 is Linux's, hidden by -std=c99 otherwise
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// Local HTTP server for "make bench" and for trying a4download without the internet: a4fixture [-p port] [-q]
+// listens on 127.0.0.1 (port 0, the default, picks a free one), prints "port N" once it does, and serves
+// until SIGINT or SIGTERM. Every file is made up as it is sent, so any size costs nothing:
+//	GET or HEAD /bytes/N		N bytes, byte i being 'a' + i % 26, with ETag "N"
+// and a query string changes how it is served:
+//	delay=MS	wait MS milliseconds before answering
+//	rate=B		send the body at B bytes per second
+//	chunked=1	send it with Transfer-Encoding: chunked
+//	norange=1	ignore Range and If-None-Match, always 200 and the whole file
+//	drop=B		close the connection after B bytes of the body
+//	status=CODE	answer CODE with a short error body instead, or only the first fail=K times this exact URL
+//			is asked for; retry=S adds Retry-After: S
+// Otherwise Range (one range, bytes=A-B or bytes=A-) gets 206 or 416, and a matching If-None-Match gets 304.
+// Connections are kept alive and pipelined requests answered in order, all from one epoll loop
+
+
+
+/* CONSTANTS */
+#define MAX_REQUEST 8192	// bytes of requests a connection buffers; a request must fit
+#define OUT_SIZE 65536		// bytes of a response made ahead of the socket
+#define CHUNK_SIZE 16384	// body bytes per chunk of a chunked response
+#define PATTERN_SIZE 4096	// body bytes copied at a time from the pattern
+#define FAIL_SLOTS 4096		// URLs whose fail=K is counted, a power of 2
+#define LISTEN_BACKLOG 4096
+#define MAX_EVENTS 256
+#define RATE_SLICE 0.05		// seconds' worth of a rate=B body sent at a time
+
+
+
+/* STRUCTS */
+// A client connection, and the response it is being sent
+typedef struct {
+	int fd;				// 1. the socket
+	char in[MAX_REQUEST + 1];	// 2. requests read but not answered yet, and a terminator
+	size_t in_len;
+	char out[OUT_SIZE];		// 3. response bytes made but not sent yet
+	size_t out_len;
+	size_t out_off;
+	int busy;			// 4. a response is under way
+	long long body_pos;		// 5. the part of the file the body still has to carry, and where to cut it off
+	long long body_end;
+	long long drop_at;
+	int chunked;			// 6. chunked, and whether the last chunk has been made
+	int body_done;
+	long long rate;			// 7. rate=B, 0 for as fast as the socket takes it
+	double wake_at;			// 8. nothing is sent before this time, 0 when there is no wait
+	int close_after;		// 9. the client asked for the connection to close after this response
+} FixConn ;
+
+// How often a URL with fail=K has been asked for, by the hash of the URL
+typedef struct {
+	uint64_t key;
+	int count;
+} FailSlot ;
+
+
+
+/* GLOBALS */
+static volatile sig_atomic_t stop = 0;
+static FixConn** conns;		// connections by descriptor
+static int n_conns_max;		// size of conns
+static int max_fd = 0;		// highest descriptor that may be in use
+static int epfd;
+static FailSlot fail_slots[FAIL_SLOTS];
+static char pattern[PATTERN_SIZE + 26];
+static int quiet = 0;
+static long long served = 0;
+static long long body_bytes = 0;
+
+
+
+/* PROGRAM FUNCTIONS */
+// Function stops the server at its next wakeup
+void on_signal(int signum)
+{
+	(void) signum;
+	stop = 1;
+}
+
+
+
+// Function reads the monotonic clock
+// Returns the time in seconds
+double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+// Function counts one more request for a URL with fail=K
+// Returns how many times it was asked for before this one
+int fail_count(const char* url, size_t len)
+{
+	uint64_t key = 14695981039346656037ull;
+	for (size_t i = 0; i < len; i++)
+		{ key = (key ^ (unsigned char) url[i]) * 1099511628211ull; }
+	key |= 1;
+
+	// A full table counts every further URL as asked for often enough to be served
+	for (size_t i = key & (FAIL_SLOTS - 1), probes = 0; probes < FAIL_SLOTS; i = (i + 1) & (FAIL_SLOTS - 1), probes++)
+	{
+		if (fail_slots[i].key == 0)
+			{ fail_slots[i].key = key; }
+		if (fail_slots[i].key == key)
+			{ return fail_slots[i].count++; }
+	}
+	return 1 << 30;
+}
+
+
+
+// Function finds a query parameter's value in the query of url, up to end
+// Returns the value as a number, fallback if the parameter is not there
+long long query_value(const char* query, const char* end, const char* name, long long fallback)
+{
+	size_t name_len = strlen(name);
+	for (const char* at = query; at != NULL && at < end; )
+	{
+		if ((size_t) (end - at) > name_len && strncmp(at, name, name_len) == 0 && at[name_len] == '=')
+			{ return strtoll(at + name_len + 1, NULL, 10); }
+		at = memchr(at, '&', (size_t) (end - at));
+		if (at != NULL)	{ at++; }
+	}
+	return fallback;
+}
+
+
+
+// Function sets which events a connection waits for: readable while its buffer has room, writable while
+// a response is under way and not held back by a wait
+void conn_arm(FixConn* conn)
+{
+	struct epoll_event ev = { .events = 0, .data.fd = conn->fd };
+	if (conn->in_len < MAX_REQUEST)
+		{ ev.events |= EPOLLIN; }
+	if (conn->busy && conn->wake_at == 0)
+		{ ev.events |= EPOLLOUT; }
+	epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+
+
+// Function closes a connection and frees its slot
+void conn_close(FixConn* conn)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	conns[conn->fd] = NULL;
+	free(conn);
+}
+
+
+
+// Function starts the response to the request at the front of a connection's buffer, if one is all there
+// Returns 1 if it did, 0 if the request is not all in yet, -1 if it is malformed (the connection is to close)
+int conn_request(FixConn* conn)
+{
+	char* end = NULL;
+	for (size_t i = 3; i < conn->in_len; i++)
+	{
+		if (conn->in[i] == '\n' && conn->in[i - 1] == '\r' && conn->in[i - 2] == '\n' && conn->in[i - 3] == '\r')
+		{
+			end = conn->in + i + 1;
+			break;
+		}
+	}
+	if (end == NULL)
+		{ return (conn->in_len >= MAX_REQUEST) ? -1 : 0; }
+
+	// The request line: method, target, version
+	char method[8];
+	char version[16];
+	int target_at, target_end;
+	if (sscanf(conn->in, "%7s %n%*s%n %15s", method, &target_at, &target_end, version) != 2)
+		{ return -1; }
+	const char* target = conn->in + target_at;
+	const char* target_stop = conn->in + target_end;
+	int head = (strcmp(method, "HEAD") == 0);
+	conn->close_after = (strcmp(version, "HTTP/1.0") == 0);
+
+	// The headers that matter here
+	long long range_from = -1, range_to = -1;
+	char if_none_match[64] = "";
+	for (char* line = strchr(conn->in, '\n') + 1; line < end - 2; line = strchr(line, '\n') + 1)
+	{
+		if (strncasecmp(line, "Range:", 6) == 0)
+		{
+			if (sscanf(line + 6, " bytes=%lld-%lld", &range_from, &range_to) < 1)
+				{ range_from = -1; }
+		}
+		else if (strncasecmp(line, "If-None-Match:", 14) == 0)
+			{ sscanf(line + 14, " %63[^\r]", if_none_match); }
+		else if (strncasecmp(line, "Connection:", 11) == 0)
+		{
+			if (strncasecmp(line + 11, " close", 6) == 0)	{ conn->close_after = 1; }
+			if (strncasecmp(line + 11, " keep-alive", 11) == 0)	{ conn->close_after = 0; }
+		}
+	}
+
+	const char* query = memchr(target, '?', (size_t) (target_stop - target));
+	const char* path_end = (query != NULL) ? query++ : target_stop;
+	long long size = -1;
+	if (path_end - target > 7 && strncmp(target, "/bytes/", 7) == 0)
+		{ size = strtoll(target + 7, NULL, 10); }
+	long long delay = query_value(query, target_stop, "delay", 0);
+	long long status = query_value(query, target_stop, "status", 0);
+	long long fail = query_value(query, target_stop, "fail", 0);
+	long long retry = query_value(query, target_stop, "retry", -1);
+	int norange = (int) query_value(query, target_stop, "norange", 0);
+
+	// The status line and headers go out first, then the body is made as the socket takes it
+	char headers[512];
+	int len;
+	long long from = 0, to = size - 1;
+	conn->chunked = 0;
+	conn->drop_at = -1;
+	conn->rate = 0;
+	if (size < 0)
+	{
+		len = snprintf(headers, sizeof(headers), "HTTP/1.1 404 Not Found\r\nContent-Length: 10\r\n\r\n");
+		from = 0;
+		to = 9;
+	}
+	else if (status > 0 && (fail == 0 || fail_count(target, (size_t) (target_stop - target)) < fail))
+	{
+		char retry_after[40] = "";
+		if (retry >= 0)	{ snprintf(retry_after, sizeof(retry_after), "Retry-After: %lld\r\n", retry); }
+		len = snprintf(headers, sizeof(headers), "HTTP/1.1 %lld Fixture Error\r\nContent-Length: 6\r\n%s\r\n", status, retry_after);
+		from = 0;
+		to = 5;
+	}
+	else
+	{
+		char etag[32];
+		snprintf(etag, sizeof(etag), "\"%lld\"", size);
+		conn->chunked = (int) query_value(query, target_stop, "chunked", 0);
+		conn->drop_at = query_value(query, target_stop, "drop", -1);
+		conn->rate = query_value(query, target_stop, "rate", 0);
+
+		char length[64];
+		if (!norange && strcmp(if_none_match, etag) == 0)
+		{
+			len = snprintf(headers, sizeof(headers), "HTTP/1.1 304 Not Modified\r\nETag: %s\r\n\r\n", etag);
+			to = -1;
+			conn->chunked = 0;
+		}
+		else if (!norange && range_from >= size)
+		{
+			len = snprintf(headers, sizeof(headers), "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%lld\r\nContent-Length: 0\r\n\r\n", size);
+			to = -1;
+			conn->chunked = 0;
+		}
+		else
+		{
+			int partial = (!norange && range_from >= 0);
+			if (partial)
+			{
+				from = range_from;
+				to = (range_to >= 0 && range_to < size) ? range_to : size - 1;
+			}
+			if (conn->chunked)	{ snprintf(length, sizeof(length), "Transfer-Encoding: chunked"); }
+			else			{ snprintf(length, sizeof(length), "Content-Length: %lld", to - from + 1); }
+			char content_range[96] = "";
+			if (partial)	{ snprintf(content_range, sizeof(content_range), "Content-Range: bytes %lld-%lld/%lld\r\n", from, to, size); }
+			len = snprintf(headers, sizeof(headers), "HTTP/1.1 %s\r\n%s\r\nETag: %s\r\n%sAccept-Ranges: %s\r\n%s\r\n",
+				partial ? "206 Partial Content" : "200 OK", length, etag, content_range, norange ? "none" : "bytes",
+				conn->close_after ? "Connection: close\r\n" : "");
+		}
+	}
+
+	// The error bodies are made from the pattern too: "abcdef" for an error, "abcdefghij" for a 404
+	memcpy(conn->out, headers, (size_t) len);
+	conn->out_len = (size_t) len;
+	conn->out_off = 0;
+	conn->body_pos = from;
+	conn->body_end = head ? from : to + 1;
+	if (conn->drop_at >= 0)
+		{ conn->drop_at += from; }
+	conn->body_done = 0;
+	conn->busy = 1;
+	conn->wake_at = (delay > 0) ? now_seconds() + delay / 1000.0 : 0;
+	if (head)
+		{ conn->chunked = 0; }
+
+	// What is left of the buffer is the next request, pipelined
+	conn->in_len -= (size_t) (end - conn->in);
+	memmove(conn->in, end, conn->in_len + 1);
+	served++;
+	return 1;
+}
+
+
+
+// Function makes more of a connection's response, as much as fits in its buffer or its rate allows now
+void conn_fill(FixConn* conn)
+{
+	if (conn->out_off == conn->out_len)
+		{ conn->out_off = conn->out_len = 0; }
+
+	long long allow = OUT_SIZE;
+	if (conn->rate > 0)
+		{ allow = (long long) (conn->rate * RATE_SLICE) + 1; }
+	while (!conn->body_done && allow > 0 && OUT_SIZE - conn->out_len > 32)
+	{
+		long long left = conn->body_end - conn->body_pos;
+		if (conn->drop_at >= 0 && conn->drop_at - conn->body_pos < left)
+			{ left = conn->drop_at - conn->body_pos; }
+		if (left <= 0)
+		{
+			// A chunked body ends with an empty chunk, unless it is being cut off
+			if (conn->chunked && (conn->drop_at < 0 || conn->body_pos < conn->drop_at))
+			{
+				memcpy(conn->out + conn->out_len, "0\r\n\r\n", 5);
+				conn->out_len += 5;
+			}
+			conn->body_done = 1;
+			break;
+		}
+
+		long long n = OUT_SIZE - (long long) conn->out_len - 32;
+		if (n > left)		{ n = left; }
+		if (n > allow)		{ n = allow; }
+		if (conn->chunked)
+		{
+			if (n > CHUNK_SIZE)	{ n = CHUNK_SIZE; }
+			conn->out_len += (size_t) sprintf(conn->out + conn->out_len, "%llx\r\n", (unsigned long long) n);
+		}
+		for (long long done = 0; done < n; )
+		{
+			long long piece = n - done;
+			if (piece > PATTERN_SIZE)	{ piece = PATTERN_SIZE; }
+			memcpy(conn->out + conn->out_len, pattern + (conn->body_pos + done) % 26, (size_t) piece);
+			conn->out_len += (size_t) piece;
+			done += piece;
+		}
+		if (conn->chunked)
+		{
+			memcpy(conn->out + conn->out_len, "\r\n", 2);
+			conn->out_len += 2;
+		}
+		conn->body_pos += n;
+		allow -= n;
+		body_bytes += n;
+	}
+}
+
+
+
+// Function sends what it can of a connection's response. A finished response closes the connection when asked
+// to (or when it was cut short), otherwise the next request buffered behind it is started
+// Returns 0 if the connection carries on, -1 if it was closed
+int conn_write(FixConn* conn)
+{
+	while (conn->busy)
+	{
+		if (conn->wake_at != 0)
+			{ break; }
+		conn_fill(conn);
+		if (conn->out_off < conn->out_len)
+		{
+			ssize_t n = send(conn->fd, conn->out + conn->out_off, conn->out_len - conn->out_off, MSG_NOSIGNAL);
+			if (n == -1)
+			{
+				if (errno == EAGAIN || errno == EINTR)
+					{ break; }
+				conn_close(conn);
+				return -1;
+			}
+			conn->out_off += (size_t) n;
+
+			// Under rate=B the next slice waits for the time this one should have taken
+			if (conn->rate > 0 && conn->out_off == conn->out_len && !conn->body_done)
+				{ conn->wake_at = now_seconds() + (double) n / conn->rate; }
+			continue;
+		}
+		if (!conn->body_done)
+			{ continue; }
+
+		// The response is all sent
+		if (conn->close_after || (conn->drop_at >= 0 && conn->drop_at < conn->body_end))
+		{
+			conn_close(conn);
+			return -1;
+		}
+		conn->busy = 0;
+		int started = conn_request(conn);
+		if (started == -1)
+		{
+			conn_close(conn);
+			return -1;
+		}
+	}
+	conn_arm(conn);
+	return 0;
+}
+
+
+
+// Function reads what a client sent and starts answering it if no response is under way
+void conn_read(FixConn* conn)
+{
+	if (conn->in_len < MAX_REQUEST)
+	{
+		ssize_t n = read(conn->fd, conn->in + conn->in_len, MAX_REQUEST - conn->in_len);
+		if (n == -1 && (errno == EAGAIN || errno == EINTR))
+			{ return; }
+		if (n <= 0)
+		{
+			conn_close(conn);
+			return;
+		}
+		conn->in_len += (size_t) n;
+		conn->in[conn->in_len] = '\0';
+	}
+	if (!conn->busy)
+	{
+		int started = conn_request(conn);
+		if (started == -1)
+		{
+			conn_close(conn);
+			return;
+		}
+	}
+	conn_write(conn);
+}
+
+
+
+// Function takes every connection waiting on the listening socket
+void accept_all(int listen_fd)
+{
+	for (;;)
+	{
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1)
+			{ return; }
+		FixConn* conn = (fd < n_conns_max) ? calloc(1, sizeof(FixConn)) : NULL;
+		if (conn == NULL)
+		{
+			close(fd);
+			continue;
+		}
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		conn->fd = fd;
+		conns[fd] = conn;
+		if (fd > max_fd)	{ max_fd = fd; }
+		struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+}
+
+
+
+/* ------------------------------------------------------------ MAIN PROGRAM RUNS HERE ------------------------------------------------------------ */
+int main(int argc, char* argv[])
+{
+	int port = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "p:q")) != -1)
+	{
+		if (opt == 'p')		{ port = atoi(optarg); }
+		else if (opt == 'q')	{ quiet = 1; }
+		else
+		{
+			fprintf(stderr, "Usage: %s [-p port] [-q]\n", argv[0]);
+			return 1;
+		}
+	}
+	for (int i = 0; i < PATTERN_SIZE + 26; i++)
+		{ pattern[i] = (char) ('a' + i % 26); }
+
+	// Benchmarks open thousands of connections, take what the hard limit allows
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	n_conns_max = (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < 1048576) ? (int) limit.rlim_cur : 1048576;
+	conns = calloc((size_t) n_conns_max, sizeof(FixConn*));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((uint16_t) port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof(addr);
+	int one = 1;
+	int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev = { .events = EPOLLIN, .data.fd = listen_fd };
+	if (conns == NULL || listen_fd == -1 || epfd == -1
+	 || setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0
+	 || bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(listen_fd, LISTEN_BACKLOG) != 0
+	 || getsockname(listen_fd, (struct sockaddr*) &addr, &addr_len) != 0
+	 || epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) != 0)
+	{
+		perror("a4fixture");
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	signal(SIGPIPE, SIG_IGN);
+	printf("port %d\n", ntohs(addr.sin_port));
+	fflush(stdout);
+
+	struct epoll_event events[MAX_EVENTS];
+	max_fd = listen_fd;
+	while (!stop)
+	{
+		// Sleep no longer than until the first response held back by delay= or rate= may go on
+		double now = now_seconds();
+		double next = 0;
+		for (int fd = 0; fd <= max_fd; fd++)
+		{
+			if (conns[fd] != NULL && conns[fd]->wake_at != 0 && (next == 0 || conns[fd]->wake_at < next))
+				{ next = conns[fd]->wake_at; }
+		}
+		int timeout = (next == 0) ? 1000 : (next <= now) ? 0 : (int) ((next - now) * 1000) + 1;
+
+		int n_events = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+		for (int i = 0; i < n_events; i++)
+		{
+			int fd = events[i].data.fd;
+			if (fd == listen_fd)
+			{
+				accept_all(listen_fd);
+				continue;
+			}
+			FixConn* conn = conns[fd];
+			if (conn == NULL)
+				{ continue; }
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))	{ conn_read(conn); }
+			else							{ conn_write(conn); }
+		}
+
+		// Connections whose wait is over carry on, and the highest descriptor in use bounds the next scan
+		now = now_seconds();
+		int highest = listen_fd;
+		for (int fd = 0; fd <= max_fd; fd++)
+		{
+			if (conns[fd] == NULL)
+				{ continue; }
+			if (conns[fd]->wake_at != 0 && conns[fd]->wake_at <= now)
+			{
+				conns[fd]->wake_at = 0;
+				if (conn_write(conns[fd]) != 0)
+					{ continue; }
+			}
+			highest = fd;
+		}
+		max_fd = highest;
+	}
+
+	for (int fd = 0; fd < n_conns_max; fd++)
+	{
+		if (conns[fd] != NULL)	{ conn_close(conns[fd]); }
+	}
+	if (!quiet)
+		{ fprintf(stderr, "a4fixture: %lld responses, %lld body bytes\n", served, body_bytes); }
+	close(listen_fd);
+	close(epfd);
+	free(conns);
+	return 0;
+}
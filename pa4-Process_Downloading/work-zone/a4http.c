@@ -0,0 +1,1832 @@
+#include "a4download.h"
+
+// The http engine: every http:// line is fetched by this process over a non-blocking socket,
+// all of them driven by one epoll loop, so a download costs a request instead of a process.
+// Each host keeps a small pool of keep-alive connections; once a connection has shown it stays
+// open, further requests are pipelined on it so small files do not each wait a round trip.
+// With -r, a large file is fetched as several byte ranges at once, each written in place.
+// Bodies go to disk without a copy through this process where they can: a large one is spliced from socket
+// to file through a pipe, and with -d a very large one is written with O_DIRECT, past the page cache.
+// Either way its CRC-32 is kept as it arrives, so a finished file is never read back to be checksummed.
+// A file the journal says was partly downloaded carries on from where it stopped.
+// Lines it cannot fetch itself (https://, which needs TLS) still go to a curl child, which shares
+// the same max_downloads slots and is reaped by the same loop, woken by SIGCHLD through a signalfd.
+// Host names are resolved by getaddrinfo_a off the loop, which an eventfd wakes once they are, so a slow
+// resolver holds up only the lines naming that host.
+
+
+
+// What every host is looked up as: any address family, for a TCP stream
+static const struct addrinfo lookup_hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+
+
+
+// Function reads the monotonic clock
+// Returns the time in seconds
+double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+// Function splits an http:// URL into its host (MAX_HOST_CHARS), port (8 chars) and path
+// Returns 0 for http, 1 for a URL the engine cannot fetch itself (https and anything else), -1 if malformed
+int parse_url(const char* url, char* host, char* port, const char** path)
+{
+	if (strncasecmp(url, "http://", 7) != 0)
+		{ return 1; }
+	url += 7;
+
+	// The authority runs up to the path, or to the query when there is no path
+	size_t len = strcspn(url, "/?#");
+	const char* colon = memchr(url, ':', len);
+	size_t host_len = colon ? (size_t) (colon - url) : len;
+	if (host_len == 0 || host_len >= MAX_HOST_CHARS)
+		{ return -1; }
+	memcpy(host, url, host_len);
+	host[host_len] = '\0';
+
+	if (colon != NULL)
+	{
+		size_t port_len = len - host_len - 1;
+		if (port_len == 0 || port_len > 5 || strspn(colon + 1, "0123456789") < port_len)
+			{ return -1; }
+		memcpy(port, colon + 1, port_len);
+		port[port_len] = '\0';
+	}
+	else	{ strcpy(port, "80"); }
+
+	*path = url + len;
+	return 0;
+}
+
+
+
+// Function runs on getaddrinfo_a's own thread once a lookup is done, and wakes the loop to take it
+static void lookup_notify(union sigval value)
+{
+	uint64_t one = 1;
+	if (write(value.sival_int, &one, sizeof(one)) == -1)
+		{ }
+}
+
+
+
+// Function finds the host for a name and port, starting to resolve it the first time it is seen. Jobs wait
+// on a host while it resolves, as they do for room on a connection
+// Returns the host, NULL if it does not resolve (reported once)
+static HttpHost* host_lookup(HttpEngine* engine, const char* name, const char* port)
+{
+	// FNV-1a over "name:port"
+	unsigned hash = 2166136261u;
+	for (const char* c = name; *c; c++)	{ hash = (hash ^ (unsigned char) *c) * 16777619u; }
+	for (const char* c = port; *c; c++)	{ hash = (hash ^ (unsigned char) *c) * 16777619u; }
+
+	HttpHost** bucket = &engine->hosts[hash & (HOST_BUCKETS - 1)];
+	for (HttpHost* host = *bucket; host != NULL; host = host->next)
+	{
+		if (strcasecmp(host->name, name) == 0 && strcmp(host->port, port) == 0)
+			{ return host->failed ? NULL : host; }
+	}
+
+	HttpHost* host = calloc(1, sizeof(HttpHost));
+	if (host == NULL || (host->name = strdup(name)) == NULL || (host->port = strdup(port)) == NULL)
+	{
+		fprintf(stderr, "Memory allocation failed\n");
+		if (host != NULL)	{ free(host->name); }
+		free(host);
+		return NULL;
+	}
+	host->next = *bucket;
+	*bucket = host;
+	host->bucket.rate = engine->host_rate;
+	host->bucket.tokens = engine->host_rate * RATE_BURST;
+	host->bucket.last = now_seconds();
+
+	// The request lives in the host, getaddrinfo_a fills it in on its own thread
+	struct gaicb* list[1] = { &host->lookup };
+	struct sigevent done;
+	memset(&done, 0, sizeof(done));
+	done.sigev_notify = SIGEV_THREAD;
+	done.sigev_notify_function = lookup_notify;
+	done.sigev_value.sival_int = engine->rfd;
+	host->lookup.ar_name = host->name;
+	host->lookup.ar_service = host->port;
+	host->lookup.ar_request = &lookup_hints;
+	int err = getaddrinfo_a(GAI_NOWAIT, list, 1, &done);
+	if (err != 0)
+	{
+		fprintf(stderr, "could not resolve %s: %s\n", name, gai_strerror(err));
+		host->failed = 1;
+		return NULL;
+	}
+	host->resolving = 1;
+	return host;
+}
+
+
+
+// Function sorts how a job ended into one of the OUTCOME_ values
+// Returns the outcome
+static int job_outcome(HttpJob* job, const char* error)
+{
+	if (error == NULL)			{ return status_outcome(job->status); }
+	if (stop_signal != 0)			{ return OUTCOME_INTERRUPTED; }
+	if (job->host == NULL || job->host->failed)	{ return OUTCOME_FAILED; }
+	if (now_seconds() > job->deadline)	{ return OUTCOME_TIMEOUT; }
+	if (!job->header_done)			{ return OUTCOME_CONNECT; }
+	return OUTCOME_PARTIAL;
+}
+
+
+
+// Function folds body bytes that reached the file into a job's CRC-32 and CRC-64
+static void job_sum(HttpJob* job, const void* data, size_t len)
+{
+	job->crc = crc32_update(job->crc, data, len);
+	job->crc64 = crc64_update(job->crc64, data, len);
+}
+
+
+
+// Function writes out what a job's O_DIRECT buffer holds, folding it into the CRCs. Whole blocks go direct; a part
+// block, the end of the body or of one cut short, goes after O_DIRECT is turned off, its length being unaligned
+// Returns 0 on success, -1 if the write failed
+static int job_flush(HttpJob* job)
+{
+	if (job->direct_len % DIRECT_ALIGN != 0)
+		{ fcntl(job->out_fd, F_SETFL, fcntl(job->out_fd, F_GETFL) & ~O_DIRECT); }
+	size_t off = 0;
+	while (off < job->direct_len)
+	{
+		ssize_t n = write(job->out_fd, job->direct_buf + off, job->direct_len - off);
+		if (n == -1)
+		{
+			if (errno == EINTR)	{ continue; }
+			return -1;
+		}
+		off += (size_t) n;
+	}
+	job_sum(job, job->direct_buf, job->direct_len);
+	job->direct_len = 0;
+	return 0;
+}
+
+
+
+// Function ends a job, reporting how it went and recording its timings, and frees its slot, or puts its line
+// back to be tried again. error is NULL when the download succeeded
+static void job_finish(HttpEngine* engine, HttpJob* job, const char* error)
+{
+	int slot = (int) (job - engine->jobs);
+
+	// Under -d the last part block is still in the buffer when a download is cut short
+	if (job->direct_len > 0 && job_flush(job) != 0)
+	{
+		job->body_bytes -= (long long) job->direct_len;
+		job->direct_len = 0;
+	}
+	long long bytes = (job->resumed ? job->resume_from : 0) + job->body_bytes;
+
+	// Unchanged since it was cached: the cached copy stands in for the empty body
+	if (error == NULL && job->status == 304)
+	{
+		uint32_t crc;
+		if ((bytes = cache_restore(job->entry, &crc)) >= 0)	{ journal_done(job->entry, bytes, crc); }
+		else
+		{
+			error = "cached copy missing";
+			bytes = 0;
+		}
+	}
+
+	// What reached the disk goes in the journal: a finished file with its CRC-32, kept as the body arrived and
+	// never read back, or how far an unfinished one got. A retry carries on from there too. A finished file goes
+	// in the cache, under its CRC-64 kept the same way
+	long long kept = 0;
+	if (job->header_done && job->status >= 200 && job->status < 300)
+	{
+		if (error != NULL)
+		{
+			if (!job->split)
+			{
+				journal_progress(job->entry, bytes, job->crc);
+				kept = bytes;
+			}
+		}
+		else
+		{
+			// A split file's CRCs are its first byte's followed by its segments', in the order of the file
+			for (int i = 0; job->split && i < MAX_RANGES; i++)
+			{
+				job->crc = crc32_combine(job->crc, job->segment_crc[i], job->segment_bytes[i]);
+				job->crc64 = crc64_combine(job->crc64, job->segment_crc64[i], job->segment_bytes[i]);
+			}
+			journal_done(job->entry, bytes, job->crc);
+			cache_store(job->entry, job->etag, job->last_modified, bytes, job->crc, job->crc64);
+		}
+	}
+
+	if (error == NULL && job->resumed)
+	{
+		printf("slot %d processing line %d finished: HTTP %d, %lld bytes, resumed at %lld\n",
+			slot, job->entry->line_number, job->status, bytes, job->resume_from);
+	}
+	else if (error == NULL && job->status == 304)
+	{
+		printf("slot %d processing line %d finished: HTTP 304, %lld bytes from the cache\n",
+			slot, job->entry->line_number, bytes);
+	}
+	else if (error == NULL)
+	{
+		printf("slot %d processing line %d finished: HTTP %d, %lld bytes\n",
+			slot, job->entry->line_number, job->status, bytes);
+	}
+	else
+		{ printf("slot %d processing line %d failed: %s\n", slot, job->entry->line_number, error); }
+
+	// A server turning requests away, or downloads that time out or break off, say too many are running
+	int outcome = job_outcome(job, error);
+	if (error != NULL || job->status == 429 || job->status >= 500)
+		{ engine->window_errors++; }
+
+	// A server may answer before the whole request is sent, that leaves no time to the first byte
+	Timing timing;
+	double now = now_seconds();
+	timing.dns = job->dns;
+	timing.connect = job->connect;
+	timing.ttfb = (job->sent_at > 0 && job->first_byte >= job->sent_at) ? job->first_byte - job->sent_at : -1;
+	timing.transfer = (job->first_byte > 0) ? now - job->first_byte : -1;
+	timing.bytes = job->body_bytes;
+	timing_record(job->entry, outcome, &timing);
+
+	if (job->out_fd != -1)	{ close(job->out_fd); }
+	free(job->request);
+	free(job->direct_buf);
+	job->request = NULL;
+	job->direct_buf = NULL;
+	if (retry_schedule(job->entry, outcome, job->retry_after))
+	{
+		job->entry->journal = (kept > 0) ? JOURNAL_PARTIAL : JOURNAL_NONE;
+		job->entry->resume_bytes = kept;
+		job->entry->resume_crc = (kept > 0) ? job->crc : 0;
+		job->entry->resume_crc64 = (kept > 0) ? job->crc64 : 0;
+		manifest_retry(engine->manifest, job->entry);
+	}
+	else
+	{
+		if (error != NULL)	{ engine->failed++; }
+		report_line(job->entry, outcome, job->status, bytes, error);
+		manifest_release(engine->manifest, job->entry);
+	}
+	job->entry = NULL;
+	job->pid = 0;
+	job->conn = NULL;
+	job->out_fd = -1;
+	engine->active--;
+}
+
+
+
+// Function forgets what a job had received, so its request can be answered again on another connection
+static void job_reset(HttpJob* job)
+{
+	job->conn = NULL;
+	job->header_done = 0;
+	job->status = 0;
+	job->close_after = 0;
+	job->content_length = -1;
+	job->body_bytes = 0;
+	job->chunked = 0;
+	job->chunk_state = CHUNK_SIZE;
+	job->range_start = -1;
+	job->range_total = -1;
+	job->resumed = 0;
+	job->crc = 0;
+	job->crc64 = 0;
+	job->retry_after = -1;
+	job->etag[0] = '\0';
+	job->last_modified[0] = '\0';
+	job->connect = -1;
+	job->sent_at = 0;
+	job->first_byte = 0;
+	job->spliced = 0;
+	free(job->direct_buf);
+	job->direct_buf = NULL;
+	job->direct_len = 0;
+	if (job->out_fd != -1)
+	{
+		close(job->out_fd);
+		job->out_fd = -1;
+	}
+}
+
+
+
+// Function ends one segment of a file, folding its outcome into the file's; the last one ends the file
+static void segment_finish(HttpEngine* engine, HttpJob* segment, const char* error)
+{
+	HttpJob* parent = segment->parent;
+
+	// A segment must come back as exactly the range asked for
+	if (error == NULL && (segment->status != 206 || segment->range_start != segment->range_from
+	 || segment->body_bytes != segment->range_to - segment->range_from + 1))
+		{ error = "server did not honour the range"; }
+	if (error != NULL && parent->error[0] == '\0')
+		{ snprintf(parent->error, sizeof(parent->error), "%s", error); }
+
+	parent->body_bytes += segment->body_bytes;
+	for (int i = 0; i < MAX_RANGES; i++)
+	{
+		if (parent->segments[i] == segment)
+		{
+			parent->segments[i] = NULL;
+			parent->segment_crc[i] = segment->crc;
+			parent->segment_crc64[i] = segment->crc64;
+			parent->segment_bytes[i] = segment->body_bytes;
+		}
+	}
+	free(segment->request);
+	free(segment);
+
+	if (--parent->segments_left == 0)
+		{ job_finish(engine, parent, parent->error[0] ? parent->error : NULL); }
+}
+
+
+
+// Function ends a HEAD request, giving its line the size it found; the line goes unsized if the request failed
+static void probe_finish(HttpEngine* engine, HttpJob* probe, const char* error)
+{
+	probe->entry->expected_bytes = (error == NULL && probe->header_done) ? probe->head_bytes : EXPECT_UNKNOWN;
+	for (int i = 0; i < engine->n_probes; i++)
+	{
+		if (engine->probes[i] == probe)
+		{
+			engine->probes[i] = engine->probes[--engine->n_probes];
+			break;
+		}
+	}
+	free(probe->request);
+	free(probe);
+}
+
+
+
+// Function ends a job, whether it is a line of its own, a segment of one or a HEAD request sizing one
+static void job_done(HttpEngine* engine, HttpJob* job, const char* error)
+{
+	if (job->head)			{ probe_finish(engine, job, error); }
+	else if (job->parent != NULL)	{ segment_finish(engine, job, error); }
+	else				{ job_finish(engine, job, error); }
+}
+
+
+
+// Function puts a job in line for a connection to its host, at the back or, for a retried job, at the front
+static void host_wait(HttpHost* host, HttpJob* job, int front)
+{
+	job->next = NULL;
+	if (host->wait_head == NULL)
+		{ host->wait_head = host->wait_tail = job; }
+	else if (front)
+	{
+		job->next = host->wait_head;
+		host->wait_head = job;
+	}
+	else
+	{
+		host->wait_tail->next = job;
+		host->wait_tail = job;
+	}
+}
+
+
+
+// Function takes a job out of its host's line without it having been sent
+static void host_unwait(HttpHost* host, HttpJob* job)
+{
+	HttpJob* prev = NULL;
+	for (HttpJob* at = host->wait_head; at != NULL; prev = at, at = at->next)
+	{
+		if (at != job)
+			{ continue; }
+		if (prev == NULL)	{ host->wait_head = job->next; }
+		else			{ prev->next = job->next; }
+		if (host->wait_tail == job)	{ host->wait_tail = prev; }
+		job->next = NULL;
+		return;
+	}
+}
+
+
+
+// Function sets which events a connection waits for: writable while requests are unsent, readable while any are
+// queued, unless it is throttled
+static void conn_arm(HttpEngine* engine, HttpConn* conn)
+{
+	struct epoll_event ev = { .events = 0, .data.ptr = conn };
+	if (conn->state == CONN_CONNECTING || conn->n_sent < conn->count)
+		{ ev.events |= EPOLLOUT; }
+	if (conn->state == CONN_OPEN && !conn->throttled)
+		{ ev.events |= EPOLLIN; }
+	epoll_ctl(engine->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+
+
+// Function starts a connection's socket connecting to addr, or to the first address after it that can be tried,
+// without waiting for the handshake
+// Returns 0 on success, -1 if none could be (errno tells why of the last)
+static int conn_connect(HttpEngine* engine, HttpConn* conn, struct addrinfo* addr)
+{
+	int err = ECONNREFUSED;
+	for (; addr != NULL; addr = addr->ai_next)
+	{
+		int fd = socket(addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd == -1)
+		{
+			err = errno;
+			continue;
+		}
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		// Connect without blocking, epoll reports writable once the handshake is done
+		struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = conn };
+		if ((connect(fd, addr->ai_addr, addr->ai_addrlen) == -1 && errno != EINPROGRESS)
+		 || epoll_ctl(engine->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		{
+			err = errno;
+			close(fd);
+			continue;
+		}
+		conn->fd = fd;
+		conn->addr = addr;
+		return 0;
+	}
+	errno = err;
+	return -1;
+}
+
+
+
+// Function opens a new connection to a host, without waiting for the handshake
+// Returns the connection, NULL if the socket could not be set up (errno tells why)
+static HttpConn* conn_open(HttpEngine* engine, HttpHost* host)
+{
+	HttpConn* conn = calloc(1, sizeof(HttpConn));
+	if (conn == NULL || (conn->buf = malloc(HTTP_BUF_SIZE + 1)) == NULL)
+	{
+		free(conn);
+		return NULL;
+	}
+	if (conn_connect(engine, conn, host->addr) != 0)
+	{
+		int err = errno;
+		free(conn->buf);
+		free(conn);
+		errno = err;
+		return NULL;
+	}
+	conn->state = CONN_CONNECTING;
+	conn->host = host;
+	conn->idle_since = conn->opened = now_seconds();
+	conn->next = host->conns;
+	host->conns = conn;
+	host->n_conns++;
+	return conn;
+}
+
+
+
+static void host_dispatch(HttpEngine* engine, HttpHost* host);
+
+
+
+// Function closes a connection. Queued jobs that have seen nothing of their response are put back in
+// line for another connection when requeue is set (a kept-alive connection can close under a request
+// the server never read); the others fail with error
+static void conn_close(HttpEngine* engine, HttpConn* conn, int requeue, const char* error)
+{
+	HttpHost* host = conn->host;
+
+	// Newest first, so pushing each to the front of the line keeps their order
+	for (int i = conn->count - 1; i >= 0; i--)
+	{
+		HttpJob* job = conn->queue[(conn->head + i) % MAX_PIPELINE];
+		if (requeue && !job->header_done && job->requeues < MAX_REQUEUES)
+		{
+			job->requeues++;
+			job_reset(job);
+			host_wait(host, job, 1);
+		}
+		else	{ job_done(engine, job, error); }
+	}
+
+	for (HttpConn** at = &host->conns; *at != NULL; at = &(*at)->next)
+	{
+		if (*at == conn)
+		{
+			*at = conn->next;
+			break;
+		}
+	}
+	host->n_conns--;
+
+	// Closing alone does not take the socket out of the epoll set while a curl child that is still
+	// between fork and exec holds a copy of it. A connection none of the host's addresses took has none
+	if (conn->fd != -1)
+	{
+		epoll_ctl(engine->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+		close(conn->fd);
+	}
+	free(conn->buf);
+	free(conn);
+
+	host_dispatch(engine, host);
+}
+
+
+
+// Function hands the jobs waiting on a host to its connections: an idle one, or a new one while the host
+// is under its limit, or else the least loaded one with room. Requests are pipelined only once the pool
+// is full, and only on connections that have already kept alive through a response
+static void host_dispatch(HttpEngine* engine, HttpHost* host)
+{
+	if (host->resolving)
+		{ return; }
+	while (host->wait_head != NULL)
+	{
+		// A probe may be stuck behind a slow server, so nothing is pipelined behind one and a probe only
+		// goes out on a connection with nothing else to do
+		HttpConn* best = NULL;
+		for (HttpConn* conn = host->conns; conn != NULL; conn = conn->next)
+		{
+			int room = (conn->persistent && !host->wait_head->head) ? engine->pipeline : 1;
+			for (int i = 0; i < conn->count; i++)
+			{
+				if (conn->queue[(conn->head + i) % MAX_PIPELINE]->head)
+					{ room = 0; }
+			}
+			if (conn->count < room && (best == NULL || conn->count < best->count))
+				{ best = conn; }
+		}
+
+		if ((best == NULL || best->count > 0) && host->n_conns < engine->host_conns)
+		{
+			if ((best = conn_open(engine, host)) == NULL)
+			{
+				// No socket to be had: everything waiting on this host fails the same way
+				const char* error = strerror(errno);
+				while (host->wait_head != NULL)
+				{
+					HttpJob* job = host->wait_head;
+					host_unwait(host, job);
+					job_done(engine, job, error);
+				}
+				return;
+			}
+		}
+		if (best == NULL)
+			{ return; }
+
+		HttpJob* job = host->wait_head;
+		host_unwait(host, job);
+		job->conn = best;
+		best->queue[(best->head + best->count) % MAX_PIPELINE] = job;
+		best->count++;
+		if (best->state == CONN_OPEN)
+			{ conn_arm(engine, best); }
+	}
+}
+
+
+
+// Function hands a line to a curl child in the given slot, like the curl engine does
+static void job_spawn(HttpEngine* engine, HttpJob* job, FileEntry* entry)
+{
+	int slot = (int) (job - engine->jobs);
+
+	// Every descriptor of the engine is close-on-exec, so the child holds no socket open
+	pid_t pid = spawn_curl(entry, entry->journal == JOURNAL_PARTIAL, engine->curl_rate);
+	if (pid == -1)
+	{
+		printf("slot %d processing line %d failed: could not start curl\n", slot, entry->line_number);
+		report_line(entry, OUTCOME_FAILED, 0, 0, "could not start curl");
+		manifest_release(engine->manifest, entry);
+		engine->failed++;
+		return;
+	}
+	journal_progress(entry, 0, 0);
+	pidmap_put(&engine->children, pid, slot);
+
+	printf("process %d processing line %d\n", pid, entry->line_number);
+	job->entry = entry;
+	job->pid = pid;
+	engine->active++;
+}
+
+
+
+// Function builds the GET (or HEAD) request for a job's URL, asking only for bytes from..to when from is not negative,
+// and for everything from on when to is
+// Returns 0 on success, -1 if memory ran out
+static int job_request(HttpJob* job, long long from, long long to)
+{
+	char host_name[MAX_HOST_CHARS];
+	char port[8];
+	const char* path;
+	char range[64] = "";
+
+	parse_url(job->entry->url, host_name, port, &path);
+	if (*path == '\0')	{ path = "/"; }
+	if (from >= 0 && to >= 0)	{ snprintf(range, sizeof(range), "Range: bytes=%lld-%lld\r\n", from, to); }
+	else if (from >= 0)		{ snprintf(range, sizeof(range), "Range: bytes=%lld-\r\n", from); }
+
+	size_t size = strlen(path) + strlen(host_name) + strlen(range) + strlen(job->conditions) + 128;
+	free(job->request);
+	if ((job->request = malloc(size)) == NULL)
+		{ return -1; }
+	int default_port = (strcmp(port, "80") == 0);
+	job->request_len = (size_t) snprintf(job->request, size,
+		"%s %s%s HTTP/1.1\r\nHost: %s%s%s\r\nUser-Agent: a4download\r\nAccept: */*\r\n%s%s\r\n",
+		job->head ? "HEAD" : "GET", (*path == '?') ? "/" : "", path, host_name, default_port ? "" : ":", default_port ? "" : port,
+		range, job->conditions);
+	return 0;
+}
+
+
+
+// Function sends a HEAD request to size a waiting line for -s sjf. It takes no slot, only room on a connection.
+// Lines it cannot ask about (https) go unsized
+static void probe_start(HttpEngine* engine, FileEntry* entry)
+{
+	char host_name[MAX_HOST_CHARS];
+	char port[8];
+	const char* path;
+	HttpHost* host = NULL;
+	HttpJob* probe = NULL;
+
+	if (parse_url(entry->url, host_name, port, &path) != 0 || (host = host_lookup(engine, host_name, port)) == NULL
+	 || (probe = calloc(1, sizeof(HttpJob))) == NULL)
+	{
+		entry->expected_bytes = EXPECT_UNKNOWN;
+		return;
+	}
+	probe->entry = entry;
+	probe->head = 1;
+	probe->host = host;
+	probe->out_fd = -1;
+	probe->deadline = now_seconds() + PROBE_TIMEOUT;
+	job_reset(probe);
+	if (job_request(probe, -1, -1) != 0)
+	{
+		free(probe);
+		entry->expected_bytes = EXPECT_UNKNOWN;
+		return;
+	}
+
+	engine->probes[engine->n_probes++] = probe;
+	host_wait(host, probe, 0);
+	host_dispatch(engine, host);
+}
+
+
+
+// Function starts downloading a line in a free slot: queues its request on its host, or spawns curl for it
+static void job_start(HttpEngine* engine, HttpJob* job, FileEntry* entry)
+{
+	int slot = (int) (job - engine->jobs);
+	char host_name[MAX_HOST_CHARS];
+	char port[8];
+	const char* path;
+
+	int kind = parse_url(entry->url, host_name, port, &path);
+	if (kind == 1)
+	{
+		job_spawn(engine, job, entry);
+		return;
+	}
+
+	job->entry = entry;
+	job->host = NULL;
+	job->out_fd = -1;
+	job->requeues = 0;
+	job->parent = NULL;
+	job->segments_left = 0;
+	memset(job->segment_crc, 0, sizeof(job->segment_crc));
+	memset(job->segment_crc64, 0, sizeof(job->segment_crc64));
+	memset(job->segment_bytes, 0, sizeof(job->segment_bytes));
+	job->split = 0;
+	job->journaled = 0;
+	job->error[0] = '\0';
+	job->dns = -1;
+	job_reset(job);
+	job->deadline = now_seconds() + entry->timeout;
+	engine->active++;
+
+	printf("slot %d processing line %d\n", slot, entry->line_number);
+	if (kind == -1)
+	{
+		job_finish(engine, job, "malformed URL");
+		return;
+	}
+	// A host still resolving times the lookup for the job once it is done
+	job->host = host_lookup(engine, host_name, port);
+	if (job->host != NULL && !job->host->resolving)
+		{ job->dns = 0; }
+	if (job->host == NULL)
+	{
+		job_finish(engine, job, "could not resolve host");
+		return;
+	}
+
+	// The whole request is built up front and sent once a connection has room for it. A file partly there
+	// asks for the rest; otherwise with -r it only asks for the first byte, which tells the size and whether
+	// the server does ranges at all
+	job->resume_from = (entry->journal == JOURNAL_PARTIAL) ? entry->resume_bytes : 0;
+	job->probe = (engine->ranges > 1 && job->resume_from == 0);
+	if (job->resume_from == 0)	{ cache_conditions(entry, job->conditions, sizeof(job->conditions)); }
+	else				{ job->conditions[0] = '\0'; }
+	long long from = (job->resume_from > 0) ? job->resume_from : (job->probe ? 0 : -1);
+	if (job_request(job, from, job->probe ? 0 : -1) != 0)
+	{
+		job_finish(engine, job, "out of memory");
+		return;
+	}
+
+	host_wait(job->host, job, 0);
+	host_dispatch(engine, job->host);
+}
+
+
+
+// Function gathers body bytes in a job's O_DIRECT buffer, writing it out whenever it fills and once the body is complete
+// Returns 0 on success, -1 if a write failed
+static int job_stage(HttpJob* job, const char* data, size_t len)
+{
+	while (len > 0)
+	{
+		size_t take = DIRECT_BUF_SIZE - job->direct_len;
+		if (take > len)	{ take = len; }
+		memcpy(job->direct_buf + job->direct_len, data, take);
+		job->direct_len += take;
+		job->body_bytes += (long long) take;
+		data += take;
+		len -= take;
+		if ((job->direct_len == DIRECT_BUF_SIZE || job->body_bytes == job->content_length) && job_flush(job) != 0)
+			{ return -1; }
+	}
+	return 0;
+}
+
+
+
+// Function writes body bytes to the output file
+// Returns 0 on success, -1 if the write failed
+static int job_write(HttpJob* job, const char* data, size_t len)
+{
+	if (job->direct_buf != NULL)
+		{ return job_stage(job, data, len); }
+	while (len > 0)
+	{
+		// Segments share their file's descriptor, each writing its own range in place
+		ssize_t n = (job->parent != NULL)
+			? pwrite(job->parent->out_fd, data, len, (off_t) (job->range_from + job->body_bytes))
+			: write(job->out_fd, data, len);
+		if (n > 0)
+			{ job_sum(job, data, (size_t) n); }
+		if (n == -1)
+		{
+			if (errno == EINTR)	{ continue; }
+			return -1;
+		}
+		data += n;
+		len -= (size_t) n;
+		job->body_bytes += n;
+	}
+	return 0;
+}
+
+
+
+// Function feeds received body bytes through the chunked decoder, or straight to the file
+// Returns how many bytes were consumed, -1 on a write error or a malformed chunk,
+// and sets *done once the body is complete
+static long job_body(HttpJob* job, const char* data, size_t len, int* done)
+{
+	*done = 0;
+
+	if (!job->chunked)
+	{
+		if (job->content_length >= 0 && (long long) len > job->content_length - job->body_bytes)
+			{ len = (size_t) (job->content_length - job->body_bytes); }
+		if (job_write(job, data, len) != 0)
+			{ return -1; }
+		*done = (job->content_length >= 0 && job->body_bytes == job->content_length);
+		return (long) len;
+	}
+
+	size_t used = 0;
+	while (used < len && !*done)
+	{
+		if (job->chunk_state == CHUNK_DATA)
+		{
+			size_t take = len - used;
+			if ((long long) take > job->chunk_left)	{ take = (size_t) job->chunk_left; }
+			if (job_write(job, data + used, take) != 0)
+				{ return -1; }
+			used += take;
+			job->chunk_left -= (long long) take;
+			if (job->chunk_left == 0)	{ job->chunk_state = CHUNK_DATA_END; }
+			continue;
+		}
+
+		// Everything else is line based; wait for the whole line
+		const char* eol = memchr(data + used, '\n', len - used);
+		if (eol == NULL)
+		{
+			if (len - used > MAX_HEADER_BYTES)	{ return -1; }
+			break;
+		}
+		size_t line_len = (size_t) (eol - (data + used)) + 1;
+
+		if (job->chunk_state == CHUNK_SIZE)
+		{
+			char* end;
+			job->chunk_left = strtoll(data + used, &end, 16);
+			if (end == data + used || job->chunk_left < 0)
+				{ return -1; }
+			job->chunk_state = (job->chunk_left == 0) ? CHUNK_TRAILER : CHUNK_DATA;
+		}
+		else if (job->chunk_state == CHUNK_DATA_END)
+			{ job->chunk_state = CHUNK_SIZE; }
+		else if (line_len <= 2)
+			{ *done = 1; }	// the empty line ending the trailer
+		used += line_len;
+	}
+	return (long) used;
+}
+
+
+
+// Function parses the status line and headers of a job's response once they are all in buf, passing over any
+// interim (1xx) responses before it
+// Returns the length of the header blocks, 0 if more is needed, -1 if the response is malformed
+static long job_headers(HttpJob* job, char* buf, size_t buf_len)
+{
+	char* end = NULL;
+	for (size_t i = 3; i < buf_len; i++)
+	{
+		if (buf[i] == '\n' && buf[i - 1] == '\r' && buf[i - 2] == '\n' && buf[i - 3] == '\r')
+		{
+			end = buf + i + 1;
+			break;
+		}
+	}
+	if (end == NULL)
+		{ return (buf_len >= MAX_HEADER_BYTES) ? -1 : 0; }
+
+	int minor;
+	if (sscanf(buf, "HTTP/1.%d %d", &minor, &job->status) != 2)
+		{ return -1; }
+
+	// 100 Continue, 103 Early Hints and the like come ahead of the response itself, as headers_status finds
+	// in curl's dump; none is the answer. Until the final one is all in, the next call parses them again
+	if (job->status >= 100 && job->status < 200)
+	{
+		long rest = job_headers(job, end, buf_len - (size_t) (end - buf));
+		return (rest > 0) ? (long) (end - buf) + rest : rest;
+	}
+
+	// HTTP/1.1 keeps the connection open unless told otherwise, HTTP/1.0 closes it unless told otherwise
+	job->close_after = (minor == 0);
+
+	// Walk the header lines after the status line
+	for (char* line = strchr(buf, '\n') + 1; line < end - 2; line = strchr(line, '\n') + 1)
+	{
+		char* eol = strchr(line, '\r');
+		if (strncasecmp(line, "Content-Length:", 15) == 0)
+			{ job->content_length = strtoll(line + 15, NULL, 10); }
+		else if (strncasecmp(line, "Retry-After:", 12) == 0)
+			{ job->retry_after = retry_after_seconds(line + 12); }
+		else if (strncasecmp(line, "ETag:", 5) == 0)
+			{ header_value(line + 5, job->etag); }
+		else if (strncasecmp(line, "Last-Modified:", 14) == 0)
+			{ header_value(line + 14, job->last_modified); }
+		else if (strncasecmp(line, "Content-Range:", 14) == 0)
+		{
+			long long range_end;	// not needed, but as wide as the rest: a range may end past 2 GiB
+			sscanf(line + 14, " bytes %lld-%lld/%lld", &job->range_start, &range_end, &job->range_total);
+		}
+		else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+		{
+			for (char* value = line + 18; value + 7 <= eol; value++)
+			{
+				if (strncasecmp(value, "chunked", 7) == 0)	{ job->chunked = 1; }
+			}
+		}
+		else if (strncasecmp(line, "Connection:", 11) == 0)
+		{
+			for (char* value = line + 11; value + 5 <= eol; value++)
+			{
+				if (strncasecmp(value, "close", 5) == 0)	{ job->close_after = 1; }
+				if (value + 10 <= eol && strncasecmp(value, "keep-alive", 10) == 0)	{ job->close_after = 0; }
+			}
+		}
+	}
+
+	// The answer to a HEAD request gives the size but has no body, whatever its headers say
+	if (job->head)
+	{
+		job->head_bytes = (job->chunked || job->status < 200 || job->status >= 300) ? EXPECT_UNKNOWN : job->content_length;
+		job->content_length = 0;
+		job->chunked = 0;
+	}
+
+	// Responses without a body
+	if (job->status == 204 || job->status == 304)
+		{ job->content_length = 0; }
+	if (job->chunked)
+		{ job->content_length = -1; }
+
+	// A body that runs until the connection closes leaves nothing to keep alive
+	if (job->content_length == -1 && !job->chunked)
+		{ job->close_after = 1; }
+	return (long) (end - buf);
+}
+
+
+
+// Function splits the rest of a probed file into byte ranges, each fetched as a job of its own.
+// The file is sized up front so every segment can write its range in place as it arrives
+static void job_split(HttpEngine* engine, HttpJob* job)
+{
+	job->probe = 0;
+	job->split = 1;
+	if (job->range_total < 0)
+	{
+		job_finish(engine, job, "no size in Content-Range");
+		return;
+	}
+	long long rest = job->range_total - 1;
+	if (rest == 0)
+	{
+		job_finish(engine, job, NULL);
+		return;
+	}
+	if (posix_fallocate(job->out_fd, 0, (off_t) job->range_total) != 0 && ftruncate(job->out_fd, (off_t) job->range_total) != 0)
+	{
+		job_finish(engine, job, strerror(errno));
+		return;
+	}
+
+	// Small files are not worth more than one request, the rest get up to -r segments of a fair size
+	long long k = rest / SEGMENT_MIN_BYTES;
+	if (k > engine->ranges)	{ k = engine->ranges; }
+	if (k < 1)		{ k = 1; }
+
+	long long from = 1;
+	for (int i = 0; i < k; i++)
+	{
+		long long to = (i == k - 1) ? job->range_total - 1 : from + rest / k - 1;
+		HttpJob* segment = calloc(1, sizeof(HttpJob));
+		if (segment != NULL)
+		{
+			segment->entry = job->entry;
+			segment->host = job->host;
+			segment->parent = job;
+			segment->deadline = job->deadline;
+			segment->out_fd = -1;
+			segment->range_from = from;
+			segment->range_to = to;
+			job_reset(segment);
+		}
+		if (segment == NULL || job_request(segment, from, to) != 0)
+		{
+			free(segment);
+			snprintf(job->error, sizeof(job->error), "out of memory");
+			break;
+		}
+		job->segments[i] = segment;
+		job->segments_left++;
+		host_wait(job->host, segment, 0);
+		from = to + 1;
+	}
+
+	if (job->segments_left == 0)
+		{ job_finish(engine, job, job->error); }
+	else
+		{ host_dispatch(engine, job->host); }
+}
+
+
+
+// Function completes the job at the front of a connection's queue
+// Returns 0 if the connection carries on, -1 if it was closed
+static int conn_pop(HttpEngine* engine, HttpConn* conn)
+{
+	HttpJob* job = conn->queue[conn->head];
+	int close_after = job->close_after;
+
+	conn->head = (conn->head + 1) % MAX_PIPELINE;
+	conn->count--;
+	conn->served++;
+
+	// A server may answer before it has read all of the request (an early error); stop sending the rest
+	if (conn->n_sent > 0)	{ conn->n_sent--; }
+	else			{ conn->sent_off = 0; }
+
+	// A probe that got its byte splits the rest of the file; one the server could not serve (an empty file
+	// answers 416) is simply asked again for the whole file. Any other answer is the whole file already
+	if (job->probe && job->status == 206)
+		{ job_split(engine, job); }
+	else if ((job->probe || job->resume_from > 0) && job->status == 416)
+	{
+		job->probe = 0;
+		job->resume_from = 0;
+		job_reset(job);
+		if (job_request(job, -1, 0) != 0)	{ job_finish(engine, job, "out of memory"); }
+		else					{ host_wait(job->host, job, 1); }
+	}
+	else	{ job_done(engine, job, NULL); }
+
+	if (close_after)
+	{
+		conn_close(engine, conn, 1, "connection closed early");
+		return -1;
+	}
+
+	// Kept alive: the connection can take pipelined requests from now on
+	conn->persistent = 1;
+	if (conn->count == 0)
+		{ conn->idle_since = now_seconds(); }
+	host_dispatch(engine, conn->host);
+	return 0;
+}
+
+
+
+// Function tops a token bucket up for the time since it was last filled, to RATE_BURST seconds' worth at most
+static void bucket_fill(TokenBucket* bucket, double now)
+{
+	double full = bucket->rate * RATE_BURST;
+	if (full < 1)
+		{ full = 1; }
+	bucket->tokens += bucket->rate * (now - bucket->last);
+	if (bucket->tokens > full)
+		{ bucket->tokens = full; }
+	bucket->last = now;
+}
+
+
+
+// Function works out how many of want bytes a connection may read now, by the run's bucket and its host's
+// Returns the bytes, 0 when either bucket is empty
+static size_t bucket_allow(HttpEngine* engine, HttpHost* host, size_t want)
+{
+	double now = now_seconds();
+	TokenBucket* buckets[2] = { &engine->bucket, &host->bucket };
+	for (int i = 0; i < 2; i++)
+	{
+		if (buckets[i]->rate == 0)
+			{ continue; }
+		bucket_fill(buckets[i], now);
+		if (buckets[i]->tokens < (double) want)
+			{ want = (buckets[i]->tokens < 1) ? 0 : (size_t) buckets[i]->tokens; }
+	}
+	return want;
+}
+
+
+
+// Function opens a new output file for a job's body, saved like curl -o whatever the status. The old file is
+// unlinked first, as it may be a hard link into the cache, not to be written through. A body of known length gets
+// its blocks allocated up front, and under -d one of DIRECT_MIN_BYTES or more is written with O_DIRECT where
+// the filesystem takes it (tmpfs does not)
+// Returns 0 on success, -1 on error (errno tells why)
+static int job_open(HttpEngine* engine, HttpJob* job)
+{
+	if (unlink(job->entry->file_name) == -1 && errno != ENOENT)
+		{ return -1; }
+
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	void* buf;
+	job->out_fd = -1;
+	if (engine->direct && !job->chunked && job->content_length >= DIRECT_MIN_BYTES && job->status >= 200 && job->status < 300
+	 && posix_memalign(&buf, DIRECT_ALIGN, DIRECT_BUF_SIZE) == 0)
+	{
+		if ((job->out_fd = open(job->entry->file_name, flags | O_DIRECT, 0644)) != -1)	{ job->direct_buf = buf; }
+		else										{ free(buf); }
+	}
+	if (job->out_fd == -1 && (job->out_fd = open(job->entry->file_name, flags, 0644)) == -1)
+		{ return -1; }
+
+	// Allocated whole, the file is laid out in one piece; its size still grows only as it is written
+	if (!job->chunked && job->content_length > 0)
+		{ fallocate(job->out_fd, FALLOC_FL_KEEP_SIZE, 0, (off_t) job->content_length); }
+	return 0;
+}
+
+
+
+// Function tells whether the rest of a job's body can be spliced: a 2xx body of known length with more than
+// SPLICE_MIN_BYTES to go, or one already being spliced. A file under O_DIRECT is written in aligned blocks, so
+// it is not
+// Returns 1 if so, 0 otherwise
+static int job_spliceable(HttpEngine* engine, HttpJob* job)
+{
+	long long left = job->content_length - job->body_bytes;
+	return engine->pipe[0] != -1 && job->header_done && !job->head && !job->chunked && job->content_length >= 0
+		&& job->status >= 200 && job->status < 300 && job->direct_buf == NULL
+		&& left > 0 && (job->spliced || left >= SPLICE_MIN_BYTES);
+}
+
+
+
+// Function reads len bytes out of one of the engine's pipes, folding them into job's CRCs, or, with job NULL,
+// throws away whatever is in it (len being SIZE_MAX then). The pipes never block, so it stops when one is empty
+static void pipe_take(int fd, size_t len, HttpJob* job)
+{
+	char buf[HTTP_BUF_SIZE];
+	while (len > 0)
+	{
+		ssize_t n = read(fd, buf, (len < sizeof(buf)) ? len : sizeof(buf));
+		if (n == -1 && errno == EINTR)
+			{ continue; }
+		if (n <= 0)
+			{ return; }
+		if (job != NULL)	{ job_sum(job, buf, (size_t) n); }
+		len -= (size_t) n;
+	}
+}
+
+
+
+// Function moves up to want bytes of the body at the front of a connection from the socket to its file, through
+// the engine's pipe and never through this process, which only reads a tee(2) of them for the CRCs. The pipes are
+// emptied again before it returns, so they do for every connection. Since the body's length is known, no more
+// than it is taken from the socket
+static void conn_splice(HttpEngine* engine, HttpConn* conn, HttpJob* job, size_t want)
+{
+	long long left = job->content_length - job->body_bytes;
+	if ((long long) want > left)
+		{ want = (size_t) left; }
+	ssize_t n = splice(conn->fd, NULL, engine->pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		{ return; }
+	if (n <= 0)
+	{
+		conn_close(engine, conn, 1, (n == 0) ? "connection closed early" : strerror(errno));
+		return;
+	}
+	engine->bucket.tokens -= (double) n;
+	conn->host->bucket.tokens -= (double) n;
+	engine->window_bytes += n;
+
+	// A segment writes its range in place, a whole file carries on from where it is
+	int out_fd = (job->parent != NULL) ? job->parent->out_fd : job->out_fd;
+	loff_t offset = job->range_from + job->body_bytes;
+	while (n > 0)
+	{
+		// The tee shares the pipe's pages rather than copying them, as many as the second pipe holds
+		ssize_t t = tee(engine->pipe[0], engine->tee[1], (size_t) n, SPLICE_F_NONBLOCK);
+		if (t == -1 && errno == EINTR)
+			{ continue; }
+		int err = (t <= 0) ? ((t == 0) ? EIO : errno) : 0;
+		ssize_t m = 0;
+		while (err == 0 && m < t)
+		{
+			ssize_t k = splice(engine->pipe[0], NULL, out_fd, (job->parent != NULL) ? &offset : NULL, (size_t) (t - m), SPLICE_F_MOVE);
+			if (k == -1 && errno == EINTR)	{ continue; }
+			if (k <= 0)						{ err = (k == 0) ? EIO : errno; }
+			else							{ m += k; }
+		}
+		pipe_take(engine->tee[0], (size_t) m, job);
+		n -= m;
+		job->body_bytes += m;
+		if (err != 0)
+		{
+			// What the file did not take is thrown away, the pipes must be empty for the next splice
+			pipe_take(engine->pipe[0], SIZE_MAX, NULL);
+			pipe_take(engine->tee[0], SIZE_MAX, NULL);
+			conn_close(engine, conn, 0, strerror(err));
+			return;
+		}
+	}
+	job->spliced = 1;
+	if (job->body_bytes == job->content_length)
+		{ conn_pop(engine, conn); }
+}
+
+
+
+// Function reads what the server sent and moves the responses along, oldest request first.
+// Under -b or -B it reads no more than the buckets allow, and a connection they have nothing left for
+// stops being read from until shaping_tick finds them filled again
+static void conn_read(HttpEngine* engine, HttpConn* conn)
+{
+	// Once nothing is left in the buffer, a large body goes on by splice
+	HttpJob* front = (conn->count > 0) ? conn->queue[conn->head] : NULL;
+	int splicing = (conn->buf_len == 0 && front != NULL && job_spliceable(engine, front));
+	size_t want = splicing ? SPLICE_PIPE_SIZE : HTTP_BUF_SIZE - conn->buf_len;
+	if (engine->bucket.rate > 0 || conn->host->bucket.rate > 0)
+	{
+		if ((want = bucket_allow(engine, conn->host, want)) == 0)
+		{
+			conn->throttled = 1;
+			conn_arm(engine, conn);
+			return;
+		}
+	}
+	if (splicing)
+	{
+		conn_splice(engine, conn, front, want);
+		return;
+	}
+
+	ssize_t n = read(conn->fd, conn->buf + conn->buf_len, want);
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		{ return; }
+	if (n > 0)
+	{
+		engine->bucket.tokens -= (double) n;
+		conn->host->bucket.tokens -= (double) n;
+		engine->window_bytes += n;
+	}
+
+	// The server closed the connection (or reset it): that ends a body only when no length was given.
+	// Requests it never started answering go to another connection
+	if (n <= 0)
+	{
+		const char* error = (n == 0) ? "connection closed early" : strerror(errno);
+		if (conn->count > 0)
+		{
+			HttpJob* job = conn->queue[conn->head];
+			if (job->header_done && job->content_length == -1 && !job->chunked)
+			{
+				if (conn_pop(engine, conn) != 0)
+					{ return; }
+			}
+		}
+		conn_close(engine, conn, 1, error);
+		return;
+	}
+	conn->buf_len += (size_t) n;
+	conn->buf[conn->buf_len] = '\0';
+
+	size_t used = 0;
+	while (conn->count > 0 && used < conn->buf_len)
+	{
+		HttpJob* job = conn->queue[conn->head];
+		if (job->first_byte == 0)
+			{ job->first_byte = now_seconds(); }
+
+		if (!job->header_done)
+		{
+			long header_len = job_headers(job, conn->buf + used, conn->buf_len - used);
+			if (header_len == 0)
+				{ break; }
+			if (header_len < 0)
+			{
+				conn_close(engine, conn, 0, "malformed response");
+				return;
+			}
+			used += (size_t) header_len;
+			job->header_done = 1;
+
+			// A HEAD request has nothing to write, a segment writes into its file's descriptor,
+			// and only if it got the range it asked for
+			if (job->head || job->parent != NULL)
+			{
+				if (job->parent != NULL && (job->status != 206 || job->range_start != job->range_from))
+				{
+					conn_close(engine, conn, 1, "server did not honour the range");
+					return;
+				}
+			}
+			// A resumed file keeps what the journal vouched for and is written on from there, the rest of it
+			// allocated up front
+			else if (job->resume_from > 0 && job->status == 206 && job->range_start == job->resume_from)
+			{
+				job->resumed = 1;
+				job->crc = job->entry->resume_crc;
+				job->crc64 = job->entry->resume_crc64;
+				job->out_fd = open(job->entry->file_name, O_WRONLY | O_CLOEXEC);
+				if (job->out_fd == -1 || ftruncate(job->out_fd, (off_t) job->resume_from) != 0
+				 || lseek(job->out_fd, (off_t) job->resume_from, SEEK_SET) == -1)
+				{
+					conn_close(engine, conn, 0, strerror(errno));
+					return;
+				}
+				if (!job->chunked && job->content_length > 0)
+					{ fallocate(job->out_fd, FALLOC_FL_KEEP_SIZE, (off_t) job->resume_from, (off_t) job->content_length); }
+			}
+			else if (job_open(engine, job) != 0)
+			{
+				conn_close(engine, conn, 0, strerror(errno));
+				return;
+			}
+			if (job->content_length == 0)
+			{
+				if (conn_pop(engine, conn) != 0)
+					{ return; }
+				continue;
+			}
+		}
+
+		int done;
+		long consumed = job_body(job, conn->buf + used, conn->buf_len - used, &done);
+		if (consumed < 0)
+		{
+			conn_close(engine, conn, 0, job->chunked ? "malformed chunk" : strerror(errno));
+			return;
+		}
+		used += (size_t) consumed;
+		if (done && conn_pop(engine, conn) != 0)
+			{ return; }
+		if (!done)
+			{ break; }
+	}
+
+	// Bytes nobody asked for mean the server and we disagree about the stream
+	if (conn->count == 0 && used < conn->buf_len)
+	{
+		conn_close(engine, conn, 0, "unexpected data");
+		return;
+	}
+	conn->buf_len -= used;
+	memmove(conn->buf, conn->buf + used, conn->buf_len + 1);
+}
+
+
+
+// Function sends the requests queued on a connection, in order, as far as the socket takes them. The first
+// request sent on a new connection is charged with its handshake
+static void conn_send(HttpEngine* engine, HttpConn* conn)
+{
+	while (conn->n_sent < conn->count)
+	{
+		HttpJob* job = conn->queue[(conn->head + conn->n_sent) % MAX_PIPELINE];
+		ssize_t n = send(conn->fd, job->request + conn->sent_off, job->request_len - conn->sent_off, MSG_NOSIGNAL);
+		if (n == -1)
+		{
+			if (errno != EAGAIN && errno != EINTR)
+				{ conn_close(engine, conn, 1, strerror(errno)); }
+			return;
+		}
+		conn->sent_off += (size_t) n;
+		if (conn->sent_off == job->request_len)
+		{
+			conn->n_sent++;
+			conn->sent_off = 0;
+			job->sent_at = now_seconds();
+			job->connect = conn->handshake;
+			conn->handshake = 0;
+		}
+	}
+	conn_arm(engine, conn);
+}
+
+
+
+// Function handles an epoll event on a connection
+static void conn_event(HttpEngine* engine, HttpConn* conn, uint32_t events)
+{
+	if (conn->state == CONN_CONNECTING)
+	{
+		int err = 0;
+		socklen_t len = sizeof(err);
+		getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err != 0)
+		{
+			// Another of the host's addresses may answer (localhost is ::1 first, a server may listen on
+			// 127.0.0.1 only). Nothing was sent, so once none does its jobs fail instead of going round again
+			epoll_ctl(engine->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+			close(conn->fd);
+			conn->fd = -1;
+			if (conn_connect(engine, conn, conn->addr->ai_next) != 0)
+				{ conn_close(engine, conn, 0, strerror(err)); }
+			return;
+		}
+		// Later connections go straight to the address that answered
+		conn->host->addr = conn->addr;
+		conn->state = CONN_OPEN;
+		conn->handshake = now_seconds() - conn->opened;
+		conn_arm(engine, conn);
+	}
+
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+	{
+		conn_read(engine, conn);
+		return;
+	}
+	if (events & EPOLLOUT)
+		{ conn_send(engine, conn); }
+}
+
+
+
+// Function collects the curl children that have finished once SIGCHLD says some have, without waiting for any
+static void reap_children(HttpEngine* engine)
+{
+	// Empty the descriptor first: signals of children exiting together arrive as one
+	struct signalfd_siginfo info;
+	while (read(engine->sfd, &info, sizeof(info)) > 0)
+		{ }
+
+	int status;
+	pid_t pid;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+	{
+		int slot = pidmap_take(&engine->children, pid);
+		if (slot == -1)
+			{ continue; }
+
+		HttpJob* job = &engine->jobs[slot];
+		int done = report_child(engine->manifest, pid, status, job->entry);
+		if (done == -1)	{ engine->failed++; }
+		if (done != 0)	{ engine->window_errors++; }
+		job->entry = NULL;
+		job->pid = 0;
+		engine->active--;
+	}
+}
+
+
+
+// Function takes the lookups that are done once the eventfd says some are: a resolved host hands its waiting jobs
+// to connections, one that did not resolve fails them
+static void hosts_resolved(HttpEngine* engine)
+{
+	uint64_t count;
+	if (read(engine->rfd, &count, sizeof(count)) == -1)
+		{ }
+
+	double now = now_seconds();
+	for (int i = 0; i < HOST_BUCKETS; i++)
+	{
+		for (HttpHost* host = engine->hosts[i]; host != NULL; host = host->next)
+		{
+			if (!host->resolving)
+				{ continue; }
+			int err = gai_error(&host->lookup);
+			if (err == EAI_INPROGRESS)
+				{ continue; }
+
+			host->resolving = 0;
+			if (err == 0)
+			{
+				host->addrs = host->addr = host->lookup.ar_result;
+				for (HttpJob* job = host->wait_head; job != NULL; job = job->next)
+					{ job->dns = now - job->entry->started; }
+				host_dispatch(engine, host);
+				continue;
+			}
+			fprintf(stderr, "could not resolve %s: %s\n", host->name, gai_strerror(err));
+			host->failed = 1;
+			while (host->wait_head != NULL)
+			{
+				HttpJob* job = host->wait_head;
+				host_unwait(host, job);
+				job_done(engine, job, "could not resolve host");
+			}
+		}
+	}
+}
+
+
+
+// Function ends a job before its response is complete. One on a connection takes the connection down with it,
+// since its response would still arrive ahead of the ones queued behind; those go to another connection.
+// A file split into segments ends each of them
+static void job_abort(HttpEngine* engine, HttpJob* job, const char* error)
+{
+	if (job->segments_left > 0)
+	{
+		// Ending one segment can end others sharing its connection, so look again every time
+		if (job->error[0] == '\0')
+			{ snprintf(job->error, sizeof(job->error), "%s", error); }
+		for (int i = 0; i < MAX_RANGES && job->entry != NULL; i++)
+		{
+			if (job->segments[i] != NULL)	{ job_abort(engine, job->segments[i], error); }
+		}
+		return;
+	}
+
+	HttpConn* conn = job->conn;
+	if (conn == NULL)
+	{
+		host_unwait(job->host, job);
+		job_done(engine, job, error);
+		return;
+	}
+
+	// Take the job out of its connection's queue before the others are moved on
+	int at = 0;
+	while (conn->queue[(conn->head + at) % MAX_PIPELINE] != job)
+		{ at++; }
+	for (int j = at; j < conn->count - 1; j++)
+		{ conn->queue[(conn->head + j) % MAX_PIPELINE] = conn->queue[(conn->head + j + 1) % MAX_PIPELINE]; }
+	conn->count--;
+	job_done(engine, job, error);
+	conn_close(engine, conn, 1, "connection closed early");
+}
+
+
+
+// Function fails the jobs whose time is up, and closes idle keep-alive connections after IDLE_TIMEOUT
+static void check_timeouts(HttpEngine* engine, double now)
+{
+	for (int i = 0; i < engine->n_jobs; i++)
+	{
+		HttpJob* job = &engine->jobs[i];
+		if (job->entry == NULL || job->pid != 0 || now <= job->deadline)
+			{ continue; }
+
+		char message[64];
+		snprintf(message, sizeof(message), "timed out after %d seconds", job->entry->timeout);
+		job_abort(engine, job, message);
+	}
+
+	// A HEAD request too slow to answer leaves its line unsized, free to start. Nothing is ever queued behind
+	// a probe, so its connection goes down alone and the slot it held is free for the next one
+	for (int i = 0; i < engine->n_probes; i++)
+	{
+		if (now > engine->probes[i]->deadline)
+		{
+			job_abort(engine, engine->probes[i], "timed out");
+			i--;
+		}
+	}
+
+	for (int i = 0; i < HOST_BUCKETS; i++)
+	{
+		for (HttpHost* host = engine->hosts[i]; host != NULL; host = host->next)
+		{
+			HttpConn* conn = host->conns;
+			while (conn != NULL)
+			{
+				HttpConn* next = conn->next;
+				if (conn->count == 0 && now - conn->idle_since > IDLE_TIMEOUT)
+					{ conn_close(engine, conn, 0, NULL); }
+				conn = next;
+			}
+		}
+	}
+}
+
+
+
+// Function reads again from the throttled connections whose buckets have filled, and under shaping adjusts how many
+// downloads may run, once every AIMD_INTERVAL: halved if any failed or were turned away since the last time,
+// otherwise one more while every one allowed is running and the run is short of its -b ceiling.
+// At the ceiling more downloads would only split the same bytes, so the window holds
+static void shaping_tick(HttpEngine* engine, double now)
+{
+	if (engine->bucket.rate > 0)
+		{ bucket_fill(&engine->bucket, now); }
+	for (int i = 0; i < HOST_BUCKETS; i++)
+	{
+		for (HttpHost* host = engine->hosts[i]; host != NULL; host = host->next)
+		{
+			if (host->bucket.rate > 0)
+				{ bucket_fill(&host->bucket, now); }
+			for (HttpConn* conn = host->conns; conn != NULL; conn = conn->next)
+			{
+				if (conn->throttled && (engine->bucket.rate == 0 || engine->bucket.tokens >= 1)
+				 && (host->bucket.rate == 0 || host->bucket.tokens >= 1))
+				{
+					conn->throttled = 0;
+					conn_arm(engine, conn);
+				}
+			}
+		}
+	}
+
+	double elapsed = now - engine->window_start;
+	if (!engine->aimd || elapsed < AIMD_INTERVAL)
+		{ return; }
+	double rate = (double) engine->window_bytes / elapsed;
+	if (engine->window_errors > 0)
+		{ engine->window = (engine->window > 1) ? engine->window / 2 : 1; }
+	else if (engine->bucket.rate > 0 && rate >= AIMD_CEILING * engine->bucket.rate)
+		{ }
+	else if (engine->active >= engine->window && engine->window < engine->n_jobs)
+		{ engine->window++; }
+	engine->window_bytes = 0;
+	engine->window_errors = 0;
+	engine->window_start = now;
+}
+
+
+
+// Function records in the journal how far each download writing straight through its file has got. A split
+// one is only recorded when it ends, its segments' CRCs being combined then
+static void journal_jobs(HttpEngine* engine)
+{
+	for (int i = 0; i < engine->n_jobs; i++)
+	{
+		HttpJob* job = &engine->jobs[i];
+		if (job->entry == NULL || job->pid != 0 || job->split || job->out_fd == -1 || job->status < 200 || job->status >= 300)
+			{ continue; }
+
+		// What is still in an O_DIRECT buffer is not on disk yet, nor in the CRC
+		long long bytes = (job->resumed ? job->resume_from : 0) + job->body_bytes - (long long) job->direct_len;
+		if (bytes != job->journaled)
+		{
+			journal_progress(job->entry, bytes, job->crc);
+			job->journaled = bytes;
+		}
+	}
+}
+
+
+
+// Function downloads every line of the manifest, at most max_downloads at a time, until all are done
+// Returns the number of lines that failed, -1 if the engine could not start
+int http_run(Manifest* manifest, Options* options)
+{
+	HttpEngine engine;
+	memset(&engine, 0, sizeof(engine));
+	engine.n_jobs = (options->max_downloads > 0) ? options->max_downloads : 1;
+	engine.host_conns = options->host_conns;
+	engine.pipeline = options->pipeline;
+	engine.manifest = manifest;
+	engine.ranges = options->ranges;
+	engine.bucket.rate = (double) options->rate;
+	engine.bucket.tokens = engine.bucket.rate * RATE_BURST;
+	engine.bucket.last = now_seconds();
+	engine.host_rate = (double) options->host_rate;
+	engine.window = engine.n_jobs;
+	engine.aimd = (options->rate > 0 || options->host_rate > 0);
+	engine.window_start = engine.bucket.last;
+	engine.curl_rate = curl_share(options);
+	engine.direct = options->direct;
+
+	// Bodies are spliced through one pipe, and tee'd to a second to be checksummed, both as big as the system lets
+	// them be; without them they are read and written
+	if (pipe2(engine.pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+		{ engine.pipe[0] = engine.pipe[1] = -1; }
+	else if (pipe2(engine.tee, O_CLOEXEC | O_NONBLOCK) != 0)
+	{
+		close(engine.pipe[0]);
+		close(engine.pipe[1]);
+		engine.pipe[0] = engine.pipe[1] = -1;
+	}
+	else
+	{
+		fcntl(engine.pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+		fcntl(engine.tee[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+	}
+
+	// Thousands of connections need as many descriptors, take what the hard limit allows
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	// Curl children are reaped when SIGCHLD makes the signalfd readable, registered with no connection, and
+	// finished lookups taken when the eventfd is, registered with itself
+	engine.epfd = epoll_create1(EPOLL_CLOEXEC);
+	engine.sfd = sigchld_open(SFD_NONBLOCK);
+	engine.rfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	engine.jobs = calloc((size_t) engine.n_jobs, sizeof(HttpJob));
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	struct epoll_event rev = { .events = EPOLLIN, .data.ptr = &engine.rfd };
+	if (engine.epfd == -1 || engine.sfd == -1 || engine.rfd == -1 || engine.jobs == NULL
+	 || pidmap_init(&engine.children, engine.n_jobs) != 0 || epoll_ctl(engine.epfd, EPOLL_CTL_ADD, engine.sfd, &ev) != 0
+	 || epoll_ctl(engine.epfd, EPOLL_CTL_ADD, engine.rfd, &rev) != 0)
+	{
+		perror("http engine");
+		free(engine.jobs);
+		free(engine.children.cells);
+		sigchld_close(engine.sfd);
+		if (engine.rfd != -1)	{ close(engine.rfd); }
+		if (engine.epfd != -1)	{ close(engine.epfd); }
+		return -1;
+	}
+	for (int i = 0; i < engine.n_jobs; i++)
+		{ engine.jobs[i].out_fd = -1; }
+
+	// Free slots are found by a rotating cursor, a slot is found within one lap
+	int cursor = 0;
+	double last_check = now_seconds();
+	double last_journal = last_check;
+	struct epoll_event events[MAX_EVENTS];
+	while (!manifest_finished(manifest) || engine.active > 0)
+	{
+		// Under -s sjf, waiting lines are sized by HEAD requests before the policy can pick them
+		FileEntry* entry;
+		while (manifest->policy == POLICY_SJF && engine.n_probes < MAX_PROBES && (entry = manifest_unprobed(manifest)) != NULL)
+			{ probe_start(&engine, entry); }
+
+		// Keep every slot the window allows busy while there are lines left
+		while (engine.active < engine.window && (entry = manifest_next(manifest)) != NULL)
+		{
+			if (cache_reuse(entry) == 0)
+			{
+				manifest_release(manifest, entry);
+				continue;
+			}
+			while (engine.jobs[cursor].entry != NULL)
+				{ cursor = (cursor + 1) % engine.n_jobs; }
+			job_start(&engine, &engine.jobs[cursor], entry);
+		}
+		// With nothing running, only lines waiting out a backoff keep the loop from reading more of the manifest
+		if (engine.active == 0 && engine.n_probes == 0 && manifest_wait(manifest) == 0)
+			{ continue; }
+
+		int n_events = epoll_wait(engine.epfd, events, MAX_EVENTS, LOOP_TICK_MS);
+		if (n_events == -1 && errno != EINTR)
+		{
+			perror("epoll_wait");
+			break;
+		}
+
+		// Handling an event only ever closes that event's own connection, so the rest stay valid
+		for (int i = 0; i < n_events; i++)
+		{
+			if (events[i].data.ptr == NULL)			{ reap_children(&engine); }
+			else if (events[i].data.ptr == &engine.rfd)	{ hosts_resolved(&engine); }
+			else						{ conn_event(&engine, events[i].data.ptr, events[i].events); }
+		}
+
+		// Interrupted: every download ends here, recording in the journal how far it got, and main exits after
+		if (stop_signal != 0)
+		{
+			for (int i = 0; i < engine.n_jobs; i++)
+			{
+				if (engine.jobs[i].entry != NULL && engine.jobs[i].pid == 0)	{ job_abort(&engine, &engine.jobs[i], "interrupted"); }
+			}
+			while (engine.n_probes > 0)
+				{ job_abort(&engine, engine.probes[0], "interrupted"); }
+			break;
+		}
+
+		// Timeouts are checked once per tick, each covering the whole download like curl -m
+		double now = now_seconds();
+		if (now - last_check >= LOOP_TICK_MS / 1000.0)
+		{
+			last_check = now;
+			check_timeouts(&engine, now);
+			shaping_tick(&engine, now);
+		}
+		if (now - last_journal >= JOURNAL_INTERVAL)
+		{
+			last_journal = now;
+			journal_jobs(&engine);
+		}
+	}
+
+	// Let go of the hosts and whatever connections they kept alive. A lookup still running when the loop stopped
+	// early may yet write to its host and to the eventfd, so neither is let go unless it can be called off
+	int lookups_left = 0;
+	for (int i = 0; i < HOST_BUCKETS; i++)
+	{
+		while (engine.hosts[i] != NULL)
+		{
+			HttpHost* host = engine.hosts[i];
+			while (host->conns != NULL)
+				{ conn_close(&engine, host->conns, 0, NULL); }
+			engine.hosts[i] = host->next;
+			if (host->resolving)
+			{
+				int err = gai_cancel(&host->lookup);
+				if (err == EAI_NOTCANCELED)
+				{
+					lookups_left = 1;
+					continue;
+				}
+				if (err == EAI_ALLDONE)
+				{
+					lookups_left = 1;
+					host->addrs = host->lookup.ar_result;
+				}
+			}
+			if (host->addrs != NULL)	{ freeaddrinfo(host->addrs); }
+			free(host->name);
+			free(host->port);
+			free(host);
+		}
+	}
+	free(engine.jobs);
+	free(engine.children.cells);
+	sigchld_close(engine.sfd);
+	if (!lookups_left)	{ close(engine.rfd); }
+	close(engine.epfd);
+	if (engine.pipe[0] != -1)
+	{
+		close(engine.pipe[0]);
+		close(engine.pipe[1]);
+		close(engine.tee[0]);
+		close(engine.tee[1]);
+	}
+	return engine.failed;
+}
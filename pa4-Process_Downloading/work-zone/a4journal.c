@@ -0,0 +1,390 @@
+#include "a4download.h"
+
+// The progress journal: <manifest>.journal records, one line each, which lines finished and how far
+// the unfinished ones got, so a run that was interrupted picks up where it stopped.
+//	done	<line> <bytes> <crc32> <file-name> <url>	the file is complete
+//	partial	<line> <bytes> <crc32> <file-name> <url>	the first bytes of the file are on disk
+// Records are only ever appended; the last one for a line wins. Every byte count comes with the CRC-32
+// of those bytes, and nothing recorded is trusted until the file on disk is checked against it, so the
+// output files need no fsync of their own: a journal that ran ahead of the disk just fails the check.
+// A run that gets every line done removes the journal, which is only there to resume one that did not.
+
+
+
+// Descriptor the records are appended to, -1 when running without a journal, and the journal's name
+static int journal_fd = -1;
+static char journal_path[MAX_LINE_CHARS * 2] = "";
+
+// Lines of the manifest looked up so far, and those of them that are done, before this run or in it
+static int lines_seen = 0;
+static int lines_done = 0;
+
+
+
+// Function folds len bytes into a running CRC-32 (the zlib polynomial), starting from 0
+// Returns the new CRC
+uint32_t crc32_update(uint32_t crc, const void* data, size_t len)
+{
+	static uint32_t table[256];
+	if (table[1] == 0)
+	{
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++)
+				{ c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1; }
+			table[i] = c;
+		}
+	}
+
+	const unsigned char* p = data;
+	crc = ~crc;
+	while (len-- > 0)
+		{ crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8); }
+	return ~crc;
+}
+
+
+
+// Function folds len bytes into a running CRC-64 (the XZ polynomial), starting from 0. With the CRC-32 and the
+// length it names a file's content in the cache, and like the CRC-32 it is kept as the body arrives
+// Returns the new CRC
+uint64_t crc64_update(uint64_t crc, const void* data, size_t len)
+{
+	static uint64_t table[256];
+	if (table[1] == 0)
+	{
+		for (uint64_t i = 0; i < 256; i++)
+		{
+			uint64_t c = i;
+			for (int k = 0; k < 8; k++)
+				{ c = (c & 1) ? 0xC96C5795D7870F42ull ^ (c >> 1) : c >> 1; }
+			table[i] = c;
+		}
+	}
+
+	const unsigned char* p = data;
+	crc = ~crc;
+	while (len-- > 0)
+		{ crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8); }
+	return ~crc;
+}
+
+
+
+// Function multiplies two polynomials modulo a CRC's, all of them bit-reflected with top the bit of x^0
+// Returns the product
+static uint64_t crc_multiply(uint64_t a, uint64_t b, uint64_t poly, uint64_t top)
+{
+	uint64_t product = 0;
+	for (uint64_t bit = top; bit != 0; bit >>= 1)
+	{
+		if (a & bit)	{ product ^= b; }
+		b = (b & 1) ? (b >> 1) ^ poly : b >> 1;
+	}
+	return product;
+}
+
+
+
+// Function moves a CRC on by len zero bytes, by multiplying it by x^(8 * len), that power found by squaring
+// Returns the new CRC register
+static uint64_t crc_shift(uint64_t crc, long long len, uint64_t poly, uint64_t top)
+{
+	uint64_t power = top >> 8;	// x^8
+	uint64_t factor = top;		// x^0
+	for (; len > 0; len >>= 1)
+	{
+		if (len & 1)	{ factor = crc_multiply(factor, power, poly, top); }
+		power = crc_multiply(power, power, poly, top);
+	}
+	return crc_multiply(factor, crc, poly, top);
+}
+
+
+
+// Function gives the CRC-32 of two runs of bytes one after the other from the CRC-32 of each, as zlib's
+// crc32_combine does, so pieces of a file written out of order can be checksummed as they arrive
+// Returns the CRC-32 of them both
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, long long len2)
+{
+	return (uint32_t) crc_shift(crc1, len2, 0xEDB88320u, 1u << 31) ^ crc2;
+}
+
+
+
+// Function does for the CRC-64 what crc32_combine does for the CRC-32
+// Returns the CRC-64 of them both
+uint64_t crc64_combine(uint64_t crc1, uint64_t crc2, long long len2)
+{
+	return crc_shift(crc1, len2, 0xC96C5795D7870F42ull, 1ull << 63) ^ crc2;
+}
+
+
+
+// Function computes the CRC-32 and the CRC-64 of the first bytes of a file
+// Returns 0 on success, -1 if the file cannot be read or is shorter than that
+int journal_file_crc(const char* file_name, long long bytes, uint32_t* crc, uint64_t* crc64)
+{
+	int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		{ return -1; }
+
+	char buf[HTTP_BUF_SIZE];
+	*crc = 0;
+	*crc64 = 0;
+	long long offset = 0;
+	while (offset < bytes)
+	{
+		size_t want = (bytes - offset < (long long) sizeof(buf)) ? (size_t) (bytes - offset) : sizeof(buf);
+		ssize_t n = pread(fd, buf, want, (off_t) offset);
+		if (n <= 0)
+			{ break; }
+		*crc = crc32_update(*crc, buf, (size_t) n);
+		*crc64 = crc64_update(*crc64, buf, (size_t) n);
+		offset += n;
+	}
+	close(fd);
+	return (offset == bytes) ? 0 : -1;
+}
+
+
+
+// Function appends one record for a line to the journal
+static void journal_write(int fd, const char* state, FileEntry* entry, long long bytes, uint32_t crc)
+{
+	char record[MAX_LINE_CHARS * 2];
+	int len = snprintf(record, sizeof(record), "%s %d %lld %08lx %s %s\n",
+		state, entry->line_number, bytes, (unsigned long) crc, entry->file_name, entry->url);
+	if (len > 0 && write(fd, record, (size_t) len) != len)
+		{ perror("journal"); }
+}
+
+
+
+// Function records that a line finished with the given bytes on disk
+void journal_done(FileEntry* entry, long long bytes, uint32_t crc)
+{
+	lines_done++;
+	if (journal_fd != -1)	{ journal_write(journal_fd, "done", entry, bytes, crc); }
+}
+
+
+
+// Function records how many bytes of a line are on disk so far
+void journal_progress(FileEntry* entry, long long bytes, uint32_t crc)
+{
+	if (journal_fd != -1)	{ journal_write(journal_fd, "partial", entry, bytes, crc); }
+}
+
+
+
+// Function hashes a line's file name and URL, which a record must match to count for that line
+static uint64_t journal_key(const char* file_name, const char* url)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (const char* c = file_name; *c != '\0'; c++)
+		{ hash = (hash ^ (unsigned char) *c) * 1099511628211ull; }
+	hash = (hash ^ ' ') * 1099511628211ull;
+	for (const char* c = url; *c != '\0'; c++)
+		{ hash = (hash ^ (unsigned char) *c) * 1099511628211ull; }
+	return hash;
+}
+
+
+
+// Function parses one record of the journal
+// Returns 0 on success, -1 for a line that is not a whole record (one cut short by a crash)
+static int journal_parse(const char* line, JournalRecord* record)
+{
+	char state[16];
+	char name[MAX_NAME_CHARS];
+	char url[MAX_URL_CHARS];
+	unsigned long crc;
+	if (sscanf(line, "%15s %d %lld %lx %63s %123s", state, &record->line_number, &record->bytes, &crc, name, url) != 6
+	 || record->line_number < 1 || record->bytes < 0)
+		{ return -1; }
+	record->state = (strcmp(state, "done") == 0) ? JOURNAL_DONE : JOURNAL_PARTIAL;
+	record->crc = (uint32_t) crc;
+	record->key = journal_key(name, url);
+	return 0;
+}
+
+
+
+// Function orders records by line, and the records of a line in the order they were written
+static int journal_compare(const void* a, const void* b)
+{
+	const JournalRecord* x = a;
+	const JournalRecord* y = b;
+	if (x->line_number != y->line_number)	{ return (x->line_number < y->line_number) ? -1 : 1; }
+	return (x->seq < y->seq) ? -1 : (x->seq > y->seq);
+}
+
+
+
+// The last record of every line of the journal, in line order, and how far the manifest has got through them
+static JournalRecord* records = NULL;
+static int n_records = 0;
+static int record_at = 0;
+
+
+
+// Function reads the journal of a manifest, keeping the last record of every line for journal_lookup,
+// and starts the journal over with just those records. The manifest is not needed for this, so the
+// journal costs memory per line it recorded but nothing per line of the manifest
+// Returns 0 on success, -1 if there is no journal to write to (the run goes on without one)
+int journal_open(const char* input_file)
+{
+	char path[MAX_LINE_CHARS * 2];
+	char temp[MAX_LINE_CHARS * 2];
+	snprintf(path, sizeof(path), "%s%s", input_file, JOURNAL_SUFFIX);
+	snprintf(temp, sizeof(temp), "%s%s.tmp", input_file, JOURNAL_SUFFIX);
+
+	FILE* fp = fopen(path, "r");
+	int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+	if (fd == -1)
+	{
+		perror(temp);
+		if (fp != NULL)	{ fclose(fp); }
+		return -1;
+	}
+
+	if (fp != NULL)
+	{
+		// First pass: every record, sorted by line with the last one of each line kept
+		char line[MAX_LINE_CHARS * 2];
+		int capacity = 0;
+		int seq = 0;
+		JournalRecord record;
+		while (fgets(line, sizeof(line), fp) != NULL)
+		{
+			if (journal_parse(line, &record) != 0)
+				{ continue; }
+			record.seq = seq++;
+			if (n_records == capacity)
+			{
+				capacity = capacity ? capacity * 2 : 256;
+				JournalRecord* grown = realloc(records, sizeof(JournalRecord) * (size_t) capacity);
+				if (grown == NULL)
+				{
+					fprintf(stderr, "Memory allocation failed\n");
+					exit(EXIT_FAILURE);
+				}
+				records = grown;
+			}
+			records[n_records++] = record;
+		}
+		qsort(records, (size_t) n_records, sizeof(JournalRecord), journal_compare);
+		int kept = 0;
+		for (int i = 0; i < n_records; i++)
+		{
+			if (i + 1 < n_records && records[i + 1].line_number == records[i].line_number)
+				{ continue; }
+			records[kept++] = records[i];
+		}
+		n_records = kept;
+
+		// Second pass: the records kept are copied to the new journal as they were written
+		unsigned char* winners = calloc((size_t) seq / 8 + 1, 1);
+		if (winners == NULL)
+		{
+			fprintf(stderr, "Memory allocation failed\n");
+			exit(EXIT_FAILURE);
+		}
+		for (int i = 0; i < n_records; i++)
+			{ winners[records[i].seq / 8] |= (unsigned char) (1 << (records[i].seq % 8)); }
+		rewind(fp);
+		seq = 0;
+		while (fgets(line, sizeof(line), fp) != NULL)
+		{
+			if (journal_parse(line, &record) != 0)
+				{ continue; }
+			if (winners[seq / 8] & (1 << (seq % 8)))
+			{
+				if (write(fd, line, strlen(line)) == -1)	{ perror("journal"); }
+			}
+			seq++;
+		}
+		free(winners);
+		fclose(fp);
+	}
+
+	// The new journal replaces the old one in one step, so a crash now loses nothing
+	if (rename(temp, path) != 0)
+	{
+		perror(path);
+		close(fd);
+		unlink(temp);
+		return -1;
+	}
+	journal_fd = fd;
+	snprintf(journal_path, sizeof(journal_path), "%s", path);
+	return 0;
+}
+
+
+
+// Function gives a line just read from the manifest what the journal says of it, in journal, resume_bytes and
+// resume_crc, with the CRC-64 of those bytes in resume_crc64. Nothing is taken on trust: the file must still
+// hold the bytes the journal says it does.
+// Lines are looked up in the order of the manifest, so this only ever moves forward through the records
+void journal_lookup(FileEntry* entry)
+{
+	lines_seen++;
+	entry->journal = JOURNAL_NONE;
+	entry->resume_bytes = 0;
+	entry->resume_crc = 0;
+	entry->resume_crc64 = 0;
+
+	while (record_at < n_records && records[record_at].line_number < entry->line_number)
+		{ record_at++; }
+	if (record_at == n_records || records[record_at].line_number != entry->line_number
+	 || records[record_at].key != journal_key(entry->file_name, entry->url))
+		{ return; }
+	JournalRecord* record = &records[record_at];
+
+	struct stat st;
+	uint32_t crc;
+	uint64_t crc64;
+	int intact = (stat(entry->file_name, &st) == 0 && journal_file_crc(entry->file_name, record->bytes, &crc, &crc64) == 0
+		&& crc == record->crc);
+	if (record->state == JOURNAL_DONE && (!intact || st.st_size != record->bytes))
+	{
+		printf("line %d: %s is missing or changed since it was downloaded, fetching it again\n", entry->line_number, entry->file_name);
+		return;
+	}
+	if (!intact)
+		{ return; }
+	entry->journal = record->state;
+	if (record->state == JOURNAL_DONE)	{ lines_done++; }
+	entry->resume_bytes = record->bytes;
+	entry->resume_crc = record->crc;
+	entry->resume_crc64 = crc64;
+}
+
+
+
+// Function ends the journal of a run that read the whole manifest. Once every line of it is done, there is
+// nothing left to resume, so the journal is removed: the next run of the manifest fetches it all again, asking
+// the servers whether what the cache holds is still current
+void journal_finish(void)
+{
+	if (journal_fd != -1 && lines_done == lines_seen)
+		{ unlink(journal_path); }
+}
+
+
+
+// Function closes the journal at the end of a run
+void journal_close(void)
+{
+	if (journal_fd != -1)
+	{
+		close(journal_fd);
+		journal_fd = -1;
+	}
+	free(records);
+	records = NULL;
+	n_records = 0;
+}
@@ -0,0 +1,215 @@
+#include "a4download.h"
+
+// Retries and the report. A line that failed for a reason that may pass (see the OUTCOME_ values) goes back
+// among the waiting lines, not to start again before a backoff that doubles with every try, jittered so lines
+// that failed together do not come back together, or before what the server asked for with Retry-After.
+// However a line ends, the report gets one JSON object for it, in the order the lines ended:
+//	[
+//	{"line": 3, "file": "out.bin", "url": "http://...", "outcome": "ok", "status": 200, "tries": 2, "bytes": 1024, "error": null},
+//	...
+//	]
+
+
+
+// The report, NULL when there is none or it could not be opened, whether a line has been written to it, and -R
+static FILE* report_fp = NULL;
+static int report_first = 1;
+static int max_retries = DEFAULT_RETRIES;
+
+// What the report calls each outcome, by OUTCOME_ value
+static const char* outcome_names[] = {
+	"connect", "timeout", "server_error", "throttled", "partial", "ok", "client_error", "failed", "interrupted", "skipped"
+};
+
+
+
+// Function sets how many times a line is retried, and opens the report when -o named report_file for it
+// Returns 0 on success, -1 if the report cannot be written (the run goes on without one)
+int report_open(const char* report_file, int retries)
+{
+	max_retries = retries;
+	srandom((unsigned) getpid() ^ (unsigned) time(NULL));
+	if (report_file == NULL)
+		{ return 0; }
+
+	if ((report_fp = fopen(report_file, "w")) == NULL)
+	{
+		perror(report_file);
+		return -1;
+	}
+	fprintf(report_fp, "[\n");
+	return 0;
+}
+
+
+
+// Function sorts an HTTP status into an outcome
+// Returns OUTCOME_OK for anything but an error status
+int status_outcome(int status)
+{
+	if (status == 429)	{ return OUTCOME_THROTTLED; }
+	if (status >= 500)	{ return OUTCOME_SERVER; }
+	if (status >= 400)	{ return OUTCOME_CLIENT; }
+	return OUTCOME_OK;
+}
+
+
+
+// Function reads the value of a Retry-After header: a number of seconds, or the date to wait until
+// Returns the seconds to wait, -1 if the value is neither
+double retry_after_seconds(const char* value)
+{
+	while (*value == ' ' || *value == '\t')
+		{ value++; }
+	if (isdigit((unsigned char) *value))
+		{ return strtod(value, NULL); }
+
+	struct tm when;
+	memset(&when, 0, sizeof(when));
+	if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &when) == NULL)
+		{ return -1; }
+	double seconds = difftime(timegm(&when), time(NULL));
+	return (seconds > 0) ? seconds : 0;
+}
+
+
+
+// Function copies a header's value into value, MAX_VALIDATOR_CHARS long, without the spaces around it.
+// A value too long to keep whole is not kept at all
+void header_value(const char* text, char* value)
+{
+	while (*text == ' ' || *text == '\t')
+		{ text++; }
+	size_t len = strcspn(text, "\r\n");
+	while (len > 0 && (text[len - 1] == ' ' || text[len - 1] == '\t'))
+		{ len--; }
+	if (len >= MAX_VALIDATOR_CHARS)
+		{ len = 0; }
+	memcpy(value, text, len);
+	value[len] = '\0';
+}
+
+
+
+// Function reads the headers curl -D saved for a line, then removes the file
+// Returns the status of the last response in it (a 100 Continue comes before the real one), 0 if there is none,
+// with its Retry-After in retry_after, -1 if it had none, and its ETag and Last-Modified, empty if it had none
+int headers_status(const char* path, double* retry_after, char* etag, char* last_modified)
+{
+	*retry_after = -1;
+	etag[0] = '\0';
+	last_modified[0] = '\0';
+	FILE* fp = fopen(path, "r");
+	if (fp == NULL)
+		{ return 0; }
+
+	char line[MAX_LINE_CHARS];
+	int status = 0;
+	int code;
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		if (strncmp(line, "HTTP/", 5) == 0 && sscanf(line, "HTTP/%*s %d", &code) == 1)
+		{
+			status = code;
+			*retry_after = -1;
+			etag[0] = '\0';
+			last_modified[0] = '\0';
+		}
+		else if (strncasecmp(line, "Retry-After:", 12) == 0)
+			{ *retry_after = retry_after_seconds(line + 12); }
+		else if (strncasecmp(line, "ETag:", 5) == 0)
+			{ header_value(line + 5, etag); }
+		else if (strncasecmp(line, "Last-Modified:", 14) == 0)
+			{ header_value(line + 14, last_modified); }
+	}
+	fclose(fp);
+	unlink(path);
+	return status;
+}
+
+
+
+// Function decides whether a line that ended with outcome is tried again, and if so when: after RETRY_BASE
+// doubled for every try so far, up to RETRY_MAX, between half and all of it at random, or after retry_after
+// (when not negative) should that be longer
+// Returns 1 if the line is to go back among the waiting ones, 0 if it is done with
+int retry_schedule(FileEntry* entry, int outcome, double retry_after)
+{
+	entry->attempts++;
+	if (outcome > OUTCOME_PARTIAL || entry->attempts > max_retries)
+		{ return 0; }
+
+	double backoff = RETRY_BASE;
+	for (int i = 1; i < entry->attempts && backoff < RETRY_MAX; i++)
+		{ backoff *= 2; }
+	if (backoff > RETRY_MAX)
+		{ backoff = RETRY_MAX; }
+	backoff *= 0.5 + 0.5 * ((double) random() / RAND_MAX);
+	if (retry_after > RETRY_AFTER_MAX)
+		{ retry_after = RETRY_AFTER_MAX; }
+	if (retry_after > backoff)
+		{ backoff = retry_after; }
+
+	entry->not_before = now_seconds() + backoff;
+	printf("line %d: %s, trying again in %.1f seconds (retry %d of %d)\n",
+		entry->line_number, outcome_names[outcome], backoff, entry->attempts, max_retries);
+	return 1;
+}
+
+
+
+// Function names an outcome as the report does
+// Returns the name
+const char* outcome_name(int outcome)
+{
+	return outcome_names[outcome];
+}
+
+
+
+// Function writes a string to the report as a JSON string
+static void report_string(const char* text)
+{
+	fputc('"', report_fp);
+	for (const unsigned char* c = (const unsigned char*) text; *c != '\0'; c++)
+	{
+		if (*c == '"' || *c == '\\')	{ fprintf(report_fp, "\\%c", *c); }
+		else if (*c < 0x20)		{ fprintf(report_fp, "\\u%04x", *c); }
+		else				{ fputc(*c, report_fp); }
+	}
+	fputc('"', report_fp);
+}
+
+
+
+// Function adds how a line ended to the report. status is the HTTP status, 0 if there was none;
+// error says what went wrong, NULL if nothing did
+void report_line(FileEntry* entry, int outcome, int status, long long bytes, const char* error)
+{
+	if (report_fp == NULL)
+		{ return; }
+
+	fprintf(report_fp, "%s{\"line\": %d, \"file\": ", report_first ? "" : ",\n", entry->line_number);
+	report_string(entry->file_name);
+	fprintf(report_fp, ", \"url\": ");
+	report_string(entry->url);
+	fprintf(report_fp, ", \"outcome\": \"%s\", \"status\": %d, \"tries\": %d, \"bytes\": %lld, \"error\": ",
+		outcome_names[outcome], status, entry->attempts, bytes);
+	if (error != NULL)	{ report_string(error); }
+	else			{ fprintf(report_fp, "null"); }
+	fputc('}', report_fp);
+	report_first = 0;
+}
+
+
+
+// Function finishes the report at the end of a run, or when it is cut short
+void report_close(void)
+{
+	if (report_fp != NULL)
+	{
+		fprintf(report_fp, "%s]\n", report_first ? "" : "\n");
+		fclose(report_fp);
+		report_fp = NULL;
+	}
+}
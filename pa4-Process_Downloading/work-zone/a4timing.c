@@ -0,0 +1,213 @@
+#include "a4download.h"
+
+// Timings: every try at a line, whichever engine made it, is timed part by part (see Timing), so a slow run
+// shows where its time went. Waiting to start points at too few downloads, DNS, connecting and the first byte
+// at the servers, a transfer slower than the network allows at the disk or at shaping. The end of the run
+// prints percentiles of each part and of the rate of every try that downloaded its file (bodies under
+// RATE_MIN_BYTES left out), and the bytes per second of the whole run; with -t every try also goes to
+// the trace as it ends, a CSV row or a JSON object each, in a JSON array like the report's:
+//	line,try,outcome,queued,dns,connect,ttfb,transfer,total,bytes,mb_per_s
+// A part a try never got to is left empty (null in JSON). Percentiles come from histograms, not from the
+// values themselves, so memory stays the same however long the manifest is
+
+
+
+// The histograms of each part of a try and of the rate of each transfer, the trace (NULL when there is none)
+// and how it is written, and the bytes of downloaded files received since the run started
+static Histogram parts[6];
+static Histogram rates;
+static const char* part_names[] = { "queued", "dns", "connect", "ttfb", "transfer", "total", "bytes", "mb_per_s" };
+static FILE* trace_fp = NULL;
+static int trace_csv = 0;
+static int trace_first = 1;
+static long long total_bytes = 0;
+static double run_start = 0;
+
+
+
+// Function opens the trace, if trace_file names one, and starts the run's clock
+// Returns 0 on success, -1 if the trace cannot be written (the run goes on without one)
+int timing_open(const char* trace_file)
+{
+	run_start = now_seconds();
+	if (trace_file == NULL)
+		{ return 0; }
+	if ((trace_fp = fopen(trace_file, "w")) == NULL)
+	{
+		perror(trace_file);
+		return -1;
+	}
+
+	size_t len = strlen(trace_file);
+	trace_csv = (len >= 4 && strcasecmp(trace_file + len - 4, ".csv") == 0);
+	if (trace_csv)	{ fprintf(trace_fp, "line,try,outcome,queued,dns,connect,ttfb,transfer,total,bytes,mb_per_s\n"); }
+	else		{ fprintf(trace_fp, "[\n"); }
+	return 0;
+}
+
+
+
+// Function finds the bucket of a value: values under 8 have one each, larger ones share one with the values
+// whose highest bit and 3 bits after it are the same
+// Returns the bucket
+static int histogram_bucket(unsigned long long value)
+{
+	if (value < 8)
+		{ return (int) value; }
+	int msb = 3;
+	while ((value >> (msb + 1)) != 0)
+		{ msb++; }
+	return msb * 8 + (int) ((value >> (msb - 3)) & 7);
+}
+
+
+
+// Function counts a value into a histogram, in units of scale (a second counted in microseconds has scale 1e6)
+static void histogram_add(Histogram* histogram, double value, double scale)
+{
+	histogram->count++;
+	histogram->sum += value;
+	if (value > histogram->max)
+		{ histogram->max = value; }
+	histogram->buckets[histogram_bucket((unsigned long long) (value * scale))]++;
+}
+
+
+
+// Function finds the value a share p (0 to 1) of a histogram's values are no larger than
+// Returns the top of the bucket it falls in, no more than the largest value counted
+static double histogram_percentile(Histogram* histogram, double p, double scale)
+{
+	long long rank = (long long) (p * (double) histogram->count + 0.999999);
+	long long seen = 0;
+	int b = 0;
+	while (b < TIMING_BUCKETS - 1 && (seen += histogram->buckets[b]) < rank)
+		{ b++; }
+
+	unsigned long long top = (unsigned long long) b;
+	if (b >= 8)
+	{
+		int msb = b / 8;
+		top = ((unsigned long long) (8 + b % 8 + 1) << (msb - 3)) - 1;
+	}
+	double value = (double) top / scale;
+	return (value < histogram->max) ? value : histogram->max;
+}
+
+
+
+// Function writes one field of the trace, empty (null in JSON) when value is negative
+static void trace_value(const char* name, double value)
+{
+	if (!trace_csv)		{ fprintf(trace_fp, ", \"%s\": ", name); }
+	else			{ fputc(',', trace_fp); }
+	if (value >= 0)		{ fprintf(trace_fp, "%.6f", value); }
+	else if (!trace_csv)	{ fprintf(trace_fp, "null"); }
+}
+
+
+
+// Function records how a try at a line went: how long it waited to start and took in all, from the line's
+// times, and the parts the engine timed in timing. It is counted for the summary and written to the trace
+void timing_record(FileEntry* entry, int outcome, Timing* timing)
+{
+	timing->queued = entry->started - entry->ready;
+	if (timing->queued < 0)
+		{ timing->queued = 0; }
+	timing->total = now_seconds() - entry->started;
+
+	double values[6] = { timing->queued, timing->dns, timing->connect, timing->ttfb, timing->transfer, timing->total };
+	for (int i = 0; i < 6; i++)
+	{
+		if (values[i] >= 0)	{ histogram_add(&parts[i], values[i], 1e6); }
+	}
+	double rate = (timing->transfer > 0 && timing->bytes > 0) ? (double) timing->bytes / timing->transfer : -1;
+	// An error page or a body of a few bytes would only drag the slowest transfers down to nothing
+	if (outcome == OUTCOME_OK)
+	{
+		if (rate >= 0 && timing->bytes >= RATE_MIN_BYTES)
+			{ histogram_add(&rates, rate, 1); }
+		total_bytes += timing->bytes;
+	}
+
+	if (trace_fp == NULL)
+		{ return; }
+	if (trace_csv)	{ fprintf(trace_fp, "%d,%d,%s", entry->line_number, entry->attempts + 1, outcome_name(outcome)); }
+	else
+	{
+		fprintf(trace_fp, "%s{\"line\": %d, \"try\": %d, \"outcome\": \"%s\"", trace_first ? "" : ",\n",
+			entry->line_number, entry->attempts + 1, outcome_name(outcome));
+		trace_first = 0;
+	}
+	for (int i = 0; i < 6; i++)
+		{ trace_value(part_names[i], values[i]); }
+	if (trace_csv)	{ fprintf(trace_fp, ",%lld", timing->bytes); }
+	else		{ fprintf(trace_fp, ", \"%s\": %lld", part_names[6], timing->bytes); }
+	trace_value(part_names[7], (rate >= 0) ? rate / 1e6 : -1);
+	fputs(trace_csv ? "\n" : "}", trace_fp);
+}
+
+
+
+// Function reads the timings curl -w wrote for a child to path, then removes the file. curl counts every time
+// from its start, each part is the difference from the one before; a part curl did not reach reads 0
+void timing_curl(const char* path, Timing* timing)
+{
+	timing->dns = timing->connect = timing->ttfb = timing->transfer = -1;
+	timing->bytes = 0;
+	FILE* fp = fopen(path, "r");
+	if (fp == NULL)
+		{ return; }
+
+	double lookup, connect, pretransfer, start, end;
+	if (fscanf(fp, "%lf %lf %lf %lf %lf %lld", &lookup, &connect, &pretransfer, &start, &end, &timing->bytes) == 6)
+	{
+		timing->dns = lookup;
+		if (connect > 0)	{ timing->connect = connect - lookup; }
+		if (start > 0)
+		{
+			timing->ttfb = start - pretransfer;
+			timing->transfer = end - start;
+		}
+	}
+	fclose(fp);
+	unlink(path);
+}
+
+
+
+// Function prints the summary of the run's timings and finishes the trace, at the end of a run or when it is cut short
+void timing_close(void)
+{
+	if (trace_fp != NULL)
+	{
+		if (!trace_csv)	{ fprintf(trace_fp, "%s]\n", trace_first ? "" : "\n"); }
+		fclose(trace_fp);
+		trace_fp = NULL;
+	}
+	if (parts[5].count == 0)
+		{ return; }
+
+	double elapsed = now_seconds() - run_start;
+	printf("\n%lld tries, %.1f MB received in %.2f seconds: %.3f GB/s\n", parts[5].count, total_bytes / 1e6, elapsed,
+		(elapsed > 0) ? total_bytes / 1e9 / elapsed : 0);
+	printf("%-10s %10s %10s %10s %10s %10s\n", "seconds", "p50", "p90", "p99", "max", "mean");
+	for (int i = 0; i < 6; i++)
+	{
+		Histogram* h = &parts[i];
+		if (h->count == 0)
+			{ continue; }
+		printf("%-10s %10.4f %10.4f %10.4f %10.4f %10.4f\n", part_names[i], histogram_percentile(h, 0.5, 1e6),
+			histogram_percentile(h, 0.9, 1e6), histogram_percentile(h, 0.99, 1e6), h->max, h->sum / h->count);
+	}
+	// The slowest transfers are the ones that matter, so their percentiles are counted from the bottom
+	if (rates.count > 0)
+	{
+		printf("%-10s %10s %10s %10s %10s %10s\n", "MB/s", "p50", "p10", "p1", "max", "mean");
+		printf("%-10s %10.2f %10.2f %10.2f %10.2f %10.2f\n", "transfer", histogram_percentile(&rates, 0.5, 1) / 1e6,
+			histogram_percentile(&rates, 0.1, 1) / 1e6, histogram_percentile(&rates, 0.01, 1) / 1e6,
+			rates.max / 1e6, rates.sum / rates.count / 1e6);
+	}
+	memset(parts, 0, sizeof(parts));
+	memset(&rates, 0, sizeof(rates));
+}
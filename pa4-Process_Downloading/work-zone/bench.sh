@@ -0,0 +1,125 @@
+#!/bin/bash
+# Benchmark for a4download against the local fixture server, run by "make bench"
+#
+# Starts ./a4fixture on a free port, generates a manifest of BENCH_LINES lines for every workload, and runs
+# a4download over it with each engine at each concurrency level, saving into a fresh directory every time.
+# Nothing leaves the machine, so runs are repeatable and work offline.
+#	small	files of 1 byte to 64 KiB, where the cost per download dominates
+#	large	a fiftieth as many files of 4 to 16 MiB, where the bytes dominate
+#	mixed	small files, one in ten of 1 MiB, and some sent late, chunked, without ranges or failing once
+#
+# Knobs, all optional:
+#	BENCH_LINES		lines per manifest, default 2000
+#	BENCH_CONCURRENCY	downloads at once, default "4 16 64"
+#	BENCH_ENGINES		default "curl http"
+#	BENCH_WORKLOADS		default "small large mixed"
+#	BENCH_DIR		where the files are saved, default /dev/shm (set it to a disk to count the disk in)
+#	BENCH_KEEP		set to 1 to keep the manifests, downloads, reports and traces
+#
+# Output is one tab separated line per run, latencies being whole tries from start to end (a4download -t):
+#	workload engine concurrency lines MB wall_s MB_per_s p50_s p99_s cpu_s cpu_ms_per_MB failed
+# CPU time counts a4download and every curl child it ran, not the fixture server
+
+A4DOWNLOAD=${A4DOWNLOAD:-./a4download}
+A4FIXTURE=${A4FIXTURE:-./a4fixture}
+LINES=${BENCH_LINES:-2000}
+CONCURRENCY=${BENCH_CONCURRENCY:-"4 16 64"}
+ENGINES=${BENCH_ENGINES:-"curl http"}
+WORKLOADS=${BENCH_WORKLOADS:-"small large mixed"}
+
+if [ ! -x "$A4DOWNLOAD" ] || [ ! -x "$A4FIXTURE" ]; then
+	echo "bench: build $A4DOWNLOAD and $A4FIXTURE first (make bench does)" >&2
+	exit 1
+fi
+A4DOWNLOAD=$(cd "$(dirname "$A4DOWNLOAD")" && pwd)/$(basename "$A4DOWNLOAD")
+if [ ! -x /usr/bin/curl ]; then
+	echo "bench: /usr/bin/curl not found, the curl engine is skipped" >&2
+	ENGINES=${ENGINES//curl/}
+fi
+
+base=${BENCH_DIR:-/dev/shm}/a4download-bench.$$
+mkdir -p "$base" || exit 1
+
+# The fixture prints the port it got, then serves until it is sent SIGTERM
+"$A4FIXTURE" -q > "$base/port" &
+fixture=$!
+trap 'kill $fixture 2> /dev/null; [ "${BENCH_KEEP:-0}" = 1 ] || rm -rf "$base"' EXIT
+for ((i = 0; i < 50; i++)); do
+	port=$(awk '{ print $2 }' "$base/port" 2> /dev/null)
+	[ -n "$port" ] && break
+	sleep 0.1
+done
+if [ -z "$port" ]; then
+	echo "bench: a4fixture did not start" >&2
+	exit 1
+fi
+
+
+# manifest WORKLOAD RUN: prints the manifest of a workload, the same every time but for the run number, which
+# keeps the URLs of one run apart from another's so the fixture counts fail=1 afresh
+manifest() {
+	awk -v workload="$1" -v run="$2" -v lines="$LINES" -v url="http://127.0.0.1:$port/bytes/" 'BEGIN {
+		srand(357)
+		if (workload == "large") { lines = int(lines / 50); if (lines < 8) lines = 8 }
+		for (i = 0; i < lines; i++) {
+			if (workload == "large")	size = int((4 + rand() * 12) * 1048576)
+			else				size = int(rand() * 65536) + 1
+			query = "run=" run
+			if (workload == "mixed") {
+				r = rand()
+				if (r < 0.10)		size = 1048576
+				else if (r < 0.15)	query = query "&delay=" int(100 + rand() * 400)
+				else if (r < 0.20)	query = query "&chunked=1"
+				else if (r < 0.22)	query = query "&norange=1"
+				else if (r < 0.24)	query = query "&status=503&fail=1"
+			}
+			printf "f%d %s%d?%s 30\n", i, url, size, query
+		}
+	}'
+}
+
+# percentile P FILE: the P-th percentile of the numbers in FILE, one per line
+percentile() {
+	sort -n "$2" | awk -v p="$1" '{ v[NR] = $1 } END { if (NR == 0) { print "-"; exit } i = int(p / 100 * NR + 0.999999); if (i < 1) i = 1; printf "%.4f", v[i] }'
+}
+
+# measure WORKLOAD ENGINE CONCURRENCY RUN: downloads the workload's manifest once and prints one result line
+measure() {
+	local workload=$1 engine=$2 concurrency=$3 run=$4
+	local dir=$base/$workload-$engine-$concurrency
+	rm -rf "$dir"
+	mkdir -p "$dir"
+	manifest "$workload" "$run" > "$dir/manifest"
+
+	# bash's time counts the children a4download waited for, so every curl child is in it
+	local TIMEFORMAT="%R %U %S" times
+	times=$( { time (cd "$dir" && "$A4DOWNLOAD" -e "$engine" -o manifest.report.json -t trace.csv manifest "$concurrency" > output 2>&1) ; } 2>&1 )
+	local wall user sys
+	read -r wall user sys <<< "$times"
+
+	# Trace columns: line,try,outcome,queued,dns,connect,ttfb,transfer,total,bytes,mb_per_s
+	awk -F, 'NR > 1 { print $9 }' "$dir/trace.csv" > "$dir/totals"
+	local bytes failed lines
+	bytes=$(awk -F, 'NR > 1 { sum += $10 } END { printf "%d", sum }' "$dir/trace.csv")
+	lines=$(wc -l < "$dir/manifest")
+	failed=$(grep -c '"outcome": "[^o]' "$dir/manifest.report.json")
+	awk -v w="$workload" -v e="$engine" -v c="$concurrency" -v l="$lines" -v b="$bytes" -v wall="$wall" -v u="$user" -v s="$sys" \
+		-v p50="$(percentile 50 "$dir/totals")" -v p99="$(percentile 99 "$dir/totals")" -v f="$failed" 'BEGIN {
+		mb = b / 1e6
+		printf "%s\t%s\t%s\t%d\t%.1f\t%.3f\t%.1f\t%s\t%s\t%.3f\t%s\t%d\n", w, e, c, l, mb, wall, (wall > 0) ? mb / wall : 0,
+			p50, p99, u + s, (mb > 0) ? sprintf("%.2f", (u + s) * 1000 / mb) : "-", f
+	}'
+	[ "${BENCH_KEEP:-0}" = 1 ] || rm -rf "$dir"
+}
+
+
+printf "workload\tengine\tconcurrency\tlines\tMB\twall_s\tMB_per_s\tp50_s\tp99_s\tcpu_s\tcpu_ms_per_MB\tfailed\n"
+run=0
+for workload in $WORKLOADS; do
+	for engine in $ENGINES; do
+		for concurrency in $CONCURRENCY; do
+			run=$((run + 1))
+			measure "$workload" "$engine" "$concurrency" "$run"
+		done
+	done
+done
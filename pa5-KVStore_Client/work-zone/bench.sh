@@ -0,0 +1,79 @@
+#!/bin/bash
+# Benchmark for kvstore, run by "make bench"
+#
+# Starts ./kvstore on a new, empty database and socket, then runs ./kvbench against it at each number of
+# connections, depth of requests in flight per connection and share of gets. Every run first sets all of its
+# keys, so gets find values; the database grows across runs as a real one would.
+#
+# Knobs, all optional:
+#	BENCH_CONNECTIONS	default "1 64 1024"
+#	BENCH_DEPTH		requests in flight per connection, default "1 32"
+#	BENCH_GETS		percent of requests that are gets, default "90 50"
+#	BENCH_REQUESTS		requests per run, default 1000000
+#	BENCH_KEYS		default 100000
+#	BENCH_VALUE		bytes per value, default 32
+#	BENCH_THREADS		kvbench threads, default 1 (the server has one, and every thread added takes a core)
+#	BENCH_DIR		where the database and socket go, default /dev/shm
+#	BENCH_KEEP		set to 1 to keep the database
+#
+# Output is one tab separated line per run, latencies from sending a request to reading its reply:
+#	connections depth get_pct requests seconds requests_per_s p50_us p99_us errors server_cpu_s requests_per_server_cpu_s
+# Server CPU time is read from /proc, so the last column is what one core of kvstore would do on its own
+
+KVSTORE=${KVSTORE:-./kvstore}
+KVBENCH=${KVBENCH:-./kvbench}
+CONNECTIONS=${BENCH_CONNECTIONS:-"1 64 1024"}
+DEPTHS=${BENCH_DEPTH:-"1 32"}
+GETS=${BENCH_GETS:-"90 50"}
+REQUESTS=${BENCH_REQUESTS:-1000000}
+KEYS=${BENCH_KEYS:-100000}
+VALUE=${BENCH_VALUE:-32}
+THREADS=${BENCH_THREADS:-1}
+
+if [ ! -x "$KVSTORE" ] || [ ! -x "$KVBENCH" ]; then
+	echo "bench: build $KVSTORE and $KVBENCH first (make bench does)" >&2
+	exit 1
+fi
+
+base=${BENCH_DIR:-/dev/shm}/kvstore-bench.$$
+mkdir -p "$base" || exit 1
+: > "$base/bench.db"
+
+# The server rehashes aloud as the index grows, which is of no interest here
+"$KVSTORE" "$base/bench.db" "$base/socket" > /dev/null &
+server=$!
+trap 'kill -QUIT $server 2> /dev/null; wait $server 2> /dev/null; [ "${BENCH_KEEP:-0}" = 1 ] || rm -rf "$base"' EXIT
+for ((i = 0; i < 50; i++)); do
+	[ -S "$base/socket" ] && break
+	sleep 0.1
+done
+if [ ! -S "$base/socket" ]; then
+	echo "bench: kvstore did not start" >&2
+	exit 1
+fi
+
+# cpu_ticks: the server's user and system time so far, in clock ticks
+cpu_ticks() {
+	awk '{ print $14 + $15 }' "/proc/$server/stat"
+}
+HZ=$(getconf CLK_TCK)
+
+printf "connections\tdepth\tget_pct\trequests\tseconds\trequests_per_s\tp50_us\tp99_us\terrors\tserver_cpu_s\trequests_per_server_cpu_s\n"
+for connections in $CONNECTIONS; do
+	for depth in $DEPTHS; do
+		for gets in $GETS; do
+			before=$(cpu_ticks)
+			result=$("$KVBENCH" -c "$connections" -d "$depth" -g "$gets" -n "$REQUESTS" -k "$KEYS" -v "$VALUE" -t "$THREADS" "$base/socket" | tail -n 1)
+			[ -n "$result" ] || exit 1
+			after=$(cpu_ticks)
+
+			# The preload's sets are in the server's time too, so they are counted in with the requests
+			awk -v c="$connections" -v d="$depth" -v g="$gets" -v r="$result" -v ticks=$((after - before)) -v hz="$HZ" -v k="$KEYS" 'BEGIN {
+				split(r, f, "\t")
+				cpu = ticks / hz
+				printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%.2f\t%s\n", c, d, g, f[1], f[2], f[3], f[4], f[5], f[6], cpu,
+					(cpu > 0) ? sprintf("%.0f", (f[1] + k) / cpu) : "-"
+			}'
+		done
+	done
+done
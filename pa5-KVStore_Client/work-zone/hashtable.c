@@ -1,166 +1,332 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-
-#define MAX_KEY_LEN 33		// 32 chars + 1 null term
-#define MAX_VAL_LEN 1025	// 1024 chars + 1 null term
-#define DEFAULT_HT_CAP 20
-
-// A KeyValuePair struct holds 3 pieces of information:
-typedef struct KeyValuePair {
-	char key[MAX_KEY_LEN];		// 1. a string representing the key
-	int value;			// 2. a byte offset representing the position of the value in the database
-	struct KeyValuePair* next;	// 3. another key-value pair to handle separate chaining
-} KeyValuePair;
-
-// A HashTable struct will hold a table of constant-defined pointers to KeyValuePairs
-typedef struct HashTable {
-	struct KeyValuePair** table;	// Pointer to a dynamically allocated array of KeyValuePairs
-	int cap;
-	int size;
-} HashTable;
-
-// Simple hash function by DJB2
-int hash_function(const char* key, int capacity)
-{
-	unsigned long hash = 5381;	// Start with a large prime
-	int c;
-
-	while ((c = *key++))
+#include "kvstore.h"
+
+// Hash function: 8 bytes of the key at a time, each multiplied in and rotated, then mixed as in MurmurHash3's
+// finalizer. Unlike DJB2's, every bit of it depends on every byte of the key, and the table takes the low 7 bits
+// for the control byte and the ones above them for the group
+uint64_t hash_function(const char* key, size_t len)
+{
+	uint64_t hash = 0x9E3779B97F4A7C15ULL ^ len;
+	uint64_t word;
+
+	while (len >= 8)
+	{
+		memcpy(&word, key, 8);
+		hash ^= word * 0x87C37B91114253D5ULL;
+		hash = ((hash << 31) | (hash >> 33)) * 0x4CF5AD432745937FULL;
+		key += 8;
+		len -= 8;
+	}
+	word = 0;
+	memcpy(&word, key, len);
+	hash ^= word * 0x87C37B91114253D5ULL;
+
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDULL;
+	hash ^= hash >> 33;
+	hash *= 0xC4CEB9FE1A85EC53ULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+
+
+// Function compares a group's control bytes to byte
+// Returns a mask with bit i set for each of its slots i whose control byte is equal to it
+static inline uint32_t group_match(const HtGroup* group, uint8_t byte)
+{
+#ifdef __SSE2__
+	__m128i ctrl = _mm_load_si128((const __m128i*) group->ctrl);
+	return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char) byte))) & ((1u << HT_SLOTS) - 1);
+#else
+	uint32_t mask = 0;
+	for (int i = 0; i < HT_SLOTS; i++)
+	{
+		if (group->ctrl[i] == byte)	{ mask |= 1u << i; }
+	}
+	return mask;
+#endif
+}
+
+
+
+// Returns a mask with bit i set for each empty slot i of a group
+static inline uint32_t group_empty(const HtGroup* group)
+{
+#ifdef __SSE2__
+	// Movemask takes the top bit of each control byte, HT_FULL
+	return ~(uint32_t) _mm_movemask_epi8(_mm_load_si128((const __m128i*) group->ctrl)) & ((1u << HT_SLOTS) - 1);
+#else
+	return group_match(group, HT_EMPTY);
+#endif
+}
+
+
+
+// Returns the pair a slot points to
+static inline KeyValuePair* pair_at(HashTable* ht, uint32_t ref)
+{
+	return (KeyValuePair*) (ht->pairs + (size_t) ref * 8);
+}
+
+
+
+// Returns the bytes a pair with a key of len chars takes in the pair storage, rounded up to keep the next aligned
+static inline size_t pair_size(size_t len)
+{
+	return (offsetof(KeyValuePair, key) + len + 1 + 7) & ~(size_t) 7;
+}
+
+
+
+// Returns the length of a key, at most MAX_KEY_LEN - 1 as a longer one is cut to that when it is stored
+static inline size_t key_len(const char* key)
+{
+	size_t len = 0;
+	while (len < MAX_KEY_LEN - 1 && key[len] != '\0')
+		{ len++; }
+	return len;
+}
+
+
+
+// Function finds where a key with this hash goes in a table of cap groups: the first empty slot of the groups it
+// probes, which are the hash's group and then the ones 1, 3, 6, 10... after it, wrapping around. With cap a
+// power of two, that visits every group, and a table is never let fill up
+// Returns the slot, its group's index times HT_SLOTS plus its own
+static size_t find_empty(const HtGroup* groups, size_t cap, uint64_t hash)
+{
+	size_t group = (size_t) (hash >> 7) & (cap - 1);
+
+	for (size_t step = 1; ; step++)
 	{
-		// hash * 33 + c
-		hash = ((hash << 5) + hash) + c;
+		uint32_t empty = group_empty(&groups[group]);
+		if (empty != 0)
+			{ return group * HT_SLOTS + (size_t) __builtin_ctz(empty); }
+		group = (group + step) & (cap - 1);
 	}
+}
+
 
-	return (int)(hash % capacity);
+
+// Function puts a pair, whose key has this hash, in the first empty slot its probe reaches
+static void place_pair(HtGroup* groups, size_t cap, uint64_t hash, uint32_t ref)
+{
+	size_t slot = find_empty(groups, cap, hash);
+	groups[slot / HT_SLOTS].ctrl[slot % HT_SLOTS] = (uint8_t) (HT_FULL | (hash & 0x7F));
+	groups[slot / HT_SLOTS].pairs[slot % HT_SLOTS] = ref;
 }
 
+
+
+// Function finds a key, of len chars, probing the same groups find_empty would have put it in. Nothing is ever
+// removed, so a group with an empty slot is the last one it could be in
+// Returns its pair, NULL if it is not in the table
+static KeyValuePair* find_pair(HashTable* ht, const char* key, size_t len, uint64_t hash)
+{
+	size_t group = (size_t) (hash >> 7) & (ht->cap - 1);
+	uint8_t tag = (uint8_t) (HT_FULL | (hash & 0x7F));
+
+	for (size_t step = 1; ; step++)
+	{
+		const HtGroup* cur = &ht->groups[group];
+
+		// Only pairs whose 7 bits match are read; 1 in 128 others get this far
+		for (uint32_t match = group_match(cur, tag); match != 0; match &= match - 1)
+		{
+			KeyValuePair* pair = pair_at(ht, cur->pairs[__builtin_ctz(match)]);
+			if (pair->len == len && memcmp(pair->key, key, len) == 0)
+				{ return pair; }
+		}
+		if (group_empty(cur) != 0)
+			{ return NULL; }
+		group = (group + step) & (ht->cap - 1);
+	}
+}
+
+
+
+// Function maps size bytes of zeroed memory, page-aligned so every group is a cache line of its own. Lookups land
+// anywhere in the groups and the pair storage, so big ones are asked for huge pages, for fewer TLB misses
+// Returns the memory, NULL if it ran out
+static void* alloc_pages(size_t size)
+{
+	void* pages = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pages == MAP_FAILED)
+		{ return NULL; }
+	if (size >= HT_HUGE_SIZE)
+		{ madvise(pages, size, MADV_HUGEPAGE); }	// only advice: without it the table still works
+	return pages;
+}
+
+
+
 // Function to create a new HashTable
 HashTable* create_hash_table()
 {
+	return create_hash_table_sized(0);
+}
+
+
+
+// Function to create a new HashTable with enough groups for items pairs, so filling it to that never rehashes
+HashTable* create_hash_table_sized(size_t items)
+{
+	size_t cap = DEFAULT_HT_CAP;
+	while (items > cap * HT_SLOTS / 8 * 7)
+		{ cap *= 2; }
+
 	HashTable* ht = (HashTable*) malloc(sizeof(HashTable));
 	if (ht != NULL)
 	{
-		ht->cap = DEFAULT_HT_CAP;
+		ht->cap = cap;
 		ht->size = 0;
-		ht->table = (KeyValuePair**) calloc(DEFAULT_HT_CAP, sizeof(KeyValuePair*));
-		if (ht->table == NULL)
+		ht->pairs = NULL;
+		ht->pairs_len = 0;
+		ht->pairs_cap = 0;
+		ht->quiet = 0;
+		ht->groups = (HtGroup*) alloc_pages(cap * sizeof(HtGroup));
+		if (ht->groups == NULL)
 		{
-			free(ht); // Clean up if calloc fails
+			free(ht); // Clean up if the allocation fails
 			return NULL;
 		}
 	}
 	return ht;
 }
 
+
+
 void rehash(HashTable* ht)
 {
-	int old_cap = ht->cap;
-	int new_cap = old_cap * 2;
+	size_t new_cap = ht->cap * 2;
 
 	// Create a new table with double the capacity
-	KeyValuePair** new_table = (KeyValuePair**) calloc(new_cap, sizeof(KeyValuePair*));
-	if (new_table == NULL)
+	HtGroup* new_groups = (HtGroup*) alloc_pages(new_cap * sizeof(HtGroup));
+	if (new_groups == NULL)
 	{
-		printf("Failed to allocate memory for rehashing.\n");
+		if (!ht->quiet)	{ printf("Failed to allocate memory for rehashing.\n"); }
 		return;
 	}
 
-	// Rehash all items from the old table into the new table
-	for (int i = 0; i < old_cap; i++)
+	// Rehash all items into the new table, reading them in the order they are stored, which is where they stay
+	for (size_t at = 0; at < ht->pairs_len; )
 	{
-		KeyValuePair* cur = ht->table[i];
-		while (cur != NULL)
-		{
-			KeyValuePair* next = cur->next;
-			int new_index = hash_function(cur->key, new_cap);
-
-			// Insert into the new table
-			cur->next = new_table[new_index];
-			new_table[new_index] = cur;
-
-			cur = next;
-		}
+		KeyValuePair* pair = (KeyValuePair*) (ht->pairs + at);
+		place_pair(new_groups, new_cap, hash_function(pair->key, pair->len), (uint32_t) (at / 8));
+		at += pair_size(pair->len);
 	}
 
 	// Free the old table and update the hash_table to point to the new table
-	free(ht->table);
-	ht->table = new_table;
+	munmap(ht->groups, ht->cap * sizeof(HtGroup));
+	ht->groups = new_groups;
 	ht->cap = new_cap;
 
-	printf("Rehashing complete. New capacity: %d\n", new_cap);
+	if (!ht->quiet)	{ printf("Rehashing complete. New capacity: %zu\n", new_cap * HT_SLOTS); }
 }
 
-void set_item(HashTable* ht, char* key, int value)
-{
-	// Create a hash index using the inputted key and the current capacity of the hashtable
-	int index = hash_function(key, ht->cap);
 
-	// Loop through the separate chains in the HashTable
-	KeyValuePair* cur = ht->table[index];
-	while (cur != NULL)
+
+// Function packs a new pair onto the end of the pair storage, doubling it when it is full. Nothing points into
+// it but by offset, so mremap(2) may move it, which moves its pages rather than copying them
+// Returns the pair's offset in units of 8 bytes, -1 if memory ran out or the offset would not fit in a slot
+static long long store_pair(HashTable* ht, const char* key, size_t len, long long value)
+{
+	size_t size = pair_size(len);
+	if (ht->pairs_len + size > ht->pairs_cap)
 	{
-		// If we find the exact key, replace it with a new value
-		if (strcmp(cur->key, key) == 0)
+		size_t new_cap = (ht->pairs_cap == 0) ? HT_PAIRS_SIZE : ht->pairs_cap * 2;
+		if (new_cap / 8 > UINT32_MAX)
+			{ return -1; }
+		char* pairs;
+		if (ht->pairs == NULL)	{ pairs = (char*) alloc_pages(new_cap); }
+		else
 		{
-			cur->value = value;
-			return;
+			pairs = (char*) mremap(ht->pairs, ht->pairs_cap, new_cap, MREMAP_MAYMOVE);
+			if (pairs == MAP_FAILED)			{ pairs = NULL; }
+			else if (new_cap >= HT_HUGE_SIZE)	{ madvise(pairs, new_cap, MADV_HUGEPAGE); }
 		}
-		cur = cur->next;
+		if (pairs == NULL)
+			{ return -1; }
+		ht->pairs = pairs;
+		ht->pairs_cap = new_cap;
 	}
 
-	// If the key doesn't exist, create an instance of the pair
-	KeyValuePair* new_pair = (KeyValuePair*) malloc(sizeof(KeyValuePair));
-	if (new_pair == NULL)
+	KeyValuePair* pair = (KeyValuePair*) (ht->pairs + ht->pairs_len);
+	pair->value = value;
+	pair->len = (uint8_t) len;
+	memcpy(pair->key, key, len);
+	pair->key[len] = '\0';
+
+	long long ref = (long long) (ht->pairs_len / 8);
+	ht->pairs_len += size;
+	return ref;
+}
+
+
+
+// Function sets key to value, adding it if it is new
+// Returns the value key had before, -1 if it was not in the table
+long long set_item(HashTable* ht, const char* key, long long value)
+{
+	size_t len = key_len(key);
+	uint64_t hash = hash_function(key, len);
+
+	// If we find the exact key, replace it with a new value
+	KeyValuePair* pair = find_pair(ht, key, len, hash);
+	if (pair != NULL)
 	{
-		printf("Allocation for new_pair failed.\n");
-		return;
+		long long old = pair->value;
+		pair->value = value;
+		return old;
 	}
-	strncpy(new_pair->key, key, MAX_KEY_LEN - 1);
-	new_pair->key[MAX_KEY_LEN - 1] = '\0';
-	new_pair->value = value;
-	new_pair->next = NULL;
-
-	// Add the new KeyPairValue to HashTable at the front and set the links appropriately
-	new_pair->next = ht->table[index];
-	ht->table[index] = new_pair;
-	ht->size += 1;
 
-	// Resize the hashtable if the load factor exceeds 0.75
-	if ( ((float)ht->size / (float)ht->cap) > 0.75)
+	// Resize the hashtable if the load factor would exceed 7/8; it must keep an empty slot even if that fails
+	if (ht->size + 1 > ht->cap * HT_SLOTS / 8 * 7)
+		{ rehash(ht); }
+	long long ref = (ht->size + 1 < ht->cap * HT_SLOTS) ? store_pair(ht, key, len, value) : -1;
+	if (ref < 0)
 	{
-		rehash(ht);
+		if (!ht->quiet)	{ printf("Allocation for new_pair failed.\n"); }
+		return -1;
 	}
+
+	// Add the new pair in the first empty slot its probe reaches, and mark the slot with 7 bits of the hash
+	place_pair(ht->groups, ht->cap, hash, (uint32_t) ref);
+	ht->size += 1;
+	return -1;
 }
 
-int get_item(HashTable* ht, char* key)
+
+
+long long get_item(HashTable* ht, const char* key)
 {
-	int index = hash_function(key, ht->cap);
+	size_t len = key_len(key);
 
-	KeyValuePair* cur = ht->table[index];
-	while (cur != NULL)
-	{
-		// If we find a key in the HashTable, return the value
-		if ( strcmp(cur->key, key) == 0 ) {
-			return cur->value;
-		}
-		cur = cur->next;
-	}
+	// If we find a key in the HashTable, return the value
+	KeyValuePair* pair = find_pair(ht, key, len, hash_function(key, len));
+	if (pair != NULL)
+		{ return pair->value; }
 	return -1;	// Key not found
 }
 
-void free_ht(HashTable *ht)
+
+
+// Function calls visit on every pair in the table, in the order they were added, passing it arg
+void for_each_item(HashTable* ht, void (*visit)(KeyValuePair* pair, void* arg), void* arg)
 {
-	for (int i = 0; i < ht->cap; i++)
+	for (size_t at = 0; at < ht->pairs_len; )
 	{
-		KeyValuePair* cur = ht->table[i];
-		while (cur != NULL)
-		{
-			KeyValuePair* temp = cur;
-			cur = cur->next;
-			free(temp);
-		}
+		KeyValuePair* pair = (KeyValuePair*) (ht->pairs + at);
+		at += pair_size(pair->len);
+		visit(pair, arg);
 	}
-	free(ht->table);
+}
+
+
+
+void free_ht(HashTable *ht)
+{
+	if (ht->pairs != NULL)	{ munmap(ht->pairs, ht->pairs_cap); }
+	munmap(ht->groups, ht->cap * sizeof(HtGroup));
 	free(ht);
 }
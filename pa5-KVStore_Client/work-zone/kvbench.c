@@ -0,0 +1,471 @@
+// getopt, clock_gettime and pthread barriers are POSIX, hidden by -std=c99 otherwise
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Load generator for "make bench": kvbench [options] SOCKET first sets every key once over one connection,
+// then has -t threads keep -c connections busy with -n requests in all, each connection with -d of them sent
+// and not yet answered at any time. Keys are picked at random, gets and sets mixed as -g says. It prints one
+// tab separated line under a header: requests, seconds, requests per second, the 50th and 99th percentile of
+// the time from sending a request to reading its reply, and the replies that were errors
+//	-c CONNECTIONS	default 64
+//	-d DEPTH	requests in flight per connection, default 16
+//	-n REQUESTS	default 2000000
+//	-k KEYS		default 100000
+//	-g PERCENT	share of gets, default 90
+//	-v BYTES	length of every value set, default 32
+//	-t THREADS	default 2
+
+
+
+/* CONSTANTS */
+#define MAX_DEPTH 256
+#define MAX_REQUEST 1100	// "set " + 32 byte key + ' ' + 1024 byte value + '\n', with room to spare
+#define READ_BUF_SIZE 65536
+#define LATENCY_US 100000	// latencies are counted per microsecond up to this, longer ones all together
+#define PRELOAD_BATCH 1024	// sets sent before their replies are read while preloading
+
+
+
+/* STRUCTS */
+// The settings of a run, from the command line
+typedef struct {
+	const char* path;	// 1. the server's socket
+	int connections;	// 2. -c, -d, -n, -k, -g, -v and -t
+	int depth;
+	long long requests;
+	int keys;
+	int get_percent;
+	int value_len;
+	int threads;
+} Settings ;
+
+// A connection and the requests it has in flight, oldest first in a ring of their send times
+typedef struct {
+	int fd;			// 1. the socket
+	char* out;		// 2. requests not written yet
+	size_t out_len;
+	size_t out_sent;
+	double sent[MAX_DEPTH];	// 3. when each request in flight was sent, from head, count of them
+	int head;
+	int count;
+	int at_start;		// 4. the next byte read starts a reply
+	uint32_t events;	// 5. what epoll watches it for
+} BenchConn ;
+
+// One thread's share of the run and what it measured
+typedef struct {
+	Settings* settings;	// 1. the run's settings
+	int n_conns;		// 2. connections it keeps busy
+	long long quota;	// 3. requests it sends in all
+	uint64_t seed;		// 4. xorshift state for picking keys and gets or sets
+	long long errors;	// 5. replies that were errors, and latencies by microsecond
+	long long* latency;
+	long long sent;		// 6. requests sent so far
+	pthread_barrier_t* start;	// 7. passed once every thread's connections are made, when the clock starts
+	pthread_t thread;
+} BenchThread ;
+
+
+
+/* PROGRAM FUNCTIONS */
+// Function reads the monotonic clock
+// Returns the time in seconds
+double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+
+
+// Function steps a thread's random number sequence
+// Returns the next number
+uint64_t next_random(uint64_t* seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 7;
+	*seed ^= *seed << 17;
+	return *seed;
+}
+
+
+
+// Function connects to the server, its socket left blocking
+// Returns the socket, -1 on error (reported)
+int connect_server(const char* path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1 || connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0)
+	{
+		perror(path);
+		if (fd != -1)	{ close(fd); }
+		return -1;
+	}
+	return fd;
+}
+
+
+
+// Function writes a whole buffer to a blocking socket
+// Returns 0 on success, -1 on error
+int write_all(int fd, const char* data, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = write(fd, data, len);
+		if (n == -1 && errno == EINTR)
+			{ continue; }
+		if (n == -1)
+			{ return -1; }
+		data += n;
+		len -= (size_t) n;
+	}
+	return 0;
+}
+
+
+
+// Function reads from a blocking socket until count replies have come
+// Returns 0 on success, -1 if the server hung up or failed
+int read_replies(int fd, long long count)
+{
+	char buf[READ_BUF_SIZE];
+	while (count > 0)
+	{
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if (n == -1 && errno == EINTR)
+			{ continue; }
+		if (n <= 0)
+			{ return -1; }
+		for (char* p = buf; (p = memchr(p, '\n', (size_t) (buf + n - p))) != NULL; p++)
+			{ count--; }
+	}
+	return 0;
+}
+
+
+
+// Function writes a request into out: a set of value to a random key, or a get of one
+// Returns its length
+size_t make_request(BenchThread* bench, char* out, const char* value)
+{
+	Settings* settings = bench->settings;
+	int key = (int) (next_random(&bench->seed) % (uint64_t) settings->keys);
+	if ((int) (next_random(&bench->seed) % 100) < settings->get_percent)
+		{ return (size_t) sprintf(out, "get key%d\n", key); }
+	return (size_t) sprintf(out, "set key%d %s\n", key, value);
+}
+
+
+
+// Function sets every key once over one connection, so the gets of the run find values
+// Returns 0 on success, -1 on error (reported)
+int preload(Settings* settings, const char* value)
+{
+	int fd = connect_server(settings->path);
+	if (fd == -1)
+		{ return -1; }
+
+	char* batch = malloc(PRELOAD_BATCH * MAX_REQUEST);
+	int status = (batch == NULL) ? -1 : 0;
+	for (int key = 0; status == 0 && key < settings->keys; key += PRELOAD_BATCH)
+	{
+		size_t len = 0;
+		int count = 0;
+		for (; count < PRELOAD_BATCH && key + count < settings->keys; count++)
+			{ len += (size_t) sprintf(batch + len, "set key%d %s\n", key + count, value); }
+		if (write_all(fd, batch, len) != 0 || read_replies(fd, count) != 0)
+			{ status = -1; }
+	}
+	if (status != 0)
+		{ fprintf(stderr, "kvbench: preloading failed\n"); }
+	free(batch);
+	close(fd);
+	return status;
+}
+
+
+
+// Function queues requests on a connection, after what it has not written yet, until it has DEPTH in flight
+// or the thread has sent its quota
+void conn_fill(BenchThread* bench, BenchConn* conn, const char* value)
+{
+	if (conn->out_sent > 0)
+	{
+		memmove(conn->out, conn->out + conn->out_sent, conn->out_len - conn->out_sent);
+		conn->out_len -= conn->out_sent;
+		conn->out_sent = 0;
+	}
+	double now = now_seconds();
+	while (conn->count < bench->settings->depth && bench->sent < bench->quota)
+	{
+		conn->out_len += make_request(bench, conn->out + conn->out_len, value);
+		conn->sent[(conn->head + conn->count) % MAX_DEPTH] = now;
+		conn->count++;
+		bench->sent++;
+	}
+}
+
+
+
+// Function reads a connection's replies, timing each against the request it answers, and counts the errors
+// Returns the replies read, -1 if the server hung up or failed
+long long conn_replies(BenchThread* bench, BenchConn* conn, char* buf)
+{
+	ssize_t n = read(conn->fd, buf, READ_BUF_SIZE);
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		{ return 0; }
+	if (n <= 0)
+		{ return -1; }
+
+	double now = now_seconds();
+	long long replies = 0;
+	char* end = buf + n;
+	for (char* p = buf; p < end; )
+	{
+		if (conn->at_start && *p == 'e')
+			{ bench->errors++; }
+		char* newline = memchr(p, '\n', (size_t) (end - p));
+		if (newline == NULL)
+		{
+			conn->at_start = 0;
+			break;
+		}
+		long long us = (long long) ((now - conn->sent[conn->head]) * 1e6);
+		bench->latency[(us < LATENCY_US) ? us : LATENCY_US]++;
+		conn->head = (conn->head + 1) % MAX_DEPTH;
+		conn->count--;
+		conn->at_start = 1;
+		replies++;
+		p = newline + 1;
+	}
+	return replies;
+}
+
+
+
+// Function writes what a connection has queued and has epoll watch it for room to write the rest, if any
+// Returns 0 on success, -1 on error
+int conn_send(int epfd, BenchConn* conn)
+{
+	while (conn->out_sent < conn->out_len)
+	{
+		ssize_t n = write(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent);
+		if (n == -1 && errno == EINTR)
+			{ continue; }
+		if (n == -1 && errno != EAGAIN)
+			{ return -1; }
+		if (n == -1)
+			{ break; }
+		conn->out_sent += (size_t) n;
+	}
+	if (conn->out_sent == conn->out_len)
+		{ conn->out_len = conn->out_sent = 0; }
+
+	uint32_t events = EPOLLIN | ((conn->out_len > 0) ? EPOLLOUT : 0);
+	if (events != conn->events)
+	{
+		struct epoll_event ev = { .events = events, .data.ptr = conn };
+		if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev) != 0)
+			{ return -1; }
+		conn->events = events;
+	}
+	return 0;
+}
+
+
+
+// Function runs one thread's share of the run: once every connection is made and the run's clock starts, its
+// connections are kept DEPTH requests deep until it has sent its quota and read every reply
+void* bench_thread(void* arg)
+{
+	BenchThread* bench = arg;
+	Settings* settings = bench->settings;
+	char* value = malloc((size_t) settings->value_len + 1);
+	BenchConn* conns = calloc((size_t) bench->n_conns, sizeof(BenchConn));
+	char* buf = malloc(READ_BUF_SIZE);
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (value == NULL || conns == NULL || buf == NULL || bench->latency == NULL || epfd == -1)
+	{
+		perror("kvbench");
+		exit(EXIT_FAILURE);
+	}
+	memset(value, 'v', (size_t) settings->value_len);
+	value[settings->value_len] = '\0';
+
+	for (int i = 0; i < bench->n_conns; i++)
+	{
+		BenchConn* conn = &conns[i];
+		conn->at_start = 1;
+		conn->events = EPOLLIN;
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = conn };
+		if ((conn->fd = connect_server(settings->path)) == -1 || fcntl(conn->fd, F_SETFL, O_NONBLOCK) != 0
+		 || (conn->out = malloc((size_t) settings->depth * MAX_REQUEST)) == NULL || epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev) != 0)
+			{ exit(EXIT_FAILURE); }
+	}
+	pthread_barrier_wait(bench->start);
+
+	long long done = 0;
+	for (int i = 0; i < bench->n_conns; i++)
+	{
+		conn_fill(bench, &conns[i], value);
+		if (conn_send(epfd, &conns[i]) != 0)
+		{
+			perror("kvbench");
+			exit(EXIT_FAILURE);
+		}
+	}
+	struct epoll_event events[64];
+	while (done < bench->quota)
+	{
+		int n = epoll_wait(epfd, events, 64, -1);
+		for (int i = 0; i < n; i++)
+		{
+			BenchConn* conn = events[i].data.ptr;
+			long long replies = 0;
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				{ replies = conn_replies(bench, conn, buf); }
+			if (replies == -1)
+			{
+				fprintf(stderr, "kvbench: the server hung up\n");
+				exit(EXIT_FAILURE);
+			}
+			done += replies;
+			conn_fill(bench, conn, value);
+			if (conn_send(epfd, conn) != 0)
+			{
+				perror("kvbench");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	for (int i = 0; i < bench->n_conns; i++)
+	{
+		close(conns[i].fd);
+		free(conns[i].out);
+	}
+	close(epfd);
+	free(conns);
+	free(buf);
+	free(value);
+	return NULL;
+}
+
+
+
+// Function finds the latency a share p (0 to 1) of the replies came within
+// Returns it in microseconds
+long long percentile(long long* latency, long long count, double p)
+{
+	long long rank = (long long) (p * (double) count + 0.999999);
+	long long seen = 0;
+	for (long long us = 0; us < LATENCY_US; us++)
+	{
+		if ((seen += latency[us]) >= rank)	{ return us; }
+	}
+	return LATENCY_US;
+}
+
+
+
+int main(int argc, char* argv[])
+{
+	Settings settings = { NULL, 64, 16, 2000000, 100000, 90, 32, 2 };
+	int opt;
+	while ((opt = getopt(argc, argv, "c:d:n:k:g:v:t:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'c':	settings.connections = atoi(optarg);	break;
+			case 'd':	settings.depth = atoi(optarg);		break;
+			case 'n':	settings.requests = atoll(optarg);	break;
+			case 'k':	settings.keys = atoi(optarg);		break;
+			case 'g':	settings.get_percent = atoi(optarg);	break;
+			case 'v':	settings.value_len = atoi(optarg);	break;
+			case 't':	settings.threads = atoi(optarg);	break;
+			default:	optind = argc + 1;			break;
+		}
+	}
+	if (optind != argc - 1 || settings.connections < 1 || settings.depth < 1 || settings.depth > MAX_DEPTH
+	 || settings.requests < 1 || settings.keys < 1 || settings.get_percent < 0 || settings.get_percent > 100
+	 || settings.value_len < 1 || settings.value_len > 1024 || settings.threads < 1)
+	{
+		fprintf(stderr, "usage: ./kvbench [-c connections] [-d depth (1-%d)] [-n requests] [-k keys] [-g get_percent] "
+			"[-v value_bytes (1-1024)] [-t threads] <socket>\n", MAX_DEPTH);
+		exit(EXIT_FAILURE);
+	}
+	settings.path = argv[optind];
+	if (settings.threads > settings.connections)
+		{ settings.threads = settings.connections; }
+
+	char* value = malloc((size_t) settings.value_len + 1);
+	if (value == NULL)
+		{ exit(EXIT_FAILURE); }
+	memset(value, 'v', (size_t) settings.value_len);
+	value[settings.value_len] = '\0';
+	int status = preload(&settings, value);
+	free(value);
+	if (status != 0)
+		{ exit(EXIT_FAILURE); }
+
+	// Connections and requests are shared out evenly, the first threads taking what does not divide
+	BenchThread* benches = calloc((size_t) settings.threads, sizeof(BenchThread));
+	pthread_barrier_t start;
+	if (benches == NULL || pthread_barrier_init(&start, NULL, (unsigned) settings.threads + 1) != 0)
+		{ exit(EXIT_FAILURE); }
+	for (int i = 0; i < settings.threads; i++)
+	{
+		BenchThread* bench = &benches[i];
+		bench->settings = &settings;
+		bench->start = &start;
+		bench->n_conns = settings.connections / settings.threads + (i < settings.connections % settings.threads);
+		bench->quota = settings.requests / settings.threads + (i < settings.requests % settings.threads);
+		bench->seed = 0x9E3779B97F4A7C15ULL * (uint64_t) (i + 1);
+		bench->latency = calloc(LATENCY_US + 1, sizeof(long long));
+		if (pthread_create(&bench->thread, NULL, bench_thread, bench) != 0)
+		{
+			perror("kvbench");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pthread_barrier_wait(&start);
+	double began = now_seconds();
+	long long* latency = calloc(LATENCY_US + 1, sizeof(long long));
+	long long errors = 0;
+	for (int i = 0; i < settings.threads; i++)
+	{
+		pthread_join(benches[i].thread, NULL);
+		errors += benches[i].errors;
+		for (int us = 0; us <= LATENCY_US; us++)
+			{ latency[us] += benches[i].latency[us]; }
+		free(benches[i].latency);
+	}
+	double seconds = now_seconds() - began;
+
+	printf("requests\tseconds\trequests_per_s\tp50_us\tp99_us\terrors\n");
+	printf("%lld\t%.3f\t%.0f\t%lld\t%lld\t%lld\n", settings.requests, seconds, settings.requests / seconds,
+		percentile(latency, settings.requests, 0.5), percentile(latency, settings.requests, 0.99), errors);
+	pthread_barrier_destroy(&start);
+	free(latency);
+	free(benches);
+	return 0;
+}
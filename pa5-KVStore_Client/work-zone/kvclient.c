@@ -2,12 +2,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #define CMD_LEN 3
 #define KEY_LEN 32
 #define VAL_LEN 1024
 #define SPACE 1
 #define NULL_TERM 1
+#define NEWLINE 1
+#define REPLY_LEN 3		// "ok " before a value
 
 
 
@@ -23,7 +29,7 @@ int main(int argc, char* argv[])
 	char* control = argv[2];
 	char* client_key = argv[3];
 	char* client_value = NULL;
-	char client_request[CMD_LEN + SPACE + KEY_LEN + SPACE + VAL_LEN + NULL_TERM] = "";
+	char client_request[CMD_LEN + SPACE + KEY_LEN + SPACE + VAL_LEN + NEWLINE + NULL_TERM] = "";
 
 	if (strcmp(control, "get") == 0)
 	{
@@ -35,8 +41,8 @@ int main(int argc, char* argv[])
 			return 1;
 		}
 
-		// "get <key32>\0"
-		sprintf(client_request, "%s %s", control, client_key);
+		// "get <key32>\n\0"
+		snprintf(client_request, sizeof(client_request), "%s %s\n", control, client_key);
 	}
 	else if (strcmp(control, "set") == 0)
 	{
@@ -56,8 +62,15 @@ int main(int argc, char* argv[])
 			return 1;
 		}
 
-		// "set <key32> <value1024>\0"
-		sprintf(client_request, "%s %s %s", control, client_key, client_value);
+		// A value must fit on the one line of the request
+		if (strlen(client_value) > VAL_LEN || strchr(client_value, '\n') != NULL)
+		{
+			printf("Error, value longer than %d characters or with a newline\n", VAL_LEN);
+			return 1;
+		}
+
+		// "set <key32> <value1024>\n\0"
+		snprintf(client_request, sizeof(client_request), "%s %s %s\n", control, client_key, client_value);
 	}
 	else
 	{
@@ -65,9 +78,79 @@ int main(int argc, char* argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	// TESTING
-	printf("client_request: %s\n", client_request);
+	if (strlen(client_key) > KEY_LEN)
+	{
+		printf("Error, key longer than %d characters\n", KEY_LEN);
+		return 1;
+	}
+
+	// Connect to the server's UNIX domain socket
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(argv[1]) >= sizeof(addr.sun_path))
+	{
+		printf("Error, socket name too long: \"%s\"\n", argv[1]);
+		return 1;
+	}
+	strcpy(addr.sun_path, argv[1]);
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == -1 || connect(sock, (struct sockaddr*) &addr, sizeof(addr)) != 0)
+	{
+		printf("Error, cannot connect to \"%s\": %s\n", argv[1], strerror(errno));
+		if (sock != -1)	{ close(sock); }
+		return 1;
+	}
+
+	// Send the request, then read its one line of reply
+	size_t request_len = strlen(client_request);
+	size_t done = 0;
+	while (done < request_len)
+	{
+		ssize_t n = write(sock, client_request + done, request_len - done);
+		if (n == -1 && errno == EINTR)
+			{ continue; }
+		if (n == -1)
+		{
+			printf("Error, cannot send the request: %s\n", strerror(errno));
+			close(sock);
+			return 1;
+		}
+		done += (size_t) n;
+	}
+
+	char reply[REPLY_LEN + VAL_LEN + NEWLINE + NULL_TERM];
+	size_t reply_len = 0;
+	char* newline = NULL;
+	while (newline == NULL && reply_len < sizeof(reply) - NULL_TERM)
+	{
+		ssize_t n = read(sock, reply + reply_len, sizeof(reply) - NULL_TERM - reply_len);
+		if (n == -1 && errno == EINTR)
+			{ continue; }
+		if (n <= 0)
+			{ break; }
+		reply_len += (size_t) n;
+		reply[reply_len] = '\0';
+		newline = strchr(reply, '\n');
+	}
+	close(sock);
+	if (newline == NULL)
+	{
+		printf("Error, no reply from the server\n");
+		return 1;
+	}
+	*newline = '\0';
 
-	// TODO: SOCKETWORK LATER
+	// "ok <value>" or "missing" to a get, "ok" to a set, "error <why>" to a request the server could not handle
+	if (strncmp(reply, "ok ", REPLY_LEN) == 0)
+		{ printf("%s\n", reply + REPLY_LEN); }
+	else if (strcmp(reply, "missing") == 0)
+		{ printf("Key %s does not exist.\n", client_key); }
+	else if (strcmp(reply, "ok") != 0)
+	{
+		printf("Error, %s\n", (strncmp(reply, "error ", 6) == 0) ? reply + 6 : reply);
+		return 1;
+	}
+	return 0;
 }
 
@@ -0,0 +1,438 @@
+#include "kvstore.h"
+
+// The database as an append-only log: a set adds a "key,value" record at the end of the file, and the index
+// points at the value of each key's latest record. Records are only ever written in order, in one write(2)
+// per round of the event loop, and the records they replace stay in the file as stale ones. When the stale
+// ones are most of it (see COMPACT_RATIO), a compaction thread copies the live records of the file as it was
+// then into a new file, while the event loop goes on appending to the old one. The event loop then appends
+// what was set meanwhile, renames the new file over the old one, and points the index into it. A crash
+// before the rename leaves the old file as it was and a <database>.compact that the next start removes
+
+
+
+// Function maps the database for reading, twice as far as it reaches so it can grow a while before the next
+// time. Only the first size bytes are ever read, the rest of the mapping being past the end of the file
+// Returns 0 on success, -1 if it cannot be mapped (reads then go through pread(2))
+static int db_map(Database* db)
+{
+	if (db->map != NULL)
+		{ munmap(db->map, db->map_len); }
+	db->map_len = ((size_t) db->size * 2 > MIN_MAP_SIZE) ? (size_t) db->size * 2 : MIN_MAP_SIZE;
+	if ((db->map = mmap(NULL, db->map_len, PROT_READ, MAP_SHARED, db->fd, 0)) == MAP_FAILED)
+	{
+		db->map = NULL;
+		db->map_len = 0;
+		return -1;
+	}
+	return 0;
+}
+
+
+
+// Function reads the value at offset into value, which has room for MAX_VAL_LEN bytes. A record not flushed
+// yet is read from the buffer, the others from the mapped file; the values stay in the page cache, out of this
+// process's memory, as with read(2), but cost no system call
+// Returns the length of the value, -1 on error (errno tells why)
+static int db_read(Database* db, long long offset, char* value)
+{
+	ssize_t n;
+	if (offset >= db->size)
+	{
+		n = (ssize_t) (db->len - (size_t) (offset - db->size));
+		if (n > MAX_VAL_LEN)	{ n = MAX_VAL_LEN; }
+		memcpy(value, db->buf + (offset - db->size), (size_t) n);
+	}
+	else if ((size_t) db->size <= db->map_len || db_map(db) == 0)
+	{
+		n = (ssize_t) (db->size - offset);
+		if (n > MAX_VAL_LEN)	{ n = MAX_VAL_LEN; }
+		memcpy(value, db->map + offset, (size_t) n);
+	}
+	else if ((n = pread(db->fd, value, MAX_VAL_LEN, offset)) == -1)
+		{ return -1; }
+
+	char* newline = memchr(value, '\n', (size_t) n);
+	if (newline == NULL)
+	{
+		errno = EIO;
+		return -1;
+	}
+	return (int) (newline - value);
+}
+
+
+
+// Function adds the length of a key's latest record to the live bytes, when the index has been rebuilt
+static void count_live(KeyValuePair* pair, void* arg)
+{
+	Database* db = arg;
+	char value[MAX_VAL_LEN];
+	int value_len = db_read(db, pair->value, value);
+	if (value_len >= 0)
+		{ db->live += (long long) (strlen(pair->key) + 1 + (size_t) value_len + 1); }
+}
+
+
+
+// Function opens the database, rebuilding its index from the records database_fp reads: "key,value" lines,
+// the last one for a key holding its value. A last line with no newline, as a file written by hand may end, is
+// read like the others and given one, so records appended after it start on a line of their own. A
+// compaction a crash cut short is thrown away
+// Returns 0 on success, -1 on error (reported)
+int db_open(Database* db, FILE* database_fp, const char* database)
+{
+	memset(db, 0, sizeof(Database));
+	db->path = database;
+	db->fd = open(database, O_RDWR | O_APPEND | O_CLOEXEC);
+	db->buf = malloc(LOG_BUF_SIZE);
+	db->index = create_hash_table();
+	db->compaction.fd = db->compaction.source_fd = -1;
+	db->compaction.path = malloc(strlen(database) + sizeof(COMPACT_SUFFIX));
+	db->compaction.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (db->fd == -1 || db->buf == NULL || db->index == NULL || db->compaction.path == NULL || db->compaction.event_fd == -1)
+	{
+		perror(database);
+		db_close(db);
+		return -1;
+	}
+	sprintf(db->compaction.path, "%s%s", database, COMPACT_SUFFIX);
+	unlink(db->compaction.path);
+
+	char* line = NULL;
+	size_t line_cap = 0;
+	ssize_t line_len;
+	int unterminated = 0;
+	while ((line_len = getline(&line, &line_cap, database_fp)) > 0)
+	{
+		unterminated = (line[line_len - 1] != '\n');
+		char* comma = memchr(line, ',', (size_t) line_len);
+		if (comma != NULL && comma - line < MAX_KEY_LEN)
+		{
+			*comma = '\0';
+			set_item(db->index, line, (long long) db->size + (comma - line) + 1);
+		}
+		db->size += line_len;
+	}
+	free(line);
+
+	if (ferror(database_fp) || (unterminated && write(db->fd, "\n", 1) != 1))
+	{
+		perror(database);
+		db_close(db);
+		return -1;
+	}
+	if (unterminated)
+	{
+		fprintf(stderr, "%s: the last line had no newline, one was added\n", database);
+		db->size += 1;
+	}
+	db_map(db);
+	for_each_item(db->index, count_live, db);
+	return 0;
+}
+
+
+
+// Function writes len bytes to a file, all of them
+// Returns 0 on success, -1 on error (errno tells why)
+static int write_all(int fd, const char* data, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = write(fd, data, len);
+		if (n == -1 && errno == EINTR)
+			{ continue; }
+		if (n == -1)
+			{ return -1; }
+		data += n;
+		len -= (size_t) n;
+	}
+	return 0;
+}
+
+
+
+// Function writes the records set since the last flush to the database file
+// Returns 0 on success, -1 if the write failed
+int db_flush(Database* db)
+{
+	if (write_all(db->fd, db->buf, db->len) != 0)
+		{ return -1; }
+	db->size += (off_t) db->len;
+	db->len = 0;
+	return 0;
+}
+
+
+
+// Function reads the value of key from the database into value, which has room for MAX_VAL_LEN bytes
+// Returns the length of the value, -1 if there is no such key, -2 on error (errno tells why)
+int db_get(Database* db, char* key, char* value)
+{
+	long long offset = get_item(db->index, key);
+	if (offset < 0)
+		{ return -1; }
+	int value_len = db_read(db, offset, value);
+	return (value_len < 0) ? -2 : value_len;
+}
+
+
+
+// Function sets key to value: a record is added to the buffer, written out with the others of this round. The
+// record it replaces, if any, is counted stale
+// Returns 0 on success, -1 if the buffer could not be written out to make room (errno tells why)
+int db_set(Database* db, char* key, const char* value, size_t value_len)
+{
+	size_t key_len = strlen(key);
+	size_t record_len = key_len + 1 + value_len + 1;
+	if (db->len + record_len > LOG_BUF_SIZE && db_flush(db) != 0)
+		{ return -1; }
+
+	char* record = db->buf + db->len;
+	memcpy(record, key, key_len);
+	record[key_len] = ',';
+	memcpy(record + key_len + 1, value, value_len);
+	record[key_len + 1 + value_len] = '\n';
+	long long old = set_item(db->index, key, (long long) db->size + (long long) (db->len + key_len + 1));
+	db->len += record_len;
+
+	db->live += (long long) record_len;
+	char old_value[MAX_VAL_LEN];
+	int old_len;
+	if (old >= 0 && (old_len = db_read(db, old, old_value)) >= 0)
+		{ db->live -= (long long) (key_len + 1 + (size_t) old_len + 1); }
+	return 0;
+}
+
+
+
+// Function tells whether a compaction thread has been asked to stop
+// Returns 1 if so, 0 otherwise
+static int compact_cancelled(Compaction* compaction)
+{
+	return __atomic_load_n(&compaction->cancel, __ATOMIC_RELAXED);
+}
+
+
+
+// Function finds the key of the record that starts at line, with avail bytes after it, and copies it into key,
+// which is left empty if the line is no record
+// Returns the length of the line, its newline included
+static size_t record_key(const char* line, size_t avail, char* key)
+{
+	const char* newline = memchr(line, '\n', avail);
+	size_t line_len = (newline != NULL) ? (size_t) (newline - line) + 1 : avail;
+	const char* comma = memchr(line, ',', line_len);
+	key[0] = '\0';
+	if (comma != NULL && comma - line < MAX_KEY_LEN)
+	{
+		memcpy(key, line, (size_t) (comma - line));
+		key[comma - line] = '\0';
+	}
+	return line_len;
+}
+
+
+
+// Function does a compaction, in its own thread. It maps the database as far as the snapshot, finds the latest
+// record of each key there, then writes those records, in file order, to the new file, noting where each value
+// went. It reads nothing the event loop writes, and the event loop reads nothing of it until it is done. Its
+// table starts with room for every key the index had, so it does not rehash, and it prints nothing
+static void* compact_thread(void* arg)
+{
+	Compaction* compaction = arg;
+	size_t snapshot = (size_t) compaction->snapshot;
+	HashTable* latest = create_hash_table_sized(compaction->keys);
+	if (latest != NULL)	{ latest->quiet = 1; }
+	char* out = malloc(COMPACT_BUF_SIZE);
+	char* map = mmap(NULL, snapshot, PROT_READ, MAP_SHARED, compaction->source_fd, 0);
+	if (map == MAP_FAILED)				{ compaction->error = errno; }
+	else if (latest == NULL || out == NULL)	{ compaction->error = ENOMEM; }
+
+	// First pass: each key's latest record is the last one to set it
+	char key[MAX_KEY_LEN];
+	size_t start = 0;
+	while (compaction->error == 0 && start < snapshot)
+	{
+		// A key that could not be added would have its record dropped, so that ends the compaction
+		size_t line_len = record_key(map + start, snapshot - start, key);
+		size_t keys = latest->size;
+		if (key[0] != '\0' && set_item(latest, key, (long long) start) == -1 && latest->size == keys)
+			{ compaction->error = ENOMEM; }
+		start += line_len;
+		if (compact_cancelled(compaction))
+			{ compaction->error = ECANCELED; }
+	}
+
+	// Second pass: the latest records are copied. A copied key's entry then holds where its value went in the
+	// new file; no later record of the key is left to match it
+	size_t out_len = 0;
+	start = 0;
+	while (compaction->error == 0 && start < snapshot)
+	{
+		size_t line_len = record_key(map + start, snapshot - start, key);
+		if (key[0] != '\0' && get_item(latest, key) == (long long) start)
+		{
+			if (out_len + line_len > COMPACT_BUF_SIZE)
+			{
+				if (write_all(compaction->fd, out, out_len) != 0)
+					{ compaction->error = errno; }
+				compaction->size += (off_t) out_len;
+				out_len = 0;
+			}
+			set_item(latest, key, (long long) compaction->size + (long long) (out_len + strlen(key) + 1));
+			memcpy(out + out_len, map + start, line_len);
+			out_len += line_len;
+		}
+		start += line_len;
+		if (compact_cancelled(compaction))
+			{ compaction->error = ECANCELED; }
+	}
+	if (compaction->error == 0 && (write_all(compaction->fd, out, out_len) != 0 || fsync(compaction->fd) != 0))
+		{ compaction->error = errno; }
+	compaction->size += (off_t) out_len;
+
+	if (map != MAP_FAILED)	{ munmap(map, snapshot); }
+	free(out);
+	compaction->moved = latest;
+
+	// Wake the event loop, which swaps the new file in
+	uint64_t done = 1;
+	if (write(compaction->event_fd, &done, sizeof(done)) != sizeof(done))
+		{ perror("compaction"); }
+	return NULL;
+}
+
+
+
+// Function frees what a compaction that will not be swapped in holds, and removes its file
+static void compact_discard(Compaction* compaction)
+{
+	if (compaction->source_fd != -1)	{ close(compaction->source_fd); }
+	if (compaction->fd != -1)		{ close(compaction->fd); }
+	if (compaction->moved != NULL)		{ free_ht(compaction->moved); }
+	compaction->source_fd = compaction->fd = -1;
+	compaction->moved = NULL;
+	unlink(compaction->path);
+}
+
+
+
+// Function starts a compaction once stale records are over COMPACT_RATIO of the database and COMPACT_MIN_BYTES,
+// unless one is under way or the last one failed and the database has not doubled since. The snapshot is what
+// has been written to the file so far; what is still in the buffer is after it
+void db_compact(Database* db)
+{
+	Compaction* compaction = &db->compaction;
+	long long total = (long long) db->size + (long long) db->len;
+	long long stale = total - db->live;
+	if (compaction->running || stale < COMPACT_MIN_BYTES || stale < COMPACT_RATIO * total || total < compaction->retry_size)
+		{ return; }
+
+	// The new file gets the old one's permissions; it is written without O_APPEND, which copy_file_range refuses
+	struct stat st;
+	compaction->snapshot = db->size;
+	compaction->keys = db->index->size;
+	compaction->size = 0;
+	compaction->error = 0;
+	compaction->cancel = 0;
+	compaction->moved = NULL;
+	compaction->source_fd = open(db->path, O_RDONLY | O_CLOEXEC);
+	compaction->fd = open(compaction->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (compaction->source_fd == -1 || compaction->fd == -1 || fstat(db->fd, &st) != 0
+	 || fchmod(compaction->fd, st.st_mode & 07777) != 0 || (errno = pthread_create(&compaction->thread, NULL, compact_thread, compaction)) != 0)
+	{
+		perror(compaction->path);
+		compact_discard(compaction);
+		compaction->retry_size = total * 2;
+		return;
+	}
+	compaction->running = 1;
+}
+
+
+
+// Function points an index entry into the compacted file: a value from before the snapshot to where the thread
+// copied it, a later one to where it lands after the copied records
+static void remap_value(KeyValuePair* pair, void* arg)
+{
+	Compaction* compaction = arg;
+	if (pair->value < (long long) compaction->snapshot)	{ pair->value = get_item(compaction->moved, pair->key); }
+	else							{ pair->value += (long long) (compaction->size - compaction->snapshot); }
+}
+
+
+
+// Function swaps in the file of a compaction whose thread is done, called when its event_fd is readable. The
+// records set since the snapshot are copied after the live ones, the new file is renamed over the database,
+// and the index is pointed into it. If anything fails the database stays as it was
+void db_compact_finish(Database* db)
+{
+	Compaction* compaction = &db->compaction;
+	uint64_t done;
+	if (read(compaction->event_fd, &done, sizeof(done)) != sizeof(done) || !compaction->running)
+		{ return; }
+	pthread_join(compaction->thread, NULL);
+	compaction->running = 0;
+
+	int error = compaction->error;
+	if (error == 0 && db->len > 0 && db_flush(db) != 0)
+		{ error = errno; }
+	loff_t from = compaction->snapshot;
+	while (error == 0 && from < db->size)
+	{
+		ssize_t n = copy_file_range(db->fd, &from, compaction->fd, NULL, (size_t) (db->size - from), 0);
+		if (n <= 0)	{ error = (n == 0) ? EIO : errno; }
+	}
+	if (error == 0 && (fdatasync(compaction->fd) != 0 || fcntl(compaction->fd, F_SETFL, O_APPEND) != 0
+	 || rename(compaction->path, db->path) != 0))
+		{ error = errno; }
+	if (error != 0)
+	{
+		fprintf(stderr, "%s: compaction failed: %s\n", db->path, strerror(error));
+		compact_discard(compaction);
+		compaction->retry_size = 2 * (long long) db->size;
+		return;
+	}
+
+	long long old_size = (long long) db->size;
+	for_each_item(db->index, remap_value, compaction);
+	close(db->fd);
+	db->fd = compaction->fd;
+	db->size = compaction->size + (db->size - compaction->snapshot);
+	db_map(db);
+	compaction->fd = -1;
+	compaction->retry_size = 0;
+	compact_discard(compaction);
+	printf("Compacted %s from %lld to %lld bytes\n", db->path, old_size, (long long) db->size);
+}
+
+
+
+// Function stops a compaction under way, writes out what is left in the buffer and frees the database
+void db_close(Database* db)
+{
+	Compaction* compaction = &db->compaction;
+	if (compaction->running)
+	{
+		__atomic_store_n(&compaction->cancel, 1, __ATOMIC_RELAXED);
+		pthread_join(compaction->thread, NULL);
+		compaction->running = 0;
+		compact_discard(compaction);
+	}
+	if (compaction->event_fd != -1)	{ close(compaction->event_fd); }
+	free(compaction->path);
+
+	if (db->fd != -1 && db->len > 0 && db_flush(db) != 0)
+		{ perror(db->path); }
+	if (db->map != NULL)		{ munmap(db->map, db->map_len); }
+	if (db->fd != -1)		{ close(db->fd); }
+	if (db->index != NULL)	{ free_ht(db->index); }
+	free(db->buf);
+	db->fd = -1;
+	db->index = NULL;
+	db->buf = NULL;
+	db->map = NULL;
+	compaction->path = NULL;
+	compaction->event_fd = -1;
+}
@@ -1,5 +1,14 @@
-#include <stdio.h>
-#include <stdlib.h>
+#include "kvstore.h"
+
+// kvstore: a key-value server on a UNIX domain socket. One process, one thread: every client connection is
+// non-blocking and watched by one epoll loop, so thousands of clients cost a buffer each and no more. Requests
+// are lines, "get <key>" or "set <key> <value>", and a client may send many before reading any reply; each
+// gets one reply line, in order (see REPLY_OK). The loop runs in rounds: the requests every ready connection
+// sent are handled, the sets among them are written to the database in one write(2), and only then do the
+// replies go out, so no set is acknowledged before it is in the file. SIGQUIT stops the server between rounds.
+// The database is a log (see kvlog.c), compacted by a thread of its own that the loop hears from when it is done
+
+
 
 int main(int argc, char* argv[])
 {
@@ -19,6 +28,446 @@ int main(int argc, char* argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	// TODO: NEED PART 2 OF REQUIREMENT 1, CREATING THE UNIX DOMAIN SOCKET
-	//	-THEN KVCLIENT PARSING FOR THE SOCKET IF IT EXISTS
+	// Rebuild the index from the records already in the database
+	Server server;
+	int status = db_open(&server.db, database_fp, database);
+	fclose(database_fp);
+	if (status != 0)
+		{ exit(EXIT_FAILURE); }
+
+	// Create the UNIX domain socket and serve until SIGQUIT
+	if (server_open(&server, argv[2]) != 0)
+	{
+		db_close(&server.db);
+		exit(EXIT_FAILURE);
+	}
+	server_run(&server);
+	server_close(&server);
+	db_close(&server.db);
+	return 0;
+}
+
+
+
+// Function creates the server's socket at path, replacing one left by a server that is no longer running, and
+// sets up the event loop. SIGQUIT is taken through a signalfd so it ends the loop between rounds, and SIGPIPE
+// is ignored, a write to a client that has gone failing with EPIPE instead
+// Returns 0 on success, -1 on error (reported)
+int server_open(Server* server, const char* path)
+{
+	server->path = NULL;
+	server->listen_fd = server->signal_fd = server->epoll_fd = -1;
+	server->conns = NULL;
+	server->conns_cap = 0;
+	server->queue = NULL;
+	server->running = 1;
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "Socket path \"%s\" is too long.\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	// A socket file nobody answers on was left behind; one that answers belongs to a server still running
+	struct stat st;
+	if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+	{
+		int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (probe != -1 && connect(probe, (struct sockaddr*) &addr, sizeof(addr)) == 0)
+		{
+			fprintf(stderr, "Socket \"%s\" is in use by another server.\n", path);
+			close(probe);
+			return -1;
+		}
+		if (probe != -1)	{ close(probe); }
+		unlink(path);
+	}
+
+	// Thousands of clients need thousands of descriptors, as many as the hard limit allows
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGQUIT);
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &action, NULL);
+
+	struct epoll_event ev = { .events = EPOLLIN };
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) != 0
+	 || (server->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1
+	 || (server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1
+	 || bind(server->listen_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0
+	 || (server->path = path, listen(server->listen_fd, SOMAXCONN)) != 0
+	 || (server->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1
+	 || (ev.data.fd = server->listen_fd, epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &ev)) != 0
+	 || (ev.data.fd = server->signal_fd, epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->signal_fd, &ev)) != 0
+	 || (ev.data.fd = server->db.compaction.event_fd, epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev)) != 0)
+	{
+		perror(path);
+		server_close(server);
+		return -1;
+	}
+	return 0;
+}
+
+
+
+// Function adds a connection to the list of those written to at the end of the round
+static void conn_queue(Server* server, Conn* conn)
+{
+	if (conn->queued)
+		{ return; }
+	conn->queued = 1;
+	conn->next = server->queue;
+	server->queue = conn;
+}
+
+
+
+// Function makes room for len more bytes of replies
+// Returns where they go, NULL if there is no memory for them
+static char* conn_reserve(Conn* conn, size_t len)
+{
+	if (conn->out_len + len > conn->out_cap)
+	{
+		size_t cap = (conn->out_cap > 0) ? conn->out_cap : 4096;
+		while (cap < conn->out_len + len)
+			{ cap *= 2; }
+		char* out = realloc(conn->out, cap);
+		if (out == NULL)
+			{ return NULL; }
+		conn->out = out;
+		conn->out_cap = cap;
+	}
+	return conn->out + conn->out_len;
+}
+
+
+
+// Function adds a reply line to a connection: word, then text if there is any
+static void conn_reply(Conn* conn, const char* word, const char* text)
+{
+	size_t word_len = strlen(word);
+	size_t text_len = (text != NULL) ? strlen(text) : 0;
+	char* out = conn_reserve(conn, word_len + 1 + text_len + 1);
+	if (out == NULL)
+	{
+		conn->closing = 1;
+		return;
+	}
+	memcpy(out, word, word_len);
+	out += word_len;
+	if (text != NULL)
+	{
+		*out++ = ' ';
+		memcpy(out, text, text_len);
+		out += text_len;
+	}
+	*out++ = '\n';
+	conn->out_len = (size_t) (out - conn->out);
+}
+
+
+
+// Function tells whether a key follows the rules of C variable names and is no longer than MAX_KEY_LEN - 1
+// Returns 1 if so, 0 otherwise
+static int valid_key(const char* key, size_t len)
+{
+	if (len == 0 || len >= MAX_KEY_LEN || isdigit((unsigned char) key[0]))
+		{ return 0; }
+	for (size_t i = 0; i < len; i++)
+	{
+		if (!isalnum((unsigned char) key[i]) && key[i] != '_')	{ return 0; }
+	}
+	return 1;
+}
+
+
+
+// Function handles one request line (its newline replaced by a '\0') and adds its reply. A get's value is read
+// straight into the reply
+static void handle_request(Server* server, Conn* conn, char* line, size_t len)
+{
+	if (len > 0 && line[len - 1] == '\r')
+		{ line[--len] = '\0'; }
+
+	if (len < 5 || line[3] != ' ')
+	{
+		conn_reply(conn, REPLY_ERROR, "bad request");
+		return;
+	}
+	char* key = line + 4;
+	char* end = memchr(key, ' ', len - 4);
+	size_t key_len = (end != NULL) ? (size_t) (end - key) : len - 4;
+	if (!valid_key(key, key_len))
+	{
+		conn_reply(conn, REPLY_ERROR, "bad key");
+		return;
+	}
+	key[key_len] = '\0';
+
+	if (memcmp(line, "get", 3) == 0 && end == NULL)
+	{
+		char* out = conn_reserve(conn, sizeof(REPLY_OK) + MAX_VAL_LEN);
+		if (out == NULL)
+		{
+			conn->closing = 1;
+			return;
+		}
+		int value_len = db_get(&server->db, key, out + sizeof(REPLY_OK));
+		if (value_len == -1)		{ conn_reply(conn, REPLY_MISSING, NULL); }
+		else if (value_len < 0)	{ conn_reply(conn, REPLY_ERROR, strerror(errno)); }
+		else
+		{
+			memcpy(out, REPLY_OK " ", sizeof(REPLY_OK));
+			out[sizeof(REPLY_OK) + value_len] = '\n';
+			conn->out_len += sizeof(REPLY_OK) + (size_t) value_len + 1;
+		}
+	}
+	else if (memcmp(line, "set", 3) == 0 && end != NULL)
+	{
+		const char* value = end + 1;
+		size_t value_len = len - (size_t) (value - line);
+		if (value_len == 0 || value_len >= MAX_VAL_LEN)
+			{ conn_reply(conn, REPLY_ERROR, "bad value"); }
+		else if (db_set(&server->db, key, value, value_len) != 0)
+		{
+			// The database can no longer be written: stop before anything else is acknowledged
+			perror("database");
+			server->running = 0;
+		}
+		else
+			{ conn_reply(conn, REPLY_OK, NULL); }
+	}
+	else
+		{ conn_reply(conn, REPLY_ERROR, "bad request"); }
+}
+
+
+
+// Function handles every whole request a connection has sent, unless its unwritten replies pass OUT_HIGH, and
+// keeps the start of one cut off by the end of the read. A full buffer with no newline holds no request
+static void conn_handle(Server* server, Conn* conn)
+{
+	size_t start = 0;
+	char* newline;
+	while (!conn->closing && conn->out_len - conn->out_sent < OUT_HIGH
+	 && (newline = memchr(conn->in + start, '\n', conn->in_len - start)) != NULL)
+	{
+		*newline = '\0';
+		handle_request(server, conn, conn->in + start, (size_t) (newline - (conn->in + start)));
+		start = (size_t) (newline - conn->in) + 1;
+	}
+	memmove(conn->in, conn->in + start, conn->in_len - start);
+	conn->in_len -= start;
+
+	if (conn->in_len == IN_BUF_SIZE && memchr(conn->in, '\n', conn->in_len) == NULL)
+	{
+		conn_reply(conn, REPLY_ERROR, "request too long");
+		conn->closing = 1;
+	}
+}
+
+
+
+// Function reads what a client sent and handles the requests it completes. A client that hangs up is closed once
+// its replies are out
+static void conn_read(Server* server, Conn* conn)
+{
+	ssize_t n = read(conn->fd, conn->in + conn->in_len, IN_BUF_SIZE - conn->in_len);
+	if (n > 0)
+	{
+		conn->in_len += (size_t) n;
+		conn_handle(server, conn);
+	}
+	else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+		{ conn->closing = 1; }
+	conn_queue(server, conn);
+}
+
+
+
+// Function closes a connection and frees it
+static void conn_close(Server* server, Conn* conn)
+{
+	server->conns[conn->fd] = NULL;
+	close(conn->fd);
+	free(conn->out);
+	free(conn);
+}
+
+
+
+// Function writes a connection's replies, after the records of the sets they acknowledge, and has epoll watch it
+// for what it waits on next: more requests, unless too many replies are unwritten, and room to write the rest
+static void conn_write(Server* server, Conn* conn)
+{
+	if (server->db.len > 0 && db_flush(&server->db) != 0)
+	{
+		perror("database");
+		server->running = 0;
+		return;
+	}
+
+	while (conn->out_sent < conn->out_len)
+	{
+		ssize_t n = write(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent);
+		if (n == -1)
+		{
+			if (errno == EINTR)	{ continue; }
+			if (errno != EAGAIN)
+			{
+				conn_close(server, conn);
+				return;
+			}
+			break;
+		}
+		conn->out_sent += (size_t) n;
+	}
+	if (conn->out_sent == conn->out_len)
+	{
+		conn->out_len = conn->out_sent = 0;
+		if (conn->out_cap > OUT_KEEP)
+		{
+			free(conn->out);
+			conn->out = NULL;
+			conn->out_cap = 0;
+		}
+		if (conn->closing)
+		{
+			conn_close(server, conn);
+			return;
+		}
+	}
+
+	// Requests left waiting on a slow client are handled once its replies drain; theirs go out next round
+	int stalled = (conn->out_len - conn->out_sent >= OUT_HIGH);
+	if (!stalled && !conn->closing && conn->in_len > 0 && memchr(conn->in, '\n', conn->in_len) != NULL)
+	{
+		conn_handle(server, conn);
+		stalled = (conn->out_len - conn->out_sent >= OUT_HIGH);
+	}
+
+	uint32_t events = ((stalled || conn->closing) ? 0 : EPOLLIN) | ((conn->out_sent < conn->out_len) ? EPOLLOUT : 0);
+	if (events != conn->events)
+	{
+		struct epoll_event ev = { .events = events, .data.fd = conn->fd };
+		epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+		conn->events = events;
+	}
+}
+
+
+
+// Function accepts every client waiting to connect
+static void accept_all(Server* server)
+{
+	int fd;
+	while ((fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+	{
+		if (fd >= server->conns_cap)
+		{
+			int cap = (server->conns_cap > 0) ? server->conns_cap : 64;
+			while (cap <= fd)
+				{ cap *= 2; }
+			Conn** conns = realloc(server->conns, (size_t) cap * sizeof(Conn*));
+			if (conns == NULL)
+			{
+				close(fd);
+				continue;
+			}
+			memset(conns + server->conns_cap, 0, (size_t) (cap - server->conns_cap) * sizeof(Conn*));
+			server->conns = conns;
+			server->conns_cap = cap;
+		}
+
+		Conn* conn = calloc(1, sizeof(Conn));
+		struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+		if (conn == NULL || epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+		{
+			free(conn);
+			close(fd);
+			continue;
+		}
+		conn->fd = fd;
+		conn->events = EPOLLIN;
+		server->conns[fd] = conn;
+	}
+	if (errno == EMFILE || errno == ENFILE)
+		{ fprintf(stderr, "kvstore: out of descriptors, new clients wait\n"); }
+}
+
+
+
+// Function runs the event loop until SIGQUIT. Each round handles what every ready connection sent, then
+// writes the replies, the database first, and starts a compaction if the database has come to need one
+void server_run(Server* server)
+{
+	struct epoll_event events[MAX_EVENTS];
+	while (server->running)
+	{
+		int n = epoll_wait(server->epoll_fd, events, MAX_EVENTS, -1);
+		if (n == -1)
+		{
+			if (errno == EINTR)	{ continue; }
+			perror("epoll_wait");
+			break;
+		}
+
+		for (int i = 0; i < n; i++)
+		{
+			int fd = events[i].data.fd;
+			if (fd == server->listen_fd)
+				{ accept_all(server); }
+			else if (fd == server->signal_fd)
+			{
+				struct signalfd_siginfo info;
+				while (read(server->signal_fd, &info, sizeof(info)) == sizeof(info))
+					{ server->running = 0; }
+			}
+			else if (fd == server->db.compaction.event_fd)
+				{ db_compact_finish(&server->db); }
+			else if (events[i].events & EPOLLOUT && !(events[i].events & EPOLLIN))
+				{ conn_queue(server, server->conns[fd]); }
+			else
+				{ conn_read(server, server->conns[fd]); }
+		}
+
+		while (server->queue != NULL)
+		{
+			Conn* conn = server->queue;
+			server->queue = conn->next;
+			conn->queued = 0;
+			if (server->running)	{ conn_write(server, conn); }
+		}
+		db_compact(&server->db);
+	}
+}
+
+
+
+// Function closes every connection and the socket, and removes the socket file if it was made
+void server_close(Server* server)
+{
+	for (int fd = 0; fd < server->conns_cap; fd++)
+	{
+		if (server->conns[fd] != NULL)	{ conn_close(server, server->conns[fd]); }
+	}
+	free(server->conns);
+	server->conns = NULL;
+	if (server->listen_fd != -1)	{ close(server->listen_fd); }
+	if (server->path != NULL)	{ unlink(server->path); }
+	if (server->signal_fd != -1)	{ close(server->signal_fd); }
+	if (server->epoll_fd != -1)	{ close(server->epoll_fd); }
 }
@@ -0,0 +1,190 @@
+// getline, accept4, signalfd, eventfd and sigaction are POSIX or Linux's, hidden by -std=c99 otherwise
+#define _GNU_SOURCE
+
+/* IMPORTS */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>		// the index compares 16 control bytes at a time with SSE2, one by one without it
+#endif
+
+/* CONSTANTS */
+#define MAX_KEY_LEN 33		// 32 chars + 1 null term
+#define MAX_VAL_LEN 1025	// 1024 chars + 1 null term
+#define DEFAULT_HT_CAP 1	// groups of slots; always a power of two
+#define HT_GROUP 16		// control bytes in a group, compared at once
+#define HT_SLOTS 12		// slots in a group, the first HT_SLOTS control bytes; a group fills a 64-byte cache line
+#define HT_EMPTY 0x00		// control byte of an empty slot, so fresh zeroed pages are an empty table
+#define HT_FULL 0x80		// set in the control byte of a full slot, with 7 bits of its key's hash below it
+#define HT_PAIRS_SIZE 4096	// bytes the pair storage starts with; it doubles from there
+#define HT_HUGE_SIZE (2 << 20)	// groups or pair storage this big are backed with huge pages if the kernel can
+
+#define IN_BUF_SIZE 4096	// bytes of requests read at a time, per connection; one request must fit
+#define OUT_HIGH (256 << 10)	// replies waiting for a slow client above which its requests are left unread
+#define OUT_KEEP (64 << 10)	// a reply buffer grown past this is freed once it is written out
+#define LOG_BUF_SIZE (1 << 20)	// bytes of new records gathered before each write(2) to the database
+#define MIN_MAP_SIZE (1 << 20)	// the database is mapped for reading at least this far, and twice its size
+
+// Compaction: once stale records (those a later set of their key replaced) are more than COMPACT_RATIO of the
+// database and at least COMPACT_MIN_BYTES, a thread rewrites the live ones into <database>.compact
+#define COMPACT_SUFFIX ".compact"
+#define COMPACT_RATIO 0.5
+#define COMPACT_MIN_BYTES (4 << 20)
+#define COMPACT_BUF_SIZE (1 << 20)	// bytes of the new file gathered before each write(2)
+#define MAX_EVENTS 256		// epoll events handled per wakeup
+
+// Replies, one line per request: "ok <value>" or "missing" to a get, "ok" to a set, "error <why>" otherwise
+#define REPLY_OK "ok"
+#define REPLY_MISSING "missing"
+#define REPLY_ERROR "error"
+
+
+
+/* STRUCTS */
+// A KeyValuePair struct holds 3 pieces of information, packed one after another in the table's pair storage:
+typedef struct KeyValuePair {
+	long long value;	// 1. a byte offset representing the position of the value in the database
+	uint8_t len;		// 2. the length of the key
+	char key[];		// 3. a string representing the key, taking only as many bytes as it needs
+} KeyValuePair;
+
+// A group of slots, one cache line. Each slot has a control byte, HT_EMPTY or HT_FULL and 7 bits of its key's
+// hash, so a lookup compares all of a group's to the key's at once and reads only the pairs whose bits match
+typedef struct {
+	uint8_t ctrl[HT_GROUP];		// 1. a control byte per slot; the last HT_GROUP - HT_SLOTS are always empty
+	uint32_t pairs[HT_SLOTS];	// 2. where each slot's pair is in the pair storage, in units of 8 bytes
+} HtGroup;
+
+// A HashTable struct will hold its pairs by open addressing, in groups of slots that point into one array
+// where the pairs are packed in the order they were added
+typedef struct HashTable {
+	HtGroup* groups;	// 1. the groups, cap of them
+	size_t cap;
+	size_t size;		// 2. pairs in the table
+	char* pairs;		// 3. the pair storage, pairs_len bytes of it used, 8-byte aligned, out of pairs_cap mapped
+	size_t pairs_len;
+	size_t pairs_cap;
+	int quiet;		// 4. set for a table a worker thread owns, so that nothing it does is printed
+} HashTable;
+
+// A compaction, from when the thread doing it starts to when the event loop swaps its file in. The thread
+// reads the database only up to snapshot, which nothing writes to any more, and writes only the new file
+typedef struct {
+	int running;		// 1. a thread is at work, or done and waiting for the swap
+	pthread_t thread;
+	int source_fd;		// 2. the database opened again for the thread, how far it had been written when the
+	off_t snapshot;		//    compaction started, and the keys in the index then, which the thread's table is
+	size_t keys;		//    made big enough for up front
+	char* path;		// 3. <database>.compact, the new file, written through fd, and the bytes of live records
+	int fd;			//    the thread wrote to it
+	off_t size;
+	HashTable* moved;	// 4. key -> offset of its value in the new file, for every key the thread copied
+	int error;		// 5. errno if the thread failed, 0 otherwise
+	int cancel;		// 6. set to stop the thread early, read and written with __atomic builtins
+	int event_fd;		// 7. written by the thread when it is done; the event loop watches it
+	long long retry_size;	// 8. after a failure, how big the database must grow before the next try
+} Compaction ;
+
+// The database: its file, only ever appended to, and the index of where each key's value is in it. A key set
+// twice is in the file twice, the index pointing at the later record; compaction drops the earlier ones
+typedef struct {
+	const char* path;	// 1. the database file's name, and the file, opened for appending
+	int fd;
+	off_t size;		// 2. bytes written to it
+	char* buf;		// 3. records set since the last flush, not in the file yet, and the room for them
+	size_t len;
+	HashTable* index;	// 4. key -> offset of the value of its latest record
+	char* map;		// 5. the file mapped for reading, map_len bytes of address space of which the first
+	size_t map_len;		//    size are the file; NULL if it could not be mapped and is read with pread(2)
+	long long live;		// 6. bytes of latest records, in the file or the buffer; the rest are stale
+	Compaction compaction;	// 7. the compaction under way, if any
+} Database ;
+
+// A client connection. Requests are handled as soon as a read completes their line, so a request cut in
+// two by the end of a read waits at the start of in for the rest of it
+typedef struct Conn {
+	int fd;			// 1. the client's socket
+	char in[IN_BUF_SIZE];	// 2. bytes read but not handled yet
+	size_t in_len;
+	char* out;		// 3. replies, written up to out_sent, with out_cap bytes of room
+	size_t out_len;
+	size_t out_sent;
+	size_t out_cap;
+	uint32_t events;	// 4. what epoll watches it for
+	int closing;		// 5. the client hung up or broke the protocol: close once the replies are out
+	int queued;		// 6. on the list of connections to write to at the end of this round, linked by next
+	struct Conn* next;
+} Conn ;
+
+// The server and everything its event loop watches
+typedef struct {
+	int listen_fd;		// 1. the UNIX domain socket clients connect to, and its path
+	const char* path;
+	int signal_fd;		// 2. delivers SIGQUIT
+	int epoll_fd;
+	Conn** conns;		// 3. connections by descriptor, room for conns_cap of them
+	int conns_cap;
+	Conn* queue;		// 4. connections with replies to write at the end of this round
+	Database db;		// 5. where the keys and values live
+	int running;
+} Server ;
+
+
+
+/* PROGRAM FUNCTIONS */
+
+int server_open(Server* server, const char* path);
+
+void server_run(Server* server);
+
+void server_close(Server* server);
+
+/* LOG-STRUCTURED DATABASE (kvlog.c) */
+int db_open(Database* db, FILE* database_fp, const char* database);
+
+int db_flush(Database* db);
+
+int db_get(Database* db, char* key, char* value);
+
+int db_set(Database* db, char* key, const char* value, size_t value_len);
+
+void db_compact(Database* db);
+
+void db_compact_finish(Database* db);
+
+void db_close(Database* db);
+
+/* INDEX (hashtable.c) */
+uint64_t hash_function(const char* key, size_t len);
+
+HashTable* create_hash_table();
+
+HashTable* create_hash_table_sized(size_t items);
+
+void rehash(HashTable* ht);
+
+long long set_item(HashTable* ht, const char* key, long long value);
+
+long long get_item(HashTable* ht, const char* key);
+
+void for_each_item(HashTable* ht, void (*visit)(KeyValuePair* pair, void* arg), void* arg);
+
+void free_ht(HashTable *ht);